@@ -0,0 +1,626 @@
+/*
+ * loadgen.c - load generator for the proxy, reporting throughput, latency
+ * quantiles, the hit ratio and what the proxy process used.
+ *
+ * Each connection is a thread with one request outstanding at a time.
+ * Closed loop (the default), it sends the next request as soon as the
+ * last response is in. Open loop (-r), the connections share a fixed
+ * request rate, and latency counts from when a request was due rather
+ * than when it went out, so a slow proxy is not hidden by the requests it
+ * held back.
+ *
+ * Requests are for http://origin/obj/<key>/<bytes>, with keys drawn from
+ * a Zipf distribution and each key's size from the -m mix, which the
+ * origin stand-in (origin.c) answers. The hit ratio comes from the
+ * proxy's /metrics (-a), CPU time and memory from /proc (-p).
+ *
+ *     make bench && ./loadgen [options] <proxy host:port> <origin host:port>
+ */
+#define _GNU_SOURCE
+#include "../http/http.h"
+#include "../rio/rio.h"
+#include "../sock_interface/sock_interface.h"
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXLINE 8192
+#define RESP_BUF 65536
+#define MAX_SIZES 16
+#define DEFAULT_MIX "512:30,4k:40,32k:25,256k:5"
+
+/* Latency histogram, log-linear like the proxy's own (metrics.h) */
+#define SUB_BITS 4
+#define SUB (1 << SUB_BITS)
+#define MAX_EXP 40
+#define BUCKETS (2 * SUB + (MAX_EXP - SUB_BITS) * SUB)
+
+typedef struct client {
+    pthread_t tid;
+    int id;
+    int fd;
+    unsigned long rng;
+    unsigned long requests, errors, bytes, max_ns;
+    unsigned long counts[BUCKETS];
+    char buf[RESP_BUF];
+} Client;
+
+/* A scrape of the proxy, at the start and the end of the measured run */
+typedef struct sample {
+    unsigned long hits, misses;
+    unsigned long cpu_ticks;
+} Sample;
+
+static char *proxy_host, *proxy_port, *origin_host, *origin_port;
+static int nconns = 16;
+static double rate;             /* Requests per second, 0: closed loop */
+static long nkeys = 10000;
+static double zipf_s = 0.99;
+static double *cdf;             /* Of the Zipf distribution over keys */
+static long *sizes;             /* Of each key */
+static unsigned long measure_start, measure_end; /* ns, CLOCK_MONOTONIC */
+static atomic_int stop;
+
+static void *client_loop(void *vargp);
+static int fetch(Client *cp, long key);
+static void record(Client *cp, unsigned long ns, long bytes);
+static long next_key(Client *cp);
+static unsigned long next_random(Client *cp);
+static int make_keys(const char *mix);
+static long parse_size(const char *s, char **end);
+static size_t bucket_of(unsigned long ns);
+static unsigned long bucket_max(size_t idx);
+static double quantile(unsigned long *counts, unsigned long total, double q,
+                       unsigned long max);
+static int scrape_metrics(char *port, Sample *sp);
+static int read_proc(long pid, Sample *sp, long *rss_kb, long *hwm_kb);
+static unsigned long now_ns(void);
+static void sleep_until(unsigned long ns);
+static int split_hostport(char *s, char **host, char **port);
+static void usage(char *prog);
+
+int
+main(int argc, char *argv[])
+{
+    double duration = 10, warmup = 2, secs;
+    char *mix = DEFAULT_MIX, *admin_port = NULL;
+    unsigned long counts[BUCKETS] = {0}, requests = 0, errors = 0, bytes = 0;
+    unsigned long max_ns = 0, start;
+    long pid = 0, rss_kb = 0, hwm_kb = 0;
+    Sample before = {0}, after = {0};
+    int opt, i, scraped = 0, proc = 0;
+    Client *clients;
+    size_t b;
+
+    while ((opt = getopt(argc, argv, "c:d:w:r:n:z:m:a:p:")) != -1) {
+        switch (opt) {
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'w':
+            warmup = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'n':
+            nkeys = atol(optarg);
+            break;
+        case 'z':
+            zipf_s = atof(optarg);
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 'a':
+            admin_port = optarg;
+            break;
+        case 'p':
+            pid = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2 || nconns < 1 || duration <= 0 || warmup < 0 ||
+        rate < 0 || nkeys < 1 || zipf_s < 0 ||
+        split_hostport(argv[optind], &proxy_host, &proxy_port) < 0 ||
+        split_hostport(argv[optind + 1], &origin_host, &origin_port) < 0) {
+        usage(argv[0]);
+    }
+    if (make_keys(mix) < 0) {
+        fprintf(stderr, "bad size mix or out of memory: %s\n", mix);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((clients = calloc(nconns, sizeof(Client))) == NULL) {
+        fprintf(stderr, "%s: %s\n", "calloc error", strerror(errno));
+        exit(1);
+    }
+    start = now_ns();
+    measure_start = start + (unsigned long)(warmup * 1e9);
+    measure_end = measure_start + (unsigned long)(duration * 1e9);
+    for (i = 0; i < nconns; i++) {
+        clients[i].id = i;
+        clients[i].fd = -1;
+        clients[i].rng = 0x9e3779b97f4a7c15UL * (i + 1);
+        if (pthread_create(&clients[i].tid, NULL, client_loop,
+                           &clients[i]) != 0) {
+            fprintf(stderr, "%s: %s\n", "pthread_create error",
+                    strerror(errno));
+            exit(1);
+        }
+    }
+
+    sleep_until(measure_start);
+    scraped = admin_port && scrape_metrics(admin_port, &before) == 0;
+    proc = pid && read_proc(pid, &before, &rss_kb, &hwm_kb) == 0;
+    sleep_until(measure_end);
+    scraped = scraped && scrape_metrics(admin_port, &after) == 0;
+    proc = proc && read_proc(pid, &after, &rss_kb, &hwm_kb) == 0;
+    atomic_store(&stop, 1);
+
+    for (i = 0; i < nconns; i++) {
+        pthread_join(clients[i].tid, NULL);
+        for (b = 0; b < BUCKETS; b++) {
+            counts[b] += clients[i].counts[b];
+        }
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        if (clients[i].max_ns > max_ns) {
+            max_ns = clients[i].max_ns;
+        }
+    }
+
+    secs = duration;
+    printf("mode          %s, %d connections, %ld keys, zipf %.2f\n",
+           rate > 0 ? "open loop" : "closed loop", nconns, nkeys, zipf_s);
+    printf("requests      %lu (%lu errors) in %.1f s\n", requests, errors,
+           secs);
+    printf("throughput    %.1f req/s, %.2f MB/s\n", requests / secs,
+           bytes / secs / (1 << 20));
+    printf("latency       p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f "
+           "ms\n",
+           quantile(counts, requests, 0.5, max_ns) / 1e6,
+           quantile(counts, requests, 0.99, max_ns) / 1e6,
+           quantile(counts, requests, 0.999, max_ns) / 1e6, max_ns / 1e6);
+    if (scraped && after.hits + after.misses > before.hits + before.misses) {
+        printf("hit ratio     %.3f\n",
+               (double)(after.hits - before.hits) /
+                   (after.hits - before.hits + after.misses - before.misses));
+    }
+    if (proc) {
+        printf("proxy         cpu %.1f%%, rss %.1f MB, peak rss %.1f MB\n",
+               100.0 * (after.cpu_ticks - before.cpu_ticks) /
+                   sysconf(_SC_CLK_TCK) / secs,
+               rss_kb / 1024.0, hwm_kb / 1024.0);
+    }
+    return 0;
+}
+
+/*
+ * client_loop - One connection's requests, until the run is over
+ */
+static void *
+client_loop(void *vargp)
+{
+    Client *cp = (Client *)vargp;
+    unsigned long interval = 0, due, sent, done;
+    long key;
+    int rc;
+
+    if (rate > 0) {
+        /* Each connection's share of the rate, staggered between them */
+        interval = 1e9 * nconns / rate;
+    }
+    due = now_ns() + interval * cp->id / nconns;
+    while (!atomic_load(&stop)) {
+        if (interval) {
+            sleep_until(due);
+        }
+        key = next_key(cp);
+        sent = now_ns();
+        rc = fetch(cp, key);
+        done = now_ns();
+        if (rc < 0) {
+            if (sent >= measure_start && done <= measure_end) {
+                cp->errors++;
+            }
+            close(cp->fd);
+            cp->fd = -1;
+            due += interval;
+            continue;
+        }
+        if (rc == 0) {
+            close(cp->fd);
+            cp->fd = -1;
+        }
+        if (interval) {
+            sent = due; /* Waiting to be sent counts too */
+            due += interval;
+        }
+        if (sent >= measure_start && done <= measure_end) {
+            record(cp, done - sent, sizes[key]);
+        }
+    }
+    if (cp->fd >= 0) {
+        close(cp->fd);
+    }
+    return NULL;
+}
+
+/*
+ * fetch - Get key through the proxy, reading the whole body. Returns 1 if
+ *     the connection can be used again, 0 if not, -1 on error or a status
+ *     other than 200.
+ */
+static int
+fetch(Client *cp, long key)
+{
+    char req[MAXLINE];
+    size_t len = 0;
+    ssize_t n, body;
+    HttpHead resp;
+    int rc;
+
+    if (cp->fd < 0 && (cp->fd = open_clientfd(proxy_host, proxy_port)) < 0) {
+        return -1;
+    }
+    n = snprintf(req, sizeof(req),
+                 "GET http://%s:%s/obj/%ld/%ld HTTP/1.1\r\n"
+                 "Host: %s:%s\r\n\r\n",
+                 origin_host, origin_port, key, sizes[key], origin_host,
+                 origin_port);
+    if (rio_writen(cp->fd, req, n) < 0) {
+        return -1;
+    }
+
+    http_init(&resp);
+    while ((rc = http_parse(&resp, cp->buf, len)) == 0) {
+        if (len == sizeof(cp->buf) ||
+            (n = read(cp->fd, cp->buf + len, sizeof(cp->buf) - len)) <= 0) {
+            return -1;
+        }
+        len += n;
+    }
+    if (rc < 0 || resp.status != 200 ||
+        (body = http_body_length(&resp, cp->buf)) < 0) {
+        return -1;
+    }
+    for (body -= len - resp.len; body > 0; body -= n) {
+        n = body < (ssize_t)sizeof(cp->buf) ? body : (ssize_t)sizeof(cp->buf);
+        if ((n = read(cp->fd, cp->buf, n)) <= 0) {
+            return -1;
+        }
+    }
+    return resp.minor == 1
+               ? !http_has_token(&resp, cp->buf, HDR_CONNECTION, "close")
+               : http_has_token(&resp, cp->buf, HDR_CONNECTION, "keep-alive");
+}
+
+static void
+record(Client *cp, unsigned long ns, long bytes)
+{
+    cp->counts[bucket_of(ns)]++;
+    cp->requests++;
+    cp->bytes += bytes;
+    if (ns > cp->max_ns) {
+        cp->max_ns = ns;
+    }
+}
+
+/*
+ * next_key - A key, 0 the most popular, drawn from the Zipf distribution
+ */
+static long
+next_key(Client *cp)
+{
+    double u = (next_random(cp) >> 11) * (1.0 / (1UL << 53));
+    long lo = 0, hi = nkeys - 1, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * next_random - xorshift64*
+ */
+static unsigned long
+next_random(Client *cp)
+{
+    cp->rng ^= cp->rng >> 12;
+    cp->rng ^= cp->rng << 25;
+    cp->rng ^= cp->rng >> 27;
+    return cp->rng * 0x2545f4914f6cdd1dUL;
+}
+
+/*
+ * make_keys - The Zipf distribution over nkeys, and each key's size from
+ *     mix ("size:weight,..."), picked by a hash of the key so it does not
+ *     follow popularity. Returns -1 if mix does not parse.
+ */
+static int
+make_keys(const char *mix)
+{
+    long mix_sizes[MAX_SIZES], weights[MAX_SIZES], total = 0, pick;
+    unsigned long h;
+    double sum = 0;
+    char *p = (char *)mix;
+    int nsizes = 0, j;
+    long i;
+
+    while (*p && nsizes < MAX_SIZES) {
+        if ((mix_sizes[nsizes] = parse_size(p, &p)) < 0 || *p++ != ':' ||
+            (weights[nsizes] = strtol(p, &p, 10)) <= 0 ||
+            (*p != ',' && *p != '\0')) {
+            return -1;
+        }
+        total += weights[nsizes++];
+        if (*p == ',') {
+            p++;
+        }
+    }
+    if (nsizes == 0 || *p ||
+        (cdf = malloc(nkeys * sizeof(double))) == NULL ||
+        (sizes = malloc(nkeys * sizeof(long))) == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < nkeys; i++) {
+        sum += 1.0 / pow(i + 1, zipf_s);
+        cdf[i] = sum;
+
+        /* splitmix64 of the key */
+        h = (i + 1) * 0x9e3779b97f4a7c15UL;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9UL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebUL;
+        pick = (h ^ (h >> 31)) % total;
+        for (j = 0; pick >= weights[j]; j++) {
+            pick -= weights[j];
+        }
+        sizes[i] = mix_sizes[j];
+    }
+    for (i = 0; i < nkeys; i++) {
+        cdf[i] /= sum;
+    }
+    return 0;
+}
+
+/*
+ * parse_size - A byte count with an optional K, M or G suffix, setting
+ *     *end past it. Returns -1 if there is none.
+ */
+static long
+parse_size(const char *s, char **end)
+{
+    long size = strtol(s, end, 10);
+
+    if (*end == s || size < 0) {
+        return -1;
+    }
+    switch (**end) {
+    case 'k':
+    case 'K':
+        (*end)++;
+        return size << 10;
+    case 'm':
+    case 'M':
+        (*end)++;
+        return size << 20;
+    case 'g':
+    case 'G':
+        (*end)++;
+        return size << 30;
+    }
+    return size;
+}
+
+static size_t
+bucket_of(unsigned long ns)
+{
+    int e;
+
+    if (ns < 2 * SUB) {
+        return ns;
+    }
+    e = 63 - __builtin_clzl(ns); /* ns is in [2^e, 2^(e+1)) */
+    if (e >= MAX_EXP) {
+        return BUCKETS - 1;
+    }
+    return 2 * SUB + (e - SUB_BITS - 1) * SUB +
+           ((ns >> (e - SUB_BITS)) & (SUB - 1));
+}
+
+/*
+ * bucket_max - The largest value counted in bucket idx
+ */
+static unsigned long
+bucket_max(size_t idx)
+{
+    size_t group, sub;
+
+    if (idx < 2 * SUB) {
+        return idx;
+    }
+    group = (idx - 2 * SUB) / SUB;
+    sub = (idx - 2 * SUB) % SUB;
+    return ((SUB + sub + 1UL) << (group + 1)) - 1;
+}
+
+/*
+ * quantile - The value below which q of the total counts fall, in ns, as
+ *     the upper bound of its bucket but no more than max
+ */
+static double
+quantile(unsigned long *counts, unsigned long total, double q,
+         unsigned long max)
+{
+    unsigned long rank = ceil(q * total), cum = 0;
+    size_t i;
+
+    for (i = 0; i < BUCKETS && total; i++) {
+        if ((cum += counts[i]) >= rank) {
+            return bucket_max(i) < max ? bucket_max(i) : max;
+        }
+    }
+    return 0;
+}
+
+/*
+ * scrape_metrics - Read the cache's hits and misses from the proxy's
+ *     /metrics on localhost:port
+ */
+static int
+scrape_metrics(char *port, Sample *sp)
+{
+    static const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    char *buf, *p;
+    size_t len = 0, size = 1 << 16;
+    ssize_t n;
+    int fd, rc = -1;
+
+    if ((fd = open_clientfd("127.0.0.1", port)) < 0) {
+        return -1;
+    }
+    if ((buf = malloc(size)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    if (rio_writen(fd, (void *)req, sizeof(req) - 1) == sizeof(req) - 1) {
+        while ((n = read(fd, buf + len, size - 1 - len)) > 0) {
+            len += n;
+            if (len == size - 1 && (p = realloc(buf, size *= 2)) != NULL) {
+                buf = p;
+            } else if (len == size - 1) {
+                break;
+            }
+        }
+        buf[len] = '\0';
+        if ((p = strstr(buf, "proxy_cache_lookups_total{result=\"hit\"}")) &&
+            sscanf(strchr(p, '}') + 1, "%lu", &sp->hits) == 1 &&
+            (p = strstr(buf, "proxy_cache_lookups_total{result=\"miss\"}")) &&
+            sscanf(strchr(p, '}') + 1, "%lu", &sp->misses) == 1) {
+            rc = 0;
+        }
+    }
+    free(buf);
+    close(fd);
+    return rc;
+}
+
+/*
+ * read_proc - The CPU time the process pid has used, and its resident
+ *     memory now and at its peak
+ */
+static int
+read_proc(long pid, Sample *sp, long *rss_kb, long *hwm_kb)
+{
+    char path[64], line[MAXLINE], *p;
+    unsigned long utime, stime;
+    FILE *fp;
+    int found = 0;
+
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    /* The command name may hold spaces, the fields start after it */
+    if (fgets(line, sizeof(line), fp) == NULL ||
+        (p = strrchr(line, ')')) == NULL ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime) != 2) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    sp->cpu_ticks = utime + stime;
+
+    snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        found += sscanf(line, "VmRSS: %ld", rss_kb) == 1;
+        found += sscanf(line, "VmHWM: %ld", hwm_kb) == 1;
+    }
+    fclose(fp);
+    return found == 2 ? 0 : -1;
+}
+
+static unsigned long
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+sleep_until(unsigned long ns)
+{
+    struct timespec ts = {.tv_sec = ns / 1000000000UL,
+                          .tv_nsec = ns % 1000000000UL};
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR)
+        ;
+}
+
+/*
+ * split_hostport - Split "host:port" in place
+ */
+static int
+split_hostport(char *s, char **host, char **port)
+{
+    char *colon = strrchr(s, ':');
+
+    if (colon == NULL || colon == s || colon[1] == '\0') {
+        return -1;
+    }
+    *colon = '\0';
+    *host = s;
+    *port = colon + 1;
+    return 0;
+}
+
+static void
+usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [options] <proxy host:port> "
+                    "<origin host:port>\n",
+            prog);
+    fprintf(stderr, "  -c  connections, each with a request outstanding "
+                    "(default: 16)\n");
+    fprintf(stderr, "  -d  seconds measured (default: 10)\n");
+    fprintf(stderr, "  -w  seconds of warmup before that (default: 2)\n");
+    fprintf(stderr, "  -r  requests per second, open loop (default: closed "
+                    "loop)\n");
+    fprintf(stderr, "  -n  distinct URLs (default: 10000)\n");
+    fprintf(stderr, "  -z  Zipf exponent of their popularity (default: "
+                    "0.99)\n");
+    fprintf(stderr, "  -m  body sizes and their weights (default: %s)\n",
+            DEFAULT_MIX);
+    fprintf(stderr, "  -a  the proxy's metrics port, for the hit ratio\n");
+    fprintf(stderr, "  -p  the proxy's pid, for its CPU and memory use\n");
+    exit(1);
+}
@@ -0,0 +1,237 @@
+/*
+ * origin.c - a fast local stand-in for origin servers, for benchmarks.
+ *
+ * GET /<anything>/<bytes> is answered with that many bytes, after the
+ * configured latency, with a Content-Length and a Cache-Control max-age,
+ * on a persistent connection. A thread per connection, so the latency of
+ * one response holds up no other client.
+ *
+ *     make bench && ./origin [-l ms] [-j ms] [-m max-age] [-s bytes] port
+ */
+#define _GNU_SOURCE
+#include "../http/http.h"
+#include "../rio/rio.h"
+#include "../sock_interface/sock_interface.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXLINE 8192
+#define BODY_CHUNK (256 * 1024) /* Bodies are written this much at a time */
+#define DEFAULT_SIZE 1024       /* For a target without a size */
+#define DEFAULT_MAX_AGE 3600
+
+static long latency_ms, jitter_ms, max_age = DEFAULT_MAX_AGE;
+static long default_size = DEFAULT_SIZE;
+static char body[BODY_CHUNK];
+
+static void *serve_conn(void *vargp);
+static int respond(int connfd, HttpHead *hp, char *head);
+static long target_size(HttpHead *hp, char *head);
+static void delay(unsigned int *seed);
+static void usage(char *prog);
+
+int
+main(int argc, char *argv[])
+{
+    int listenfd, connfd, *fdp, opt, one = 1;
+    pthread_t tid;
+
+    while ((opt = getopt(argc, argv, "l:j:m:s:")) != -1) {
+        switch (opt) {
+        case 'l':
+            latency_ms = atol(optarg);
+            break;
+        case 'j':
+            jitter_ms = atol(optarg);
+            break;
+        case 'm':
+            max_age = atol(optarg);
+            break;
+        case 's':
+            default_size = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || latency_ms < 0 || jitter_ms < 0 ||
+        max_age < 0 || default_size < 0) {
+        usage(argv[0]);
+    }
+    memset(body, 'x', sizeof(body));
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((listenfd = open_listenfd(argv[optind])) < 0) {
+        fprintf(stderr, "%s: %s\n", "open_listenfd error", strerror(errno));
+        exit(-1);
+    }
+    while (1) {
+        if ((connfd = accept(listenfd, NULL, NULL)) < 0) {
+            continue;
+        }
+        /* Responses are written whole, nothing to gain from waiting */
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if ((fdp = malloc(sizeof(int))) == NULL) {
+            close(connfd);
+            continue;
+        }
+        *fdp = connfd;
+        if (pthread_create(&tid, NULL, serve_conn, fdp) != 0) {
+            close(connfd);
+            free(fdp);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
+
+/*
+ * serve_conn - Answer the requests on a connection until it closes
+ */
+static void *
+serve_conn(void *vargp)
+{
+    int connfd = *(int *)vargp;
+    unsigned int seed = connfd;
+    char buf[MAXLINE];
+    size_t len = 0;
+    ssize_t n;
+    HttpHead req;
+    int rc;
+
+    free(vargp);
+    http_init(&req);
+    while (1) {
+        if ((rc = http_parse(&req, buf, len)) < 0) {
+            break;
+        }
+        if (rc == 0) {
+            if (len == sizeof(buf) ||
+                (n = read(connfd, buf + len, sizeof(buf) - len)) <= 0) {
+                break;
+            }
+            len += n;
+            continue;
+        }
+
+        delay(&seed);
+        if (respond(connfd, &req, buf) <= 0) {
+            break;
+        }
+        /* A pipelined request may follow the head */
+        len -= req.len;
+        memmove(buf, buf + req.len, len);
+        http_init(&req);
+    }
+    close(connfd);
+    return NULL;
+}
+
+/*
+ * respond - Send the response to the request in head. Returns 1 if the
+ *     connection stays open, 0 if it closes, -1 on error.
+ */
+static int
+respond(int connfd, HttpHead *hp, char *head)
+{
+    char hdrs[MAXLINE];
+    long size = target_size(hp, head), left, n;
+    struct iovec iov[2];
+    int keepalive, len;
+
+    keepalive = hp->minor == 1
+                    ? !http_has_token(hp, head, HDR_CONNECTION, "close")
+                    : http_has_token(hp, head, HDR_CONNECTION, "keep-alive");
+    if (max_age > 0) {
+        len = snprintf(hdrs, sizeof(hdrs),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: application/octet-stream\r\n"
+                       "Content-Length: %ld\r\n"
+                       "Cache-Control: max-age=%ld\r\n"
+                       "Connection: %s\r\n\r\n",
+                       size, max_age, keepalive ? "keep-alive" : "close");
+    } else {
+        len = snprintf(hdrs, sizeof(hdrs),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: application/octet-stream\r\n"
+                       "Content-Length: %ld\r\n"
+                       "Cache-Control: no-store\r\n"
+                       "Connection: %s\r\n\r\n",
+                       size, keepalive ? "keep-alive" : "close");
+    }
+    /* The head goes out with the start of the body */
+    n = size < BODY_CHUNK ? size : BODY_CHUNK;
+    iov[0].iov_base = hdrs;
+    iov[0].iov_len = len;
+    iov[1].iov_base = body;
+    iov[1].iov_len = n;
+    if (rio_writevn(connfd, iov, 2) < 0) {
+        return -1;
+    }
+    for (left = size - n; left > 0; left -= n) {
+        n = left < BODY_CHUNK ? left : BODY_CHUNK;
+        if (rio_writen(connfd, body, n) < 0) {
+            return -1;
+        }
+    }
+    return keepalive;
+}
+
+/*
+ * target_size - The number after the last slash of the request target, or
+ *     default_size if there is none
+ */
+static long
+target_size(HttpHead *hp, char *head)
+{
+    char *target = head + hp->start[1].off, *end = target + hp->start[1].len;
+    char *p = end, *stop;
+    long size;
+
+    while (p > target && p[-1] != '/') {
+        p--;
+    }
+    size = strtol(p, &stop, 10);
+    return stop == end && stop > p && size >= 0 ? size : default_size;
+}
+
+/*
+ * delay - Wait latency_ms, plus up to jitter_ms more
+ */
+static void
+delay(unsigned int *seed)
+{
+    long ms = latency_ms + (jitter_ms ? rand_r(seed) % (jitter_ms + 1) : 0);
+    struct timespec ts = {.tv_sec = ms / 1000,
+                          .tv_nsec = (ms % 1000) * 1000000L};
+
+    if (ms > 0) {
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+static void
+usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-l ms] [-j ms] [-m max-age] [-s bytes] "
+                    "<port>\n",
+            prog);
+    fprintf(stderr, "  -l  latency before each response (default: 0)\n");
+    fprintf(stderr, "  -j  up to this much more, at random (default: 0)\n");
+    fprintf(stderr, "  -m  max-age of the responses, 0 for no-store "
+                    "(default: %d)\n",
+            DEFAULT_MAX_AGE);
+    fprintf(stderr, "  -s  body size for a target that does not end in one "
+                    "(default: %d)\n",
+            DEFAULT_SIZE);
+    exit(1);
+}
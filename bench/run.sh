@@ -0,0 +1,47 @@
+#!/bin/bash
+#
+# run.sh - Benchmark the proxy against the local origin stand-in.
+#
+# Starts ./origin and ./proxy on free ports, runs ./loadgen through the
+# proxy with its metrics port and pid, so the report has the hit ratio
+# and the proxy's CPU and memory, then stops both.
+#
+#     make perf
+#     PROXY_OPTS="-m thread -p tinylfu" LOAD_OPTS="-r 5000 -c 64" ./bench/run.sh
+#
+# ORIGIN_OPTS, PROXY_OPTS and LOAD_OPTS are passed to each program, see
+# their usage for the options.
+
+cd "$(dirname "$0")/.." || exit 1
+
+free_port() {
+    while true; do
+        port=$((20000 + RANDOM % 20000))
+        if ! (exec 3<>/dev/tcp/127.0.0.1/$port) 2>/dev/null; then
+            echo $port
+            return
+        fi
+    done
+}
+
+for prog in proxy loadgen origin; do
+    if [ ! -x ./$prog ]; then
+        echo "$prog not built, run make bench proxy"
+        exit 1
+    fi
+done
+
+ORIGIN_PORT=$(free_port)
+PROXY_PORT=$(free_port)
+ADMIN_PORT=$(free_port)
+
+./origin $ORIGIN_OPTS $ORIGIN_PORT &
+ORIGIN_PID=$!
+./proxy $PROXY_OPTS -a $ADMIN_PORT $PROXY_PORT > /dev/null &
+PROXY_PID=$!
+trap 'kill $ORIGIN_PID $PROXY_PID 2> /dev/null' EXIT
+sleep 1
+
+echo "origin $ORIGIN_OPTS, proxy $PROXY_OPTS, loadgen $LOAD_OPTS"
+./loadgen $LOAD_OPTS -a $ADMIN_PORT -p $PROXY_PID \
+    localhost:$PROXY_PORT localhost:$ORIGIN_PORT
@@ -0,0 +1,183 @@
+/*
+ * scan_bench.c - heads parsed per second, the way the proxy used to read
+ * them and with the in-place parser on each scan_char() implementation.
+ *
+ * The old way is replayed from memory: rio_readlineb() taking one byte at
+ * a time, each line appended to the headers string, then strcasestr() for
+ * the headers the proxy looks at. The new way is http_parse() and the
+ * same lookups through the known field table.
+ *
+ *     make bench && ./scan_bench [seconds per run]
+ */
+#define _GNU_SOURCE
+#include "../http/http.h"
+#include "../scan/scan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAXLINE 8192
+
+typedef struct head_set {
+    const char *name;
+    const char *head;
+} HeadSet;
+
+static double run(const char *head, size_t len, int legacy, double secs,
+                  long *sink);
+static long legacy_parse(const char *head, size_t len);
+static long http_parse_once(const char *head, size_t len);
+static double now(void);
+
+static const HeadSet sets[] = {
+    {"request",
+     "GET http://www.example.com/static/js/app.3f9c2d1e.js HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 "
+     "Firefox/115.0\r\n"
+     "Accept: */*\r\n"
+     "Accept-Language: en-US,en;q=0.5\r\n"
+     "Accept-Encoding: gzip, deflate\r\n"
+     "Referer: http://www.example.com/products/list?page=2&sort=price\r\n"
+     "Connection: keep-alive\r\n"
+     "Cookie: session=8f2a9c3b7d1e4f60a5b2c8d9e0f1a2b3; theme=dark; "
+     "lang=en\r\n"
+     "Sec-Fetch-Dest: script\r\n"
+     "Sec-Fetch-Mode: no-cors\r\n"
+     "Sec-Fetch-Site: same-origin\r\n"
+     "If-None-Match: \"5f3e-1a2b3c4d\"\r\n"
+     "\r\n"},
+    {"response",
+     "HTTP/1.1 200 OK\r\n"
+     "Date: Sat, 18 Oct 2025 10:21:07 GMT\r\n"
+     "Server: nginx/1.24.0\r\n"
+     "Content-Type: application/javascript; charset=utf-8\r\n"
+     "Content-Length: 48213\r\n"
+     "Last-Modified: Tue, 14 Oct 2025 08:02:11 GMT\r\n"
+     "Connection: keep-alive\r\n"
+     "ETag: \"5f3e-1a2b3c4d\"\r\n"
+     "Cache-Control: public, max-age=31536000, immutable\r\n"
+     "Vary: Accept-Encoding\r\n"
+     "X-Content-Type-Options: nosniff\r\n"
+     "Accept-Ranges: bytes\r\n"
+     "\r\n"},
+    {"response+cookies",
+     "HTTP/1.1 200 OK\r\n"
+     "Date: Sat, 18 Oct 2025 10:21:07 GMT\r\n"
+     "Server: Apache\r\n"
+     "Content-Type: text/html; charset=UTF-8\r\n"
+     "Transfer-Encoding: chunked\r\n"
+     "Set-Cookie: a=0123456789abcdef0123456789abcdef0123456789abcdef0123456789"
+     "abcdef; Path=/; HttpOnly; Secure; SameSite=Lax\r\n"
+     "Set-Cookie: b=0123456789abcdef0123456789abcdef0123456789abcdef0123456789"
+     "abcdef; Path=/; HttpOnly; Secure; SameSite=Lax\r\n"
+     "Set-Cookie: c=0123456789abcdef0123456789abcdef0123456789abcdef0123456789"
+     "abcdef; Path=/; HttpOnly; Secure; SameSite=Lax\r\n"
+     "Content-Security-Policy: default-src 'self'; script-src 'self' "
+     "https://cdn.example.com; img-src 'self' data: https:; style-src 'self' "
+     "'unsafe-inline'; frame-ancestors 'none'\r\n"
+     "Strict-Transport-Security: max-age=63072000; includeSubDomains; "
+     "preload\r\n"
+     "Cache-Control: private, no-cache\r\n"
+     "Connection: close\r\n"
+     "\r\n"},
+};
+
+int
+main(int argc, char *argv[])
+{
+    double secs = argc > 1 ? atof(argv[1]) : 1.0;
+    int best = scan_select(SCAN_AVX2), level;
+    size_t i;
+    long sink = 0;
+
+    printf("%-18s %-17s %14s\n", "head", "method", "heads/s");
+    for (i = 0; i < sizeof(sets) / sizeof(sets[0]); i++) {
+        size_t len = strlen(sets[i].head);
+
+        printf("%-18s %-17s %14.0f\n", sets[i].name, "readline+sprintf",
+               run(sets[i].head, len, 1, secs, &sink));
+        for (level = SCAN_SCALAR; level <= best; level++) {
+            scan_select(level);
+            printf("%-18s http_parse/%-6s %14.0f\n", sets[i].name,
+                   scan_name(level), run(sets[i].head, len, 0, secs, &sink));
+        }
+        scan_select(best);
+    }
+    return sink == 42; /* Keeps the work from being optimized away */
+}
+
+static double
+run(const char *head, size_t len, int legacy, double secs, long *sink)
+{
+    double start = now(), elapsed;
+    long n = 0;
+    int i;
+
+    do {
+        for (i = 0; i < 1000; i++) {
+            *sink += legacy ? legacy_parse(head, len)
+                            : http_parse_once(head, len);
+        }
+        n += 1000;
+    } while ((elapsed = now() - start) < secs);
+    return n / elapsed;
+}
+
+/*
+ * legacy_parse - What read_request() and response_length() used to do
+ */
+static long
+legacy_parse(const char *head, size_t len)
+{
+    char headers[MAXLINE], line[MAXLINE], *p;
+    size_t pos = 0, n;
+    long found = 0;
+
+    headers[0] = '\0';
+    while (pos < len) {
+        /* One byte at a time, as rio_readlineb() did through rio_read() */
+        for (n = 0; pos < len && n < sizeof(line) - 1;) {
+            memcpy(&line[n++], &head[pos++], 1);
+            if (line[n - 1] == '\n') {
+                break;
+            }
+        }
+        line[n] = '\0';
+        strcat(headers, line); /* sprintf(headers, "%s%s", headers, ...) */
+    }
+
+    found += strcasestr(headers, "\nhost:") != NULL;
+    found += strcasestr(headers, "\nconnection:") != NULL;
+    found += strcasestr(headers, "\ntransfer-encoding:") != NULL;
+    if ((p = strcasestr(headers, "\ncontent-length:"))) {
+        found += atol(p + strlen("\ncontent-length:"));
+    }
+    return found;
+}
+
+static long
+http_parse_once(const char *head, size_t len)
+{
+    HttpHead h;
+    long found = 0;
+
+    http_init(&h);
+    if (http_parse(&h, head, len) != 1) {
+        return -1;
+    }
+    found += h.known[HDR_HOST] >= 0;
+    found += http_has_token(&h, head, HDR_CONNECTION, "close");
+    found += http_body_length(&h, head);
+    return found;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -1,168 +1,800 @@
 #include "cache.h"
-#include <semaphore.h>
+#include "disk.h"
+#include "policy.h"
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#define DEMOTE_MAX 16 /* Evicted objects one insertion moves to disk */
+
+/* Objects evicted under a shard lock, written to disk once it is dropped */
+typedef struct demote {
+    CacheObjectPtr ops[DEMOTE_MAX];
+    time_t expires[DEMOTE_MAX];
+    int n;
+} Demote;
 
 static unsigned long long generate_tag(const char *request);
-static int find_empty_line(CachePtr cp);
-static unsigned int find_victim(CachePtr cp);
-static void free_line(CachePtr cp, unsigned int idx);
-static int find_line(CachePtr cp, unsigned long long tag);
+static CacheShardPtr find_shard(CachePtr cp, unsigned long long tag);
+static int shard_init(CachePtr cp, CacheShardPtr sp, size_t nlines,
+                      size_t budget);
+static long find_line(CacheShardPtr sp, unsigned long long tag,
+                      const char *request);
+static long find_slot(CacheShardPtr sp, CacheLinePtr line);
+static void index_remove(CacheShardPtr sp, size_t idx);
+static int evict_line(CachePtr cp, CacheShardPtr sp, size_t incoming,
+                      Demote *dm);
+static void demote(CachePtr cp, Demote *dm);
+static CacheObjectPtr promote(CachePtr cp, char *request, CacheObjectPtr op,
+                              time_t expires);
+static int memory_write(CachePtr cp, char *request, char *response_hdrs,
+                        char *content, size_t content_length, time_t expires,
+                        int replace);
+static void memory_remove(CachePtr cp, char *request);
+static void free_line(CachePtr cp, CacheShardPtr sp, CacheLinePtr line);
+static CacheObjectPtr object_alloc(CachePtr cp, CacheShardPtr sp,
+                                   size_t size, Demote *dm);
+static void object_evict(void *arg, void *item);
 
-static unsigned long long time = 0;
-sem_t time_mutex;
+#define FILL_MINSIZE 8192 /* First allocation for bodies of unknown length */
 
-void
-cache_init(CachePtr cp)
+/*
+ * cache_init - Set up an empty cache as described by opts. Its lines and
+ *     its max_size bytes are split evenly over nshards shards (rounded up
+ *     to a power of two), and the objects live in an arena of max_size
+ *     bytes mapped once here, managed by mm.c or by slab.c. Lines are
+ *     evicted as the policy says, see policy.c, to the disk tier if there
+ *     is one.
+ */
+int
+cache_init(CachePtr cp, CacheOptsPtr opts)
 {
-    cp->readcnt = 0;
-    sem_init(&cp->readcnt_mutex, 0, 1);
-    sem_init(&cp->write_mutex, 0, 1);
-    sem_init(&time_mutex, 0, 1);
-    memset(cp->cache_set, 0, sizeof(cp->cache_set));
-    mm_init();
+    size_t n = 1, i, per_shard;
+
+    while (n < opts->nshards) {
+        n <<= 1;
+    }
+    if ((cp->shards = aligned_alloc(sizeof(CacheShard),
+                                    n * sizeof(CacheShard))) == NULL) {
+        return -1;
+    }
+    cp->nshards = n;
+    cp->max_size = opts->max_size;
+    cp->max_object = opts->max_object;
+    cp->max_fill = opts->max_object;
+    cp->heuristic = opts->heuristic;
+    cp->engine = opts->engine;
+    if ((cp->policy = policy_get(opts->policy)) == NULL) {
+        return -1;
+    }
+    if (flight_init(&cp->flights) < 0) {
+        return -1;
+    }
+    cp->disk = NULL;
+    if (opts->disk_dir) {
+        if ((cp->disk = malloc(sizeof(Disk))) == NULL ||
+            disk_init(cp->disk, opts->disk_dir, opts->disk_size) < 0) {
+            return -1;
+        }
+        if (cp->disk->seg_size > cp->max_fill) {
+            cp->max_fill = cp->disk->seg_size;
+        }
+    }
+
+    per_shard = (opts->nlines + n - 1) / n;
+    for (i = 0; i < n; i++) {
+        if (shard_init(cp, &cp->shards[i], per_shard, cp->max_size / n) <
+            0) {
+            return -1;
+        }
+    }
+
+    if (cp->engine == CACHE_ENGINE_SLAB) {
+        return slab_init(&cp->slab, cp->max_size,
+                         sizeof(CacheObject) + cp->max_object + OBJECT_SLACK,
+                         opts->slab_policy, opts->arena_flags, object_evict,
+                         cp);
+    }
+    return mm_init(cp->max_size, opts->arena_flags);
 }
 
-ssize_t
-cache_read(CachePtr cp, char *request, char **response_hdrs, char **content)
+static int
+shard_init(CachePtr cp, CacheShardPtr sp, size_t nlines, size_t budget)
 {
-    int idx;
-    unsigned long long tag = generate_tag(request);
-    ssize_t content_length;
+    size_t nslots = 2, i;
 
-    sem_wait(&cp->readcnt_mutex);
-    cp->readcnt++;
-    if (cp->readcnt == 1) { /* First in */
-        sem_wait(&cp->write_mutex);
+    while (nslots < 2 * nlines) {
+        nslots <<= 1;
     }
-    sem_post(&cp->readcnt_mutex);
+    memset(sp, 0, sizeof(CacheShard));
+    sp->lines = calloc(nlines, sizeof(CacheLine));
+    sp->slots = calloc(nslots, sizeof(CacheLinePtr));
+    if (sp->lines == NULL || sp->slots == NULL) {
+        return -1;
+    }
+    sp->nlines = nlines;
+    sp->mask = nslots - 1;
+    sp->budget = budget;
+
+    for (i = 0; i < nlines; i++) {
+        sp->lines[i].next = sp->free_lines;
+        sp->free_lines = &sp->lines[i];
+    }
+    if (cp->policy->init(sp) < 0) {
+        return -1;
+    }
+    return pthread_rwlock_init(&sp->lock, NULL) ? -1 : 0;
+}
 
-    if ((idx = find_line(cp, tag)) < 0) {
-        content_length = -1;
+/*
+ * cache_read - Look up request, in memory and then on disk. On a hit the
+ *     object comes back with a reference held for the caller, to be
+ *     dropped with cache_release() once it has been sent; nothing is
+ *     copied. *expires tells until when it is fresh; after that the
+ *     caller revalidates it. A disk object hit often enough moves back to
+ *     memory. Returns NULL on a miss.
+ */
+CacheObjectPtr
+cache_read(CachePtr cp, char *request, time_t *expires)
+{
+    long idx;
+    unsigned long long tag = generate_tag(request);
+    CacheShardPtr sp = find_shard(cp, tag);
+    CacheObjectPtr op = NULL;
+    CacheLinePtr line;
+    unsigned int hits;
+
+    pthread_rwlock_rdlock(&sp->lock);
+
+    if ((idx = find_line(sp, tag, request)) >= 0) {
+        line = sp->slots[idx];
+        op = line->object;
+        atomic_fetch_add(&op->refcnt, 1);
+        *expires = atomic_load_explicit(&line->expires, memory_order_relaxed);
+        cp->policy->access(sp, line, tag);
     } else {
-        *response_hdrs = strdup(cp->cache_set[idx].response_hdr);
-        content_length = cp->cache_set[idx].content_length;
-        *content = malloc(content_length);
-        memcpy(*content, cp->cache_set[idx].content, content_length);
+        cp->policy->access(sp, NULL, tag);
+    }
+
+    pthread_rwlock_unlock(&sp->lock);
 
-        sem_wait(&time_mutex);
-        cp->cache_set[idx].time = time++;
-        sem_post(&time_mutex);
+    if (op == NULL && cp->disk &&
+        (op = disk_read(cp->disk, tag, request, expires, &hits)) &&
+        hits >= DISK_PROMOTE_HITS && op->content_length <= cp->max_object) {
+        op = promote(cp, request, op, *expires);
     }
 
-    sem_wait(&cp->readcnt_mutex);
-    cp->readcnt--;
-    if (cp->readcnt == 0) { /* Last out */
-        sem_post(&cp->write_mutex);
+    if (op) {
+        atomic_fetch_add_explicit(&sp->hits, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&sp->hit_bytes, op->content_length,
+                                  memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&sp->misses, 1, memory_order_relaxed);
     }
-    sem_post(&cp->readcnt_mutex);
+    return op;
+}
 
-    return content_length;
+/*
+ * cache_release - Drop a reference to op, freeing it if it was the last
+ */
+void
+cache_release(CachePtr cp, CacheObjectPtr op)
+{
+    if (atomic_fetch_sub(&op->refcnt, 1) == 1) {
+        if (OBJECT_ON_DISK(op)) {
+            disk_release(cp->disk, op);
+            free(op);
+        } else if (cp->engine == CACHE_ENGINE_SLAB) {
+            slab_free(&cp->slab, op);
+        } else {
+            mm_free(op);
+        }
+    }
 }
 
+/*
+ * cache_write - Insert a response for request, fresh until expires,
+ *     replacing any older copy in either tier. Bodies up to max_object go
+ *     to memory, bigger ones straight to disk.
+ */
 void
 cache_write(CachePtr cp, char *request, char *response_hdrs, char *content,
-            size_t content_length)
+            size_t content_length, time_t expires)
 {
-    size_t len = content_length + strlen(response_hdrs);
-    if (content_length > MAX_OBJECT_SIZE ||
-        (cache_size(cp) + len) >= MAX_CACHE_SIZE) {
-        /* TO-DO: Remove element from cache */
+    unsigned long long tag = generate_tag(request);
+    CacheShardPtr sp = find_shard(cp, tag);
+
+    if (content_length > cp->max_fill) {
         return;
     }
-    int idx;
+    atomic_fetch_add_explicit(&sp->miss_bytes, content_length,
+                              memory_order_relaxed);
+
+    if ((content_length > cp->max_object ||
+         memory_write(cp, request, response_hdrs, content, content_length,
+                      expires, 1) < 0) &&
+        cp->disk) {
+        memory_remove(cp, request);
+        disk_write(cp->disk, tag, request, strlen(request), response_hdrs,
+                   strlen(response_hdrs), content, content_length, expires);
+    }
+}
+
+/*
+ * memory_write - Insert into the memory tier. Lines of the key's shard are
+ *     evicted, in the order the policy picks, until the object fits in
+ *     the shard's line count and byte budget; under W-TinyLFU that may be
+ *     the new object itself, once it leaves the window. What is evicted
+ *     moves to the disk tier. An older copy is replaced, or kept if
+ *     replace is not set. Returns -1 if it could not be stored.
+ */
+static int
+memory_write(CachePtr cp, char *request, char *response_hdrs, char *content,
+             size_t content_length, time_t expires, int replace)
+{
+    size_t hdr_len = strlen(response_hdrs), key_len = strlen(request);
+    size_t size = sizeof(CacheObject) + content_length + hdr_len + key_len;
+    unsigned long long tag = generate_tag(request);
+    CacheShardPtr sp = find_shard(cp, tag);
+    CacheObjectPtr op;
+    CacheLinePtr line;
+    Demote dm = {.n = 0};
+    long idx;
+
+    if (size > sp->budget) {
+        return -1;
+    }
+    if (cp->disk) {
+        disk_remove(cp->disk, tag, request); /* The tiers never share a key */
+    }
+
+    if ((op = object_alloc(cp, sp, size, &dm)) == NULL) {
+        demote(cp, &dm);
+        return -1;
+    }
+    atomic_init(&op->refcnt, 1); /* The cache's own reference */
+    op->tag = tag;
+    op->hdr_len = hdr_len;
+    op->content_length = content_length;
+    op->key_len = key_len;
+    op->seg = -1;
+    op->fd = -1;
+    op->offset = 0;
+    memcpy(OBJECT_HDRS(op), response_hdrs, hdr_len);
+    memcpy(OBJECT_CONTENT(op), content, content_length);
+    memcpy(OBJECT_KEY(op), request, key_len);
+
+    pthread_rwlock_wrlock(&sp->lock);
+
+    if ((idx = find_line(sp, tag, request)) >= 0 && !replace) {
+        pthread_rwlock_unlock(&sp->lock);
+        cache_release(cp, op);
+        demote(cp, &dm);
+        return 0;
+    } else if (idx >= 0) {
+        /* Newer copy of a cached response, swap it in place */
+        line = sp->slots[idx];
+        cp->policy->remove(sp, line);
+        sp->size -= OBJECT_SIZE(line->object);
+        cache_release(cp, line->object);
+    } else {
+        while ((sp->free_lines == NULL || sp->size + size > sp->budget) &&
+               evict_line(cp, sp, size, &dm) == 0)
+            ;
+        line = sp->free_lines;
+        sp->free_lines = line->next;
+        line->tag = tag;
+
+        /* Claim the first free slot from the home position */
+        idx = tag & sp->mask;
+        while (sp->slots[idx]) {
+            idx = (idx + 1) & sp->mask;
+        }
+        sp->slots[idx] = line;
+    }
+    line->object = op;
+    atomic_store(&line->expires, expires);
+    sp->size += size;
+    cp->policy->insert(sp, line);
+
+    /* A replacement may have grown past the budget */
+    while (sp->size > sp->budget && evict_line(cp, sp, 0, &dm) == 0)
+        ;
+
+    pthread_rwlock_unlock(&sp->lock);
+    demote(cp, &dm);
+    return 0;
+}
+
+/*
+ * cache_restore - Insert a response saved by cache_export(), unless the
+ *     request got cached again in the meantime. The strings need not be
+ *     terminated.
+ */
+void
+cache_restore(CachePtr cp, const char *request, size_t key_len,
+              const char *response_hdrs, size_t hdr_len, const char *content,
+              size_t content_length, time_t expires)
+{
+    char *key = strndup(request, key_len), *hdrs = strndup(response_hdrs,
+                                                            hdr_len);
+
+    if (key && hdrs &&
+        (content_length > cp->max_object ||
+         memory_write(cp, key, hdrs, (char *)content, content_length,
+                      expires, 0) < 0) &&
+        cp->disk) {
+        disk_write(cp->disk, generate_tag(key), key, key_len, hdrs, hdr_len,
+                   content, content_length, expires);
+    }
+    free(key);
+    free(hdrs);
+}
+
+/*
+ * cache_export - Fill ops and expires with the objects of shard i, in the
+ *     order its policy would evict them, each with a reference for the
+ *     caller. Both arrays must have room for the shard's lines. Returns
+ *     how many there are.
+ */
+size_t
+cache_export(CachePtr cp, size_t i, CacheObjectPtr *ops, time_t *expires)
+{
+    CacheShardPtr sp = &cp->shards[i];
+    CacheLinePtr line = NULL;
+    size_t n = 0;
+
+    pthread_rwlock_rdlock(&sp->lock);
+    while (n < sp->nlines && (line = cp->policy->next(sp, line))) {
+        atomic_fetch_add(&line->object->refcnt, 1);
+        ops[n] = line->object;
+        expires[n++] = atomic_load(&line->expires);
+    }
+    pthread_rwlock_unlock(&sp->lock);
+    return n;
+}
+
+/*
+ * memory_remove - Drop request from the memory tier, if it is there
+ */
+static void
+memory_remove(CachePtr cp, char *request)
+{
     unsigned long long tag = generate_tag(request);
-    char *response_hdrs_ptr = mm_malloc(strlen(response_hdrs));
-    char *content_ptr = mm_malloc(content_length);
-    sem_wait(&cp->write_mutex);
+    CacheShardPtr sp = find_shard(cp, tag);
+    CacheLinePtr line;
+    long idx;
 
-    idx = find_empty_line(cp);
+    pthread_rwlock_wrlock(&sp->lock);
+    if ((idx = find_line(sp, tag, request)) >= 0) {
+        line = sp->slots[idx];
+        free_line(cp, sp, line);
+        line->next = sp->free_lines;
+        sp->free_lines = line;
+    }
+    pthread_rwlock_unlock(&sp->lock);
+}
 
-    cp->cache_set[idx].valid = 1;
-    cp->cache_set[idx].tag = tag;
-    cp->cache_set[idx].content_length = content_length;
-    cp->cache_set[idx].response_hdr = response_hdrs_ptr;
-    strcpy(cp->cache_set[idx].response_hdr, response_hdrs);
-    cp->cache_set[idx].content = content_ptr;
-    memcpy(cp->cache_set[idx].content, content, content_length);
+/*
+ * cache_refresh - The origin confirmed op is still current: it is fresh
+ *     until expires now. Nothing happens if op is no longer cached.
+ */
+void
+cache_refresh(CachePtr cp, CacheObjectPtr op, time_t expires)
+{
+    CacheShardPtr sp = find_shard(cp, op->tag);
+    size_t idx = op->tag & sp->mask;
+    CacheLinePtr line;
 
-    sem_wait(&time_mutex);
-    cp->cache_set[idx].time = time++;
-    sem_post(&time_mutex);
+    if (OBJECT_ON_DISK(op)) {
+        disk_refresh(cp->disk, op, expires);
+        return;
+    }
 
-    sem_post(&cp->write_mutex);
+    /* The line does not move, so the read lock is enough */
+    pthread_rwlock_rdlock(&sp->lock);
+    while ((line = sp->slots[idx])) {
+        if (line->object == op) {
+            atomic_store(&line->expires, expires);
+            break;
+        }
+        idx = (idx + 1) & sp->mask;
+    }
+    pthread_rwlock_unlock(&sp->lock);
 }
 
 size_t
 cache_size(CachePtr cp)
 {
-    return mm_size();
+    return cp->engine == CACHE_ENGINE_SLAB ? slab_size(&cp->slab) : mm_size();
 }
 
-static unsigned long long
-generate_tag(const char *request)
+/*
+ * cache_stats - Add up the shards' counters and the bytes they hold
+ */
+void
+cache_stats(CachePtr cp, CacheStatsPtr st)
+{
+    CacheShardPtr sp;
+    size_t i;
+
+    memset(st, 0, sizeof(CacheStats));
+    for (i = 0; i < cp->nshards; i++) {
+        sp = &cp->shards[i];
+        st->hits += atomic_load_explicit(&sp->hits, memory_order_relaxed);
+        st->misses += atomic_load_explicit(&sp->misses, memory_order_relaxed);
+        st->hit_bytes +=
+            atomic_load_explicit(&sp->hit_bytes, memory_order_relaxed);
+        st->miss_bytes +=
+            atomic_load_explicit(&sp->miss_bytes, memory_order_relaxed);
+        st->evictions +=
+            atomic_load_explicit(&sp->evictions, memory_order_relaxed);
+        pthread_rwlock_rdlock(&sp->lock);
+        st->stored += sp->size;
+        pthread_rwlock_unlock(&sp->lock);
+    }
+}
+
+/*
+ * cache_fill_init - Start a cache copy of a body of expected bytes, or of
+ *     unknown length if expected is negative. A known length too big for
+ *     memory gets its room on the disk tier right away, if there is one;
+ *     an unknown one is only copied up to max_object.
+ */
+void
+cache_fill_init(CachePtr cp, CacheFillPtr fp, ssize_t expected)
 {
-    size_t len = strlen(request);
-    unsigned long hash = 5381;
-    char *hash_str;
+    fp->content = NULL;
+    fp->len = 0;
+    fp->cap = 0;
+    fp->limit = cp->max_object;
+    fp->abandoned = 0;
+    fp->disk = NULL;
+    if (expected > 0 && (size_t)expected > cp->max_object) {
+        fp->abandoned = cp->disk == NULL || (size_t)expected > cp->max_fill ||
+                        (fp->seg = disk_begin(cp->disk, expected,
+                                              &fp->offset)) < 0;
+        if (!fp->abandoned) {
+            fp->disk = cp->disk;
+            fp->limit = expected;
+        }
+    } else if (expected > 0) {
+        if ((fp->content = malloc(expected)) == NULL) {
+            fp->abandoned = 1;
+        }
+        fp->cap = expected;
+    }
+}
 
-    /* Build the string that will be hashed */
-    hash_str = (char *)malloc(len + 1);
-    hash_str[0] = '\0';
-    strcpy(hash_str, request);
+/*
+ * cache_fill_append - Add the next n bytes of the body. The copy is
+ *     dropped for good as soon as the body outgrows its limit, or cannot
+ *     be written.
+ */
+void
+cache_fill_append(CacheFillPtr fp, const void *buf, size_t n)
+{
+    size_t cap;
+    char *content;
 
-    for (int i = 0; i < len; i++)
-        hash = ((hash << 5) + hash) + hash_str[i]; /* hash * 33 + c */
+    if (fp->abandoned) {
+        return;
+    }
+    if (fp->len + n > fp->limit ||
+        (fp->disk && disk_pwrite(fp->disk, fp->seg, buf, n,
+                                 fp->offset + fp->len) < 0)) {
+        cache_fill_free(fp);
+        fp->abandoned = 1;
+        return;
+    }
+    if (fp->disk) {
+        fp->len += n;
+        return;
+    }
 
-    free(hash_str);
+    if (fp->len + n > fp->cap) {
+        cap = fp->cap ? fp->cap : FILL_MINSIZE;
+        while (cap < fp->len + n) {
+            cap *= 2;
+        }
+        if (cap > fp->limit) {
+            cap = fp->limit;
+        }
+        if ((content = realloc(fp->content, cap)) == NULL) {
+            cache_fill_free(fp);
+            fp->abandoned = 1;
+            return;
+        }
+        fp->content = content;
+        fp->cap = cap;
+    }
+    memcpy(fp->content + fp->len, buf, n);
+    fp->len += n;
+}
+
+/*
+ * cache_fill_commit - Cache the whole body copied into fp as the response
+ *     for request, fresh until expires. A copy written to the disk tier
+ *     is indexed there, with nothing left to write.
+ */
+void
+cache_fill_commit(CachePtr cp, CacheFillPtr fp, char *request,
+                  char *response_hdrs, time_t expires)
+{
+    unsigned long long tag = generate_tag(request);
+
+    if (fp->abandoned) {
+        return;
+    }
+    if (fp->disk == NULL) {
+        cache_write(cp, request, response_hdrs, fp->content, fp->len,
+                    expires);
+        return;
+    }
+    if (fp->len != fp->limit) {
+        return; /* Cut short, cache_fill_free() gives the room back */
+    }
+    atomic_fetch_add_explicit(&find_shard(cp, tag)->miss_bytes, fp->len,
+                              memory_order_relaxed);
+    memory_remove(cp, request);
+    disk_commit(fp->disk, fp->seg, fp->offset, tag, request, strlen(request),
+                response_hdrs, strlen(response_hdrs), fp->len, expires);
+    fp->disk = NULL;
+}
+
+void
+cache_fill_free(CacheFillPtr fp)
+{
+    free(fp->content);
+    fp->content = NULL;
+    fp->len = 0;
+    fp->cap = 0;
+    if (fp->disk) {
+        disk_abort(fp->disk, fp->seg);
+        fp->disk = NULL;
+    }
+}
+
+/*
+ * generate_tag - 64-bit FNV-1a hash of the request
+ */
+static unsigned long long
+generate_tag(const char *request)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+
+    for (; *request; request++) {
+        hash ^= (unsigned char)*request;
+        hash *= 0x100000001b3ULL;
+    }
     return hash;
 }
 
-static int
-find_line(CachePtr cp, unsigned long long tag)
+/*
+ * find_shard - The shard owning tag. It uses the high bits, the slot
+ *     index inside the shard uses the low ones.
+ */
+static CacheShardPtr
+find_shard(CachePtr cp, unsigned long long tag)
 {
-    int i;
-    for (i = 0; i < CACHE_LINES; i++) {
-        if (cp->cache_set[i].valid == 1 && cp->cache_set[i].tag == tag) {
-            return i;
+    return &cp->shards[(tag >> 32) & (cp->nshards - 1)];
+}
+
+/*
+ * find_line - Return the slot holding request, or -1. The tag only
+ *     narrows the search; the stored key decides.
+ */
+static long
+find_line(CacheShardPtr sp, unsigned long long tag, const char *request)
+{
+    size_t idx = tag & sp->mask;
+    CacheLinePtr line;
+
+    while ((line = sp->slots[idx])) {
+        if (line->tag == tag && !strncmp(OBJECT_KEY(line->object), request,
+                                         line->object->key_len) &&
+            request[line->object->key_len] == '\0') {
+            return idx;
         }
+        idx = (idx + 1) & sp->mask;
     }
     return -1;
 }
 
+/*
+ * find_slot - Return the slot pointing at line
+ */
+static long
+find_slot(CacheShardPtr sp, CacheLinePtr line)
+{
+    size_t idx = line->tag & sp->mask;
+
+    while (sp->slots[idx] && sp->slots[idx] != line) {
+        idx = (idx + 1) & sp->mask;
+    }
+    return sp->slots[idx] ? idx : -1;
+}
+
+/*
+ * index_remove - Empty slot idx, then move back any later entry of the
+ *     same probe run that could no longer be reached past the hole
+ */
+static void
+index_remove(CacheShardPtr sp, size_t idx)
+{
+    size_t next = idx, home;
+
+    sp->slots[idx] = NULL;
+    while (1) {
+        next = (next + 1) & sp->mask;
+        if (sp->slots[next] == NULL) {
+            return;
+        }
+        home = sp->slots[next]->tag & sp->mask;
+        /* Leave it if its home lies cyclically in (idx, next] */
+        if (idx <= next ? (idx < home && home <= next)
+                        : (idx < home || home <= next)) {
+            continue;
+        }
+        sp->slots[idx] = sp->slots[next];
+        sp->slots[next] = NULL;
+        idx = next;
+    }
+}
+
+/*
+ * evict_line - Free the line of sp the policy picks onto its free list,
+ *     making room for incoming more bytes. With a disk tier its object is
+ *     kept in dm, to be written there. Returns -1 if the shard is empty.
+ */
 static int
-find_empty_line(CachePtr cp)
+evict_line(CachePtr cp, CacheShardPtr sp, size_t incoming, Demote *dm)
 {
-    int idx;
-    for (idx = 0; idx < CACHE_LINES; idx++) {
-        if (cp->cache_set[idx].valid == 0) {
-            return idx;
+    CacheLinePtr line;
+
+    if ((line = cp->policy->victim(sp, incoming)) == NULL) {
+        return -1;
+    }
+    if (cp->disk && dm->n < DEMOTE_MAX) {
+        atomic_fetch_add(&line->object->refcnt, 1);
+        dm->ops[dm->n] = line->object;
+        dm->expires[dm->n++] = atomic_load(&line->expires);
+    }
+    atomic_fetch_add_explicit(&sp->evictions, 1, memory_order_relaxed);
+    free_line(cp, sp, line);
+    line->next = sp->free_lines;
+    sp->free_lines = line;
+    return 0;
+}
+
+static void
+free_line(CachePtr cp, CacheShardPtr sp, CacheLinePtr line)
+{
+    index_remove(sp, find_slot(sp, line));
+    cp->policy->remove(sp, line);
+    sp->size -= OBJECT_SIZE(line->object);
+    /* Readers still sending the object keep it alive */
+    cache_release(cp, line->object);
+    line->object = NULL;
+}
+
+/*
+ * object_alloc - Room for an object of size bytes. Called without any
+ *     shard lock, since the slab may evict from every shard. The mm heap
+ *     is made room in at the expense of sp when it is full.
+ */
+static CacheObjectPtr
+object_alloc(CachePtr cp, CacheShardPtr sp, size_t size, Demote *dm)
+{
+    CacheObjectPtr op;
+    int rc;
+
+    if (cp->engine == CACHE_ENGINE_SLAB) {
+        return slab_alloc(&cp->slab, size);
+    }
+
+    while ((op = mm_malloc(size)) == NULL) {
+        pthread_rwlock_wrlock(&sp->lock);
+        rc = evict_line(cp, sp, size, dm);
+        pthread_rwlock_unlock(&sp->lock);
+        if (rc < 0) {
+            return NULL;
         }
     }
-    idx = find_victim(cp);
-    return idx;
+    return op;
 }
 
-static unsigned int
-find_victim(CachePtr cp)
+/*
+ * object_evict - Slab callback for an object in a segment being recycled:
+ *     drop its line if it is still cached
+ */
+static void
+object_evict(void *arg, void *item)
 {
-    /* LRU algorithm */
-    int lru = 0;
-    int t = cp->cache_set[0].time;
-    int i;
-    for (i = 1; i < CACHE_LINES; i++) {
-        if (cp->cache_set[i].time < t) {
-            t = cp->cache_set[i].time;
-            lru = i;
+    CachePtr cp = arg;
+    CacheObjectPtr op = item;
+    CacheShardPtr sp = find_shard(cp, op->tag);
+    size_t idx = op->tag & sp->mask;
+    CacheLinePtr line;
+
+    pthread_rwlock_wrlock(&sp->lock);
+    while ((line = sp->slots[idx])) {
+        if (line->object == op) {
+            atomic_fetch_add_explicit(&sp->evictions, 1, memory_order_relaxed);
+            free_line(cp, sp, line);
+            line->next = sp->free_lines;
+            sp->free_lines = line;
+            break;
         }
+        idx = (idx + 1) & sp->mask;
     }
-    free_line(cp, lru);
-    return lru;
+    pthread_rwlock_unlock(&sp->lock);
 }
 
+/*
+ * demote - Write the objects evicted into dm to the disk tier, then let go
+ *     of them. Called without any shard lock.
+ */
 static void
-free_line(CachePtr cp, unsigned int idx)
+demote(CachePtr cp, Demote *dm)
+{
+    CacheObjectPtr op;
+    int i;
+
+    for (i = 0; i < dm->n; i++) {
+        op = dm->ops[i];
+        disk_write(cp->disk, op->tag, OBJECT_KEY(op), op->key_len,
+                   OBJECT_HDRS(op), op->hdr_len, OBJECT_CONTENT(op),
+                   op->content_length, dm->expires[i]);
+        cache_release(cp, op);
+    }
+    dm->n = 0;
+}
+
+/*
+ * promote - Move the disk object op, hit often enough, to memory.
+ *     Returns the memory copy, or op if it could not be made.
+ */
+static CacheObjectPtr
+promote(CachePtr cp, char *request, CacheObjectPtr op, time_t expires)
 {
-    mm_free(cp->cache_set[idx].response_hdr);
-    mm_free(cp->cache_set[idx].content);
+    unsigned long long tag = generate_tag(request);
+    CacheShardPtr sp = find_shard(cp, tag);
+    CacheObjectPtr mem = NULL;
+    char *hdrs, *content;
+    size_t done = 0;
+    ssize_t n;
+    long idx;
+
+    hdrs = strndup(OBJECT_HDRS(op), op->hdr_len);
+    content = malloc(op->content_length + 1);
+    while (hdrs && content && done < op->content_length) {
+        if ((n = pread(op->fd, content + done, op->content_length - done,
+                       op->offset + done)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        done += n;
+    }
+
+    if (hdrs && content && done == op->content_length) {
+        memory_write(cp, request, hdrs, content, op->content_length, expires,
+                     1);
+        pthread_rwlock_rdlock(&sp->lock);
+        if ((idx = find_line(sp, tag, request)) >= 0) {
+            mem = sp->slots[idx]->object;
+            atomic_fetch_add(&mem->refcnt, 1);
+        }
+        pthread_rwlock_unlock(&sp->lock);
+    }
+    free(hdrs);
+    free(content);
+    if (mem == NULL) {
+        return op;
+    }
+    cache_release(cp, op);
+    return mem;
 }
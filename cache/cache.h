@@ -1,38 +1,197 @@
 #ifndef CACHE_h
 #define CACHE_h
 
+#include "flight.h"
+#include "memlib.h"
 #include "mm.h"
-#include <semaphore.h>
+#include "sketch.h"
+#include "slab.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <time.h>
 
-#define MAX_CACHE_SIZE 1049000 /* 1MB total cache size */
-#define MAX_OBJECT_SIZE 102400 /* 1KB cache object size */
+#define MAX_CACHE_SIZE 1049000 /* Default total cache size, 1MB */
+#define MAX_OBJECT_SIZE 102400 /* Default largest cached body, 100KB */
 #define CACHE_LINES 100
+#define CACHE_SHARDS 8
+#define OBJECT_SLACK 16384 /* Headers and key, on top of the body */
+#define CACHE_HEURISTIC 60 /* Most seconds fresh without explicit freshness */
+
+/* Where objects are stored */
+#define CACHE_ENGINE_MM 0   /* One mm_malloc() block each */
+#define CACHE_ENGINE_SLAB 1 /* Appended to slab segments */
+
+/* Which line is evicted when room is needed, see policy.c */
+#define CACHE_POLICY_LRU 0     /* Least recently used, hits get a second chance */
+#define CACHE_POLICY_TINYLFU 1 /* LRU window, then only admitted if popular */
+#define CACHE_POLICY_GDSF 2    /* Fewest hits per byte, aged */
+
+/*
+ * A cached response. It is immutable once inserted and shared by the
+ * cache and every reader sending it; whoever drops the last reference
+ * frees it, so eviction never pulls it from under a reader. An object
+ * from the disk tier only has its headers in data, its body stays in the
+ * segment file fd at offset, see disk.c.
+ */
+typedef struct cache_object {
+    atomic_int refcnt;
+    unsigned long long tag; /* Of the key, to find its line again */
+    size_t hdr_len;        /* Headers, at data */
+    size_t content_length; /* Body, right after the headers */
+    size_t key_len;        /* Request it answers, after the body */
+    int seg;               /* Disk segment holding the body, or -1 */
+    int fd;
+    off_t offset;
+    char data[];
+} CacheObject, *CacheObjectPtr;
+
+#define OBJECT_ON_DISK(op) ((op)->seg >= 0)
+
+#define OBJECT_HDRS(op) ((op)->data)
+#define OBJECT_CONTENT(op) ((op)->data + (op)->hdr_len)
+#define OBJECT_KEY(op) ((op)->data + (op)->hdr_len + (op)->content_length)
+#define OBJECT_SIZE(op)                                                        \
+    (sizeof(CacheObject) + (op)->hdr_len + (op)->content_length +             \
+     (op)->key_len)
 
 typedef struct cache_line {
-    unsigned char valid;
-    unsigned long long tag;
-    unsigned long long time;
-    size_t content_length;
-    char *response_hdr;
-    void *content;
+    unsigned long long tag; /* 64-bit hash of the key */
+    CacheObjectPtr object;
+    atomic_int referenced; /* Hit since eviction last passed over it */
+    atomic_long expires;   /* Fresh until then, pushed back on revalidation */
+    struct cache_line *prev, *next; /* Policy list, or free list when unused */
+
+    int window;          /* W-TinyLFU: in the window, not the main list */
+    atomic_uint hits;    /* GDSF: since it was inserted */
+    unsigned int scored; /* GDSF: hits when priority was last computed */
+    double priority;     /* GDSF: evicted lowest first */
+    size_t heap_idx;     /* GDSF: position in the shard's heap */
 } CacheLine, *CacheLinePtr;
 
+/*
+ * An independently locked slice of the cache. A key always lives in the
+ * shard picked by its tag, so shards never need each other's locks.
+ * Readers only take the shard lock shared: a hit only sets atomics on
+ * its line, such as the referenced bit or the hit count, and the policy
+ * catches up when it next has to evict.
+ */
+typedef struct cache_shard {
+    pthread_rwlock_t lock;
+
+    CacheLinePtr lines; /* nlines lines, allocated at init */
+    size_t nlines;
+
+    /*
+     * Open-addressing index from tag to line, linear probing, kept at
+     * most half full. Deletions shift entries back, so there are no
+     * tombstones.
+     */
+    CacheLinePtr *slots;
+    size_t mask;
+
+    CacheLinePtr lru_head, lru_tail; /* Most and least recently used */
+    CacheLinePtr free_lines;
+
+    size_t size;   /* Bytes held by this shard's objects */
+    size_t budget; /* Bytes it may hold */
+
+    /* W-TinyLFU: the window in front of the LRU list, which is "main" */
+    CacheLinePtr win_head, win_tail;
+    size_t win_size, win_lines;   /* What the window holds */
+    size_t win_budget, win_max;   /* And may hold */
+    size_t main_size, main_lines; /* What the LRU list holds */
+    Sketch sketch;
+
+    /* GDSF: min-heap on priority, which starts from the last one evicted */
+    CacheLinePtr *heap;
+    size_t heap_len;
+    double inflation;
+
+    /* Counted on lookups and insertions, see cache_stats() */
+    atomic_ulong hits, misses;
+    atomic_ulong hit_bytes, miss_bytes;
+    atomic_ulong evictions;
+} __attribute__((aligned(64))) CacheShard, *CacheShardPtr;
+
 typedef struct cache {
-    CacheLine cache_set[CACHE_LINES];
-    sem_t write_mutex, readcnt_mutex;
-    unsigned long long readcnt;
+    CacheShardPtr shards;
+    size_t nshards;    /* A power of two */
+    size_t max_size;   /* Bytes all shards may hold together */
+    size_t max_object; /* Largest body worth caching in memory */
+    size_t max_fill;   /* Largest body either tier takes */
+    long heuristic;    /* Seconds, see http_lifetime() */
+    int engine;
+    const struct cache_policy *policy;
+    struct disk *disk;   /* Second tier, or NULL */
+    Slab slab;           /* With CACHE_ENGINE_SLAB */
+    FlightTable flights; /* Misses being fetched, see flight.c */
 } Cache, *CachePtr;
 
-void cache_init(CachePtr cp);
+/* Settings fixed at startup, see cache_init() */
+typedef struct cache_opts {
+    size_t nlines;
+    size_t nshards;
+    size_t max_size;
+    size_t max_object;
+    long heuristic;
+    int arena_flags; /* MEM_HUGEPAGES, MEM_LOCKED */
+    int engine;
+    int slab_policy; /* SLAB_LEAST_USED, SLAB_FIFO */
+    int policy;      /* CACHE_POLICY_* */
+    char *disk_dir;  /* Where the disk tier keeps its files, or NULL */
+    size_t disk_size;
+} CacheOpts, *CacheOptsPtr;
+
+/*
+ * Totals over every shard. Bodies missed only count if they were small
+ * enough to be cached, so the byte hit ratio compares like with like.
+ */
+typedef struct cache_stats {
+    unsigned long hits, misses;
+    unsigned long hit_bytes, miss_bytes;
+    unsigned long evictions; /* From memory, whether demoted or not */
+    size_t stored;           /* Bytes of the objects in memory */
+} CacheStats, *CacheStatsPtr;
 
-ssize_t cache_read(CachePtr cp, char *request, char **response_hdrs,
-                   char **content);
+/*
+ * A copy of a response body for the cache, built while it is relayed: in
+ * memory up to max_object, else written to the disk tier as it comes
+ */
+typedef struct cache_fill {
+    char *content;
+    size_t len, cap;
+    size_t limit;      /* Most bytes the copy may take */
+    int abandoned;     /* Set once the body is known not to fit */
+    struct disk *disk; /* Writing to this tier, or NULL */
+    long seg;          /* At offset in segment seg */
+    off_t offset;
+} CacheFill, *CacheFillPtr;
+
+int cache_init(CachePtr cp, CacheOptsPtr opts);
+
+CacheObjectPtr cache_read(CachePtr cp, char *request, time_t *expires);
+void cache_release(CachePtr cp, CacheObjectPtr op);
 
 void cache_write(CachePtr cp, char *request, char *response_hdrs, char *content,
-                 size_t content_length);
+                 size_t content_length, time_t expires);
+void cache_refresh(CachePtr cp, CacheObjectPtr op, time_t expires);
+
+size_t cache_export(CachePtr cp, size_t i, CacheObjectPtr *ops,
+                    time_t *expires);
+void cache_restore(CachePtr cp, const char *request, size_t key_len,
+                   const char *response_hdrs, size_t hdr_len,
+                   const char *content, size_t content_length, time_t expires);
 
 size_t cache_size(CachePtr cp);
+void cache_stats(CachePtr cp, CacheStatsPtr st);
+
+void cache_fill_init(CachePtr cp, CacheFillPtr fp, ssize_t expected);
+void cache_fill_append(CacheFillPtr fp, const void *buf, size_t n);
+void cache_fill_commit(CachePtr cp, CacheFillPtr fp, char *request,
+                       char *response_hdrs, time_t expires);
+void cache_fill_free(CacheFillPtr fp);
 #endif
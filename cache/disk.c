@@ -0,0 +1,394 @@
+/*
+ * disk.c - disk tier behind the in-memory cache, for objects too big for
+ *          it and for the ones it evicts.
+ *
+ * A hit comes back as a CacheObject holding only the headers; the body
+ * stays in the segment file and is sent from there with sendfile(). The
+ * object pins its segment until it is released.
+ */
+#define _GNU_SOURCE
+#include "disk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define DISK_BUCKET_BYTES 16384 /* Expected bytes per index bucket */
+
+static DiskEntry **find_entry(DiskPtr dp, unsigned long long tag,
+                              const char *key);
+static long reserve(DiskPtr dp, size_t size, off_t *offset);
+static long find_victim(DiskPtr dp);
+static void evict_segment(DiskPtr dp, size_t idx);
+static void unpin(DiskPtr dp, size_t idx);
+static void entry_free(DiskEntry *ep);
+
+/*
+ * disk_init - Create and preallocate the segment files, about size bytes
+ *     in all, in the directory dir. Whatever they held is discarded.
+ */
+int
+disk_init(DiskPtr dp, const char *dir, size_t size)
+{
+    char path[PATH_MAX];
+    size_t i, nbuckets = 1024;
+
+    dp->seg_size = size / DISK_MIN_SEGMENTS;
+    if (dp->seg_size > DISK_SEGMENT_MAX) {
+        dp->seg_size = DISK_SEGMENT_MAX;
+    }
+    if (dp->seg_size < 1) {
+        return -1;
+    }
+    dp->nsegs = size / dp->seg_size;
+    if ((dp->segs = calloc(dp->nsegs, sizeof(DiskSegment))) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < dp->nsegs; i++) {
+        snprintf(path, sizeof(path), "%s/segment.%03zu", dir, i);
+        if ((dp->segs[i].fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) <
+            0) {
+            return -1;
+        }
+        /* Not every file system preallocates, a sparse file does too */
+        if (posix_fallocate(dp->segs[i].fd, 0, dp->seg_size) != 0 &&
+            ftruncate(dp->segs[i].fd, dp->seg_size) < 0) {
+            return -1;
+        }
+    }
+
+    while (nbuckets < size / DISK_BUCKET_BYTES) {
+        nbuckets <<= 1;
+    }
+    if ((dp->buckets = calloc(nbuckets, sizeof(DiskEntry *))) == NULL) {
+        return -1;
+    }
+    dp->mask = nbuckets - 1;
+    dp->open = 0;
+    dp->segs[0].state = SEG_OPEN;
+    dp->seq = 0;
+    return pthread_mutex_init(&dp->lock, NULL) ? -1 : 0;
+}
+
+/*
+ * disk_read - Look up key. On a hit the object comes back with its
+ *     headers, one reference for the caller and its segment pinned; *hits
+ *     counts the hits it had on disk, this one included. Returns NULL on a
+ *     miss.
+ */
+CacheObjectPtr
+disk_read(DiskPtr dp, unsigned long long tag, const char *key,
+          time_t *expires, unsigned int *hits)
+{
+    DiskEntry **epp, *ep;
+    CacheObjectPtr op = NULL;
+
+    pthread_mutex_lock(&dp->lock);
+    if ((ep = *(epp = find_entry(dp, tag, key))) &&
+        (op = malloc(sizeof(CacheObject) + ep->hdr_len))) {
+        atomic_init(&op->refcnt, 1);
+        op->tag = tag;
+        op->hdr_len = ep->hdr_len;
+        op->content_length = ep->content_length;
+        op->key_len = 0; /* Not kept, a disk object is never indexed */
+        op->seg = ep->seg;
+        op->fd = dp->segs[ep->seg].fd;
+        op->offset = ep->offset;
+        memcpy(OBJECT_HDRS(op), ep->hdrs, ep->hdr_len);
+        dp->segs[ep->seg].users++;
+        *expires = ep->expires;
+        *hits = ++ep->hits;
+    }
+    pthread_mutex_unlock(&dp->lock);
+    return op;
+}
+
+/*
+ * disk_write - Store a response for key, replacing any older copy. It is
+ *     dropped if it does not fit in a segment, or if readers pin every
+ *     segment that could make room.
+ */
+void
+disk_write(DiskPtr dp, unsigned long long tag, const char *key,
+           size_t key_len, const char *hdrs, size_t hdr_len,
+           const char *content, size_t content_length, time_t expires)
+{
+    off_t offset;
+    long seg;
+
+    if ((seg = disk_begin(dp, content_length, &offset)) < 0) {
+        return;
+    }
+    if (disk_pwrite(dp, seg, content, content_length, offset) < 0) {
+        disk_abort(dp, seg);
+        return;
+    }
+    disk_commit(dp, seg, offset, tag, key, key_len, hdrs, hdr_len,
+                content_length, expires);
+}
+
+/*
+ * disk_begin - Set aside size bytes for a body, to be written with
+ *     disk_pwrite() without the lock held, then indexed by disk_commit()
+ *     or given up with disk_abort(). Returns the segment, pinned until
+ *     then, and the body's *offset in it; or -1 if there is no room.
+ */
+long
+disk_begin(DiskPtr dp, size_t size, off_t *offset)
+{
+    long seg;
+
+    pthread_mutex_lock(&dp->lock);
+    seg = reserve(dp, size, offset);
+    pthread_mutex_unlock(&dp->lock);
+    return seg;
+}
+
+/*
+ * disk_pwrite - Write n bytes to segment seg at offset. Returns -1 on
+ *     error.
+ */
+int
+disk_pwrite(DiskPtr dp, long seg, const void *buf, size_t n, off_t offset)
+{
+    size_t done = 0;
+    ssize_t rc;
+
+    while (done < n) {
+        if ((rc = pwrite(dp->segs[seg].fd, (const char *)buf + done,
+                         n - done, offset + done)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += rc;
+    }
+    return 0;
+}
+
+/*
+ * disk_commit - The body set aside at offset of seg is written: index it
+ *     for key, replacing any older copy, and unpin the segment
+ */
+void
+disk_commit(DiskPtr dp, long seg, off_t offset, unsigned long long tag,
+            const char *key, size_t key_len, const char *hdrs,
+            size_t hdr_len, size_t content_length, time_t expires)
+{
+    DiskEntry **epp, *ep;
+
+    if ((ep = calloc(1, sizeof(DiskEntry))) == NULL ||
+        (ep->key = strndup(key, key_len)) == NULL ||
+        (ep->hdrs = malloc(hdr_len)) == NULL) {
+        if (ep) {
+            entry_free(ep);
+        }
+        disk_abort(dp, seg);
+        return;
+    }
+    memcpy(ep->hdrs, hdrs, hdr_len);
+    ep->tag = tag;
+    ep->hdr_len = hdr_len;
+    ep->content_length = content_length;
+    ep->expires = expires;
+    ep->seg = seg;
+    ep->offset = offset;
+
+    pthread_mutex_lock(&dp->lock);
+    /* The segment may have been evicted while we were writing to it */
+    if (dp->segs[seg].state == SEG_OPEN || dp->segs[seg].state == SEG_SEALED) {
+        if (*(epp = find_entry(dp, tag, ep->key))) {
+            (*epp)->live = 0;
+            *epp = (*epp)->next;
+        }
+        ep->live = 1;
+        ep->next = dp->buckets[tag & dp->mask];
+        dp->buckets[tag & dp->mask] = ep;
+        ep->seg_next = dp->segs[seg].entries;
+        dp->segs[seg].entries = ep;
+    } else {
+        entry_free(ep);
+    }
+    unpin(dp, seg);
+    pthread_mutex_unlock(&dp->lock);
+}
+
+/*
+ * disk_abort - Give up on the body set aside in seg
+ */
+void
+disk_abort(DiskPtr dp, long seg)
+{
+    pthread_mutex_lock(&dp->lock);
+    unpin(dp, seg);
+    pthread_mutex_unlock(&dp->lock);
+}
+
+/*
+ * disk_remove - Drop key from the index, if it is there. Its body stays
+ *     until its segment is recycled.
+ */
+void
+disk_remove(DiskPtr dp, unsigned long long tag, const char *key)
+{
+    DiskEntry **epp;
+
+    pthread_mutex_lock(&dp->lock);
+    if (*(epp = find_entry(dp, tag, key))) {
+        (*epp)->live = 0;
+        *epp = (*epp)->next;
+    }
+    pthread_mutex_unlock(&dp->lock);
+}
+
+/*
+ * disk_refresh - The origin confirmed the disk object op is current: it is
+ *     fresh until expires now, if it is still indexed
+ */
+void
+disk_refresh(DiskPtr dp, CacheObjectPtr op, time_t expires)
+{
+    DiskEntry *ep;
+
+    pthread_mutex_lock(&dp->lock);
+    for (ep = dp->buckets[op->tag & dp->mask]; ep; ep = ep->next) {
+        if (ep->seg == op->seg && ep->offset == op->offset) {
+            ep->expires = expires;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dp->lock);
+}
+
+/*
+ * disk_release - The last reference to the disk object op is gone:
+ *     unpin its segment. Freeing op is up to the caller.
+ */
+void
+disk_release(DiskPtr dp, CacheObjectPtr op)
+{
+    pthread_mutex_lock(&dp->lock);
+    unpin(dp, op->seg);
+    pthread_mutex_unlock(&dp->lock);
+}
+
+/*
+ * find_entry - The link pointing at the live entry for key, or at the
+ *     NULL ending its chain
+ */
+static DiskEntry **
+find_entry(DiskPtr dp, unsigned long long tag, const char *key)
+{
+    DiskEntry **epp = &dp->buckets[tag & dp->mask];
+
+    while (*epp && ((*epp)->tag != tag || strcmp((*epp)->key, key))) {
+        epp = &(*epp)->next;
+    }
+    return epp;
+}
+
+/*
+ * reserve - Room for size bytes in the open segment, recycling the oldest
+ *     sealed segment if no other is free. The segment comes back pinned
+ *     for the writer. Returns its index, or -1. Called with dp->lock held.
+ */
+static long
+reserve(DiskPtr dp, size_t size, off_t *offset)
+{
+    DiskSegment *seg;
+    size_t i;
+    long victim;
+
+    if (size > dp->seg_size) {
+        return -1;
+    }
+    while (dp->segs[dp->open].used + size > dp->seg_size) {
+        /* Seal the open segment and move on to a free one */
+        for (i = 0; i < dp->nsegs && dp->segs[i].state != SEG_FREE; i++)
+            ;
+        if (i < dp->nsegs) {
+            dp->segs[dp->open].state = SEG_SEALED;
+            dp->segs[dp->open].seq = dp->seq++;
+            dp->open = i;
+            dp->segs[i].state = SEG_OPEN;
+            dp->segs[i].used = 0;
+            continue;
+        }
+        if ((victim = find_victim(dp)) < 0) {
+            return -1;
+        }
+        evict_segment(dp, victim);
+    }
+
+    seg = &dp->segs[dp->open];
+    *offset = seg->used;
+    seg->used += size;
+    seg->users++;
+    return dp->open;
+}
+
+/*
+ * find_victim - Index of the oldest sealed segment, or -1
+ */
+static long
+find_victim(DiskPtr dp)
+{
+    size_t i;
+    long best = -1;
+
+    for (i = 0; i < dp->nsegs; i++) {
+        if (dp->segs[i].state == SEG_SEALED &&
+            (best < 0 || dp->segs[i].seq < dp->segs[best].seq)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+/*
+ * evict_segment - Drop every entry of segment idx. It is free right away
+ *     unless someone still pins it.
+ */
+static void
+evict_segment(DiskPtr dp, size_t idx)
+{
+    DiskSegment *seg = &dp->segs[idx];
+    DiskEntry *ep, *next, **epp;
+
+    for (ep = seg->entries; ep; ep = next) {
+        next = ep->seg_next;
+        if (ep->live) {
+            for (epp = &dp->buckets[ep->tag & dp->mask]; *epp != ep;
+                 epp = &(*epp)->next)
+                ;
+            *epp = ep->next;
+        }
+        entry_free(ep);
+    }
+    seg->entries = NULL;
+    seg->state = seg->users ? SEG_DRAINING : SEG_FREE;
+}
+
+/*
+ * unpin - Drop a writer's or a reader's pin on segment idx. The last one
+ *     frees an evicted segment. Called with dp->lock held.
+ */
+static void
+unpin(DiskPtr dp, size_t idx)
+{
+    DiskSegment *seg = &dp->segs[idx];
+
+    if (--seg->users == 0 && seg->state == SEG_DRAINING) {
+        seg->state = SEG_FREE;
+    }
+}
+
+static void
+entry_free(DiskEntry *ep)
+{
+    free(ep->key);
+    free(ep->hdrs);
+    free(ep);
+}
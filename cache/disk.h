@@ -0,0 +1,68 @@
+#ifndef DISK_h
+#define DISK_h
+
+#include "cache.h"
+
+#define DISK_SIZE (1UL << 30)           /* Default size of the tier, 1GB */
+#define DISK_SEGMENT_MAX (64UL << 20)   /* Upper bound on a segment file */
+#define DISK_MIN_SEGMENTS 8
+#define DISK_PROMOTE_HITS 2 /* Disk hits that move an object back to memory */
+
+/* Where a body is on disk. The headers are kept here, in memory. */
+typedef struct disk_entry {
+    unsigned long long tag;
+    char *key;
+    char *hdrs;
+    size_t hdr_len, content_length;
+    int seg;
+    off_t offset;
+    time_t expires;
+    unsigned int hits;
+    int live;                    /* Indexed, not replaced or removed */
+    struct disk_entry *next;     /* Hash chain */
+    struct disk_entry *seg_next; /* Entries written to the same segment */
+} DiskEntry;
+
+typedef struct disk_segment {
+    int fd;
+    int state; /* SEG_* as in slab.h */
+    unsigned long seq;
+    size_t used;
+    int users;          /* Writers filling it, readers sending from it */
+    DiskEntry *entries; /* Dropped with the segment when it is recycled */
+} DiskSegment;
+
+/*
+ * The second cache tier: bodies appended to preallocated segment files,
+ * found through an index in memory. Like the slab, space comes back a
+ * whole segment at a time, the oldest first; a segment is only reused
+ * once nobody still writes to it or sends from it.
+ */
+typedef struct disk {
+    DiskSegment *segs;
+    size_t nsegs, seg_size;
+    DiskEntry **buckets;
+    size_t mask;
+    size_t open; /* Index of the segment being appended to */
+    unsigned long seq;
+    pthread_mutex_t lock;
+} Disk, *DiskPtr;
+
+int disk_init(DiskPtr dp, const char *dir, size_t size);
+CacheObjectPtr disk_read(DiskPtr dp, unsigned long long tag,
+                         const char *key, time_t *expires,
+                         unsigned int *hits);
+void disk_write(DiskPtr dp, unsigned long long tag, const char *key,
+                size_t key_len, const char *hdrs, size_t hdr_len,
+                const char *content, size_t content_length, time_t expires);
+long disk_begin(DiskPtr dp, size_t size, off_t *offset);
+int disk_pwrite(DiskPtr dp, long seg, const void *buf, size_t n, off_t offset);
+void disk_commit(DiskPtr dp, long seg, off_t offset, unsigned long long tag,
+                 const char *key, size_t key_len, const char *hdrs,
+                 size_t hdr_len, size_t content_length, time_t expires);
+void disk_abort(DiskPtr dp, long seg);
+void disk_remove(DiskPtr dp, unsigned long long tag, const char *key);
+void disk_refresh(DiskPtr dp, CacheObjectPtr op, time_t expires);
+void disk_release(DiskPtr dp, CacheObjectPtr op);
+
+#endif
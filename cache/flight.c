@@ -0,0 +1,333 @@
+/*
+ * flight.c - coalescing of concurrent misses on the same key.
+ *
+ * The first miss on a key becomes the leader of a new flight and fetches
+ * the response; misses that find the flight in the table follow it
+ * instead of going to the origin themselves. The leader publishes the
+ * headers and every piece of the body as it relays them, which wakes the
+ * followers. The flight leaves the table when the leader finishes, after
+ * the response went into the cache, so later requests hit there.
+ *
+ * Lock order is the table, then a flight.
+ */
+#include "flight.h"
+#include <stdlib.h>
+#include <string.h>
+
+static FlightPtr *find_flight(FlightTablePtr ft, const char *key);
+static void unlist(FlightTablePtr ft, FlightPtr fp);
+static void notify(FlightPtr fp);
+static void release(FlightPtr fp);
+
+int
+flight_init(FlightTablePtr ft)
+{
+    memset(ft->buckets, 0, sizeof(ft->buckets));
+    return pthread_mutex_init(&ft->lock, NULL) ? -1 : 0;
+}
+
+/*
+ * flight_join - Follow the flight for key, or lead a new one if there is
+ *     none, setting *leader. A follower that cannot block passes w to be
+ *     woken on progress. Returns NULL if out of memory; the caller then
+ *     fetches on its own.
+ */
+FlightPtr
+flight_join(FlightTablePtr ft, char *key, size_t limit, FlightWaiter *w,
+            int *leader)
+{
+    FlightPtr *fpp, fp;
+
+    pthread_mutex_lock(&ft->lock);
+    fpp = find_flight(ft, key);
+    if ((fp = *fpp)) {
+        pthread_mutex_lock(&fp->lock);
+        atomic_fetch_add(&fp->refcnt, 1);
+        fp->nfollowers++;
+        if (w) {
+            w->prev = NULL;
+            w->next = fp->waiters;
+            if (fp->waiters) {
+                fp->waiters->prev = w;
+            }
+            fp->waiters = w;
+        }
+        pthread_mutex_unlock(&fp->lock);
+        pthread_mutex_unlock(&ft->lock);
+        *leader = 0;
+        return fp;
+    }
+
+    if ((fp = calloc(1, sizeof(Flight))) == NULL ||
+        (fp->key = strdup(key)) == NULL) {
+        pthread_mutex_unlock(&ft->lock);
+        free(fp);
+        return NULL;
+    }
+    atomic_init(&fp->refcnt, 1);
+    pthread_mutex_init(&fp->lock, NULL);
+    pthread_cond_init(&fp->progress, NULL);
+    fp->state = FLIGHT_PENDING;
+    fp->limit = limit;
+    fp->listed = 1;
+    *fpp = fp;
+    pthread_mutex_unlock(&ft->lock);
+    *leader = 1;
+    return fp;
+}
+
+/*
+ * flight_headers - Publish the response headers, content_length being the
+ *     body's or negative if it is not known. Followers only get them with
+ *     the whole body then, as the flight may still fail for outgrowing
+ *     limit. Returns 0 if the flight failed instead, its body too big; the
+ *     leader then stops publishing but still finishes it.
+ */
+int
+flight_headers(FlightTablePtr ft, FlightPtr fp, char *hdrs,
+               ssize_t content_length)
+{
+    if (content_length > 0 && (size_t)content_length > fp->limit) {
+        flight_fail(ft, fp);
+        return 0;
+    }
+
+    pthread_mutex_lock(&fp->lock);
+    fp->hdrs = strdup(hdrs);
+    fp->content_length = content_length;
+    if (fp->hdrs == NULL) {
+        fp->state = FLIGHT_FAILED;
+    } else if (content_length >= 0) {
+        fp->state = FLIGHT_BODY;
+    }
+    notify(fp);
+    pthread_mutex_unlock(&fp->lock);
+    return fp->hdrs != NULL;
+}
+
+/*
+ * flight_append - Publish the next n bytes of the body. Returns 0 like
+ *     flight_headers().
+ */
+int
+flight_append(FlightTablePtr ft, FlightPtr fp, const void *buf, size_t n)
+{
+    size_t cap;
+    char *body;
+
+    if (fp->len + n > fp->limit) {
+        flight_fail(ft, fp);
+        return 0;
+    }
+
+    pthread_mutex_lock(&fp->lock);
+    if (fp->len + n > fp->cap) {
+        cap = fp->cap ? fp->cap : 8192;
+        while (cap < fp->len + n) {
+            cap *= 2;
+        }
+        if (cap > fp->limit) {
+            cap = fp->limit;
+        }
+        if ((body = realloc(fp->body, cap)) == NULL) {
+            fp->state = FLIGHT_FAILED;
+            notify(fp);
+            pthread_mutex_unlock(&fp->lock);
+            return 0;
+        }
+        fp->body = body;
+        fp->cap = cap;
+    }
+    memcpy(fp->body + fp->len, buf, n);
+    fp->len += n;
+    notify(fp);
+    pthread_mutex_unlock(&fp->lock);
+    return 1;
+}
+
+/*
+ * flight_fail - The leader will not share the response after all: take
+ *     the flight out of the table and tell the followers, who fetch on
+ *     their own unless they already started sending it. The leader still
+ *     finishes it.
+ */
+void
+flight_fail(FlightTablePtr ft, FlightPtr fp)
+{
+    pthread_mutex_lock(&ft->lock);
+    unlist(ft, fp);
+    pthread_mutex_unlock(&ft->lock);
+
+    pthread_mutex_lock(&fp->lock);
+    fp->state = FLIGHT_FAILED;
+    free(fp->body);
+    fp->body = NULL;
+    fp->len = fp->cap = 0;
+    notify(fp);
+    pthread_mutex_unlock(&fp->lock);
+}
+
+/*
+ * flight_finish - The leader is done, successfully or not, and drops its
+ *     reference. Followers still sending keep the flight alive.
+ */
+void
+flight_finish(FlightTablePtr ft, FlightPtr fp, int ok)
+{
+    pthread_mutex_lock(&ft->lock);
+    unlist(ft, fp);
+    pthread_mutex_unlock(&ft->lock);
+
+    pthread_mutex_lock(&fp->lock);
+    if (fp->state != FLIGHT_FAILED) {
+        fp->state = ok ? FLIGHT_DONE : FLIGHT_FAILED;
+    }
+    notify(fp);
+    pthread_mutex_unlock(&fp->lock);
+    release(fp);
+}
+
+/*
+ * flight_wait - Block until the headers are in and the body has more
+ *     than off bytes, or the flight is over. Returns its state.
+ */
+int
+flight_wait(FlightPtr fp, size_t off)
+{
+    int state;
+
+    pthread_mutex_lock(&fp->lock);
+    while (fp->state == FLIGHT_PENDING ||
+           (fp->state == FLIGHT_BODY && fp->len <= off)) {
+        pthread_cond_wait(&fp->progress, &fp->lock);
+    }
+    state = fp->state;
+    pthread_mutex_unlock(&fp->lock);
+    return state;
+}
+
+/*
+ * flight_response - Copy the headers into hdrs and set the body length.
+ *     Returns -1 if they are not in, or do not fit; *state tells whether
+ *     they may still come.
+ */
+int
+flight_response(FlightPtr fp, char *hdrs, size_t size,
+                ssize_t *content_length, int *state)
+{
+    int rc = -1;
+
+    pthread_mutex_lock(&fp->lock);
+    *state = fp->state;
+    if ((fp->state == FLIGHT_BODY || fp->state == FLIGHT_DONE) &&
+        fp->hdrs && strlen(fp->hdrs) < size) {
+        strcpy(hdrs, fp->hdrs);
+        *content_length = fp->content_length;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&fp->lock);
+    return rc;
+}
+
+/*
+ * flight_read - Copy up to size body bytes from offset off into buf.
+ *     Returns how many, with the state they were read in.
+ */
+size_t
+flight_read(FlightPtr fp, size_t off, char *buf, size_t size, int *state)
+{
+    size_t n = 0;
+
+    pthread_mutex_lock(&fp->lock);
+    if (fp->len > off) {
+        n = fp->len - off < size ? fp->len - off : size;
+        memcpy(buf, fp->body + off, n);
+    }
+    *state = fp->state;
+    pthread_mutex_unlock(&fp->lock);
+    return n;
+}
+
+/*
+ * flight_leave - A follower is done with the flight
+ */
+void
+flight_leave(FlightPtr fp, FlightWaiter *w)
+{
+    pthread_mutex_lock(&fp->lock);
+    if (w) {
+        if (w->prev) {
+            w->prev->next = w->next;
+        } else {
+            fp->waiters = w->next;
+        }
+        if (w->next) {
+            w->next->prev = w->prev;
+        }
+    }
+    fp->nfollowers--;
+    pthread_mutex_unlock(&fp->lock);
+    release(fp);
+}
+
+static FlightPtr *
+find_flight(FlightTablePtr ft, const char *key)
+{
+    unsigned long hash = 5381;
+    const char *p;
+    FlightPtr *fpp;
+
+    for (p = key; *p; p++) {
+        hash = hash * 33 + (unsigned char)*p;
+    }
+    fpp = &ft->buckets[hash % FLIGHT_BUCKETS];
+    while (*fpp && strcmp((*fpp)->key, key)) {
+        fpp = &(*fpp)->next;
+    }
+    return fpp;
+}
+
+/*
+ * unlist - Remove fp from the table if it is still there. Called with the
+ *     table lock held.
+ */
+static void
+unlist(FlightTablePtr ft, FlightPtr fp)
+{
+    FlightPtr *fpp;
+
+    if (!fp->listed) {
+        return;
+    }
+    fpp = find_flight(ft, fp->key);
+    *fpp = fp->next;
+    fp->listed = 0;
+}
+
+/*
+ * notify - Wake every follower. Called with the flight lock held, which
+ *     keeps the waiters from leaving meanwhile.
+ */
+static void
+notify(FlightPtr fp)
+{
+    FlightWaiter *w;
+
+    pthread_cond_broadcast(&fp->progress);
+    for (w = fp->waiters; w; w = w->next) {
+        w->wake(w->arg);
+    }
+}
+
+static void
+release(FlightPtr fp)
+{
+    if (atomic_fetch_sub(&fp->refcnt, 1) == 1) {
+        pthread_mutex_destroy(&fp->lock);
+        pthread_cond_destroy(&fp->progress);
+        free(fp->key);
+        free(fp->hdrs);
+        free(fp->body);
+        free(fp);
+    }
+}
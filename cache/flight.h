@@ -0,0 +1,73 @@
+#ifndef FLIGHT_h
+#define FLIGHT_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define FLIGHT_BUCKETS 256
+
+/* Flight states */
+#define FLIGHT_PENDING 0 /* Waiting for the headers, or a body of unknown
+                            length to end */
+#define FLIGHT_BODY 1    /* Headers in, body arriving */
+#define FLIGHT_DONE 2    /* The whole response is in */
+#define FLIGHT_FAILED 3  /* The leader gave up */
+
+/* How a follower that cannot block is told a flight made progress */
+typedef struct flight_waiter {
+    void (*wake)(void *arg);
+    void *arg;
+    struct flight_waiter *prev, *next;
+} FlightWaiter;
+
+/*
+ * One response being fetched from the origin by its leader, for every
+ * request for the same key that missed meanwhile. Followers are sent the
+ * headers and body from here as they arrive, blocking on progress or
+ * registering a waiter. The body is kept whole, so a flight whose body
+ * would outgrow limit fails instead and its followers fetch on their own.
+ */
+typedef struct flight {
+    char *key;
+    atomic_int refcnt; /* The leader and each follower */
+    int listed;        /* Still in the table, joinable */
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+
+    int state;
+    char *hdrs;             /* As sent to clients, without Connection */
+    ssize_t content_length; /* Or BODY_* */
+    char *body;
+    size_t len, cap, limit;
+
+    int nfollowers;
+    FlightWaiter *waiters;
+    struct flight *next;
+} Flight, *FlightPtr;
+
+typedef struct flight_table {
+    pthread_mutex_t lock;
+    FlightPtr buckets[FLIGHT_BUCKETS];
+} FlightTable, *FlightTablePtr;
+
+int flight_init(FlightTablePtr ft);
+FlightPtr flight_join(FlightTablePtr ft, char *key, size_t limit,
+                      FlightWaiter *w, int *leader);
+
+/* Leader side */
+int flight_headers(FlightTablePtr ft, FlightPtr fp, char *hdrs,
+                   ssize_t content_length);
+int flight_append(FlightTablePtr ft, FlightPtr fp, const void *buf, size_t n);
+void flight_fail(FlightTablePtr ft, FlightPtr fp);
+void flight_finish(FlightTablePtr ft, FlightPtr fp, int ok);
+
+/* Follower side */
+int flight_wait(FlightPtr fp, size_t off);
+int flight_response(FlightPtr fp, char *hdrs, size_t size,
+                    ssize_t *content_length, int *state);
+size_t flight_read(FlightPtr fp, size_t off, char *buf, size_t size,
+                   int *state);
+void flight_leave(FlightPtr fp, FlightWaiter *w);
+
+#endif
@@ -1,7 +1,8 @@
 /*
- * memlib.c - a module that simulates the memory system.  Needed because it
- *            allows us to interleave calls from the student's malloc package
- *            with the system's malloc package in libc.
+ * memlib.c - the arena under the mm allocator. One anonymous mapping of
+ *            the configured size is reserved up front and handed out with
+ *            a private brk pointer, so the cache never competes with libc
+ *            malloc for address space.
  */
 #include <assert.h>
 #include <errno.h>
@@ -17,30 +18,56 @@
 static char *mem_start_brk; /* points to first byte of heap */
 static char *mem_brk;       /* points to last byte of heap */
 static char *mem_max_addr;  /* largest legal heap address */
+static size_t mem_mapped;   /* length of the mapping */
+
+#define HUGE_PAGESIZE (2UL << 20)
 
 /*
- * mem_init - initialize the memory system model
+ * mem_init - map a heap of size bytes. With MEM_HUGEPAGES it is backed by
+ *     explicit huge pages when some are reserved, and otherwise marked
+ *     for transparent huge pages. With MEM_LOCKED every page is faulted
+ *     in and locked, so the heap is never swapped out. Returns -1 with
+ *     errno set on failure.
  */
-void
-mem_init(void)
+int
+mem_init(size_t size, int flags)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-        fprintf(stderr, "mem_init_vm: malloc error\n");
-        exit(1);
+    int prot = PROT_READ | PROT_WRITE, mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *p = MAP_FAILED;
+
+    if (flags & MEM_HUGEPAGES) {
+        /* Reserved, so it fails here rather than SIGBUS when the pool is short */
+        mem_mapped = (size + HUGE_PAGESIZE - 1) & ~(HUGE_PAGESIZE - 1);
+        p = mmap(NULL, mem_mapped, prot, mflags | MAP_HUGETLB, -1, 0);
+    }
+    if (p == MAP_FAILED) {
+        mem_mapped = size;
+        p = mmap(NULL, mem_mapped, prot, mflags | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            return -1;
+        }
+        if (flags & MEM_HUGEPAGES) {
+            madvise(p, mem_mapped, MADV_HUGEPAGE);
+        }
+    }
+    if ((flags & MEM_LOCKED) && mlock(p, mem_mapped) < 0) {
+        munmap(p, mem_mapped);
+        return -1;
     }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP; /* max legal heap address */
-    mem_brk = mem_start_brk;                 /* heap is empty initially */
+    mem_start_brk = p;
+    mem_max_addr = mem_start_brk + size; /* max legal heap address */
+    mem_brk = mem_start_brk;             /* heap is empty initially */
+    return 0;
 }
 
 /*
- * mem_deinit - free the storage used by the memory system model
+ * mem_deinit - unmap the heap
  */
 void
 mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_start_brk, mem_mapped);
 }
 
 /*
@@ -58,13 +85,12 @@ mem_reset_brk()
  *    this model, the heap cannot be shrunk.
  */
 void *
-mem_sbrk(int incr)
+mem_sbrk(size_t incr)
 {
     char *old_brk = mem_brk;
 
-    if ((incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (incr > (size_t)(mem_max_addr - mem_brk)) {
         errno = ENOMEM;
-        fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
         return (void *)-1;
     }
     mem_brk += incr;
@@ -3,15 +3,19 @@
 
 #include <unistd.h>
 
-void mem_init(void);
+int mem_init(size_t size, int flags);
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(size_t incr);
 void mem_reset_brk(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
 
-#define MAX_HEAP 1049000 /* 1MB */
+#define MAX_HEAP 1049000 /* 1MB, heap size when mm_malloc() initializes */
+
+/* mem_init() flags */
+#define MEM_HUGEPAGES 0x1 /* Back the heap with huge pages if possible */
+#define MEM_LOCKED 0x2    /* Lock the heap in RAM */
 
 #endif
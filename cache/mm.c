@@ -1,4 +1,25 @@
-#include <assert.h>
+/*
+ * mm.c - segregated-fit allocator over the memlib arena.
+ *
+ * Blocks carry a boundary tag at both ends and free blocks are coalesced
+ * at once, as in the textbook implicit-list allocator. Free blocks are
+ * also kept on one of NCLASSES doubly linked lists by power-of-two size
+ * class, with a bitmap of the non-empty classes:
+ *
+ *     - malloc looks at a few blocks of the request's own class, then
+ *       takes the head of the first larger non-empty class, which is
+ *       always big enough;
+ *     - free coalesces with its neighbours and pushes the result on its
+ *       class list.
+ *
+ * Both are O(1). The heap is shared by all threads behind one mutex.
+ * Small blocks are first recycled through a per-thread cache, which does
+ * not need the mutex at all. A thread's cache goes back to the heap when
+ * the thread exits.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,22 +28,21 @@
 #include "memlib.h"
 #include "mm.h"
 
-/*
- * If NEXT_FIT defined use next fit search, else use first-fit search
- */
-#define NEXT_FIT
-
-#define WSIZE 4          /* Word and header/footer size (bytes) */
-#define DSIZE 8          /* Double word size (bytes) */
-#define ALIGNMENT DSIZE  /* single word (4) or double word (8) alignment */
+#define WSIZE 8          /* Word and header/footer size (bytes) */
+#define DSIZE 16         /* Double word size (bytes) */
+#define ALIGNMENT DSIZE  /* Payloads are 16-byte aligned */
 #define BTAGS_SIZE DSIZE /* size of header and footer */
-#define MIN_BLKSIZE (ALIGNMENT + BTAGS_SIZE)
-#define ALIGN(size)                                                            \
-    (((size) + (ALIGNMENT - 1)) &                                              \
-     ~0x7) /* rounds up to the nearest multiple of ALIGNMENT */
-#define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
+#define MIN_BLKSIZE (2 * DSIZE) /* Tags plus the free list links */
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(size_t)(ALIGNMENT - 1))
 
-#define CHUNKSIZE (1 << 12) /* Extend heap by this amount (bytes) */
+#define CHUNKSIZE (1 << 16) /* Extend heap by at least this amount (bytes) */
+
+#define NCLASSES 40  /* Class c holds sizes in [2^(c+5), 2^(c+6)) */
+#define FIT_SCAN 8   /* Blocks of the request's own class tried first */
+
+#define TCACHE_MAX 512 /* Largest block kept in a thread cache */
+#define TCACHE_BINS (TCACHE_MAX / ALIGNMENT - 1)
+#define TCACHE_COUNT 4 /* Blocks per thread cache bin */
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
@@ -31,11 +51,11 @@
 #define PACK(size, alloc) ((size) | (alloc))
 
 /* Read and write a word at address p */
-#define GET(p) (*(unsigned int *)(p))
-#define PUT(p, val) (*(unsigned int *)(p) = (val))
+#define GET(p) (*(size_t *)(p))
+#define PUT(p, val) (*(size_t *)(p) = (val))
 
 /* Read the size and allocated fields from address p */
-#define GET_SIZE(p) (GET(p) & ~0x7)
+#define GET_SIZE(p) (GET(p) & ~(size_t)0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
 
 /* Given block ptr bp, compute address of its header and footer */
@@ -46,91 +66,132 @@
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp)-WSIZE)))
 #define PREV_BLKP(bp) ((char *)(bp)-GET_SIZE(((char *)(bp)-DSIZE)))
 
+/* Free list links, kept in the payload of a free block */
+#define PRED(bp) (((char **)(bp))[0])
+#define SUCC(bp) (((char **)(bp))[1])
+
 static char *heap_listp = 0; /* Pointer to first block */
-#ifdef NEXT_FIT
-static char *rover; /* Next fit rover */
-#endif
+static char *free_lists[NCLASSES];
+static uint64_t nonempty; /* Bit c set if free_lists[c] has a block */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_size_t inuse; /* Bytes in blocks handed out */
 
-static void *extend_heap(size_t words);
+/*
+ * Per-thread cache of freed small blocks, one LIFO bin per size. Cached
+ * blocks stay marked allocated in the heap.
+ */
+static __thread char *tcache[TCACHE_BINS];
+static __thread int tcache_count[TCACHE_BINS];
+static __thread int tcache_used; /* Flushed at exit, see tcache_enter() */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static int tcache_keyed;
+
+static int heap_init(size_t heap_size, int flags);
+static size_t adjust_size(size_t size);
+static void *heap_malloc(size_t asize);
+static void heap_free(void *bp);
+static int tcache_enter(void);
+static void tcache_key_init(void);
+static void tcache_exit(void *arg);
+static void tcache_flush(void);
+static void *extend_heap(size_t size);
 static void place(void *bp, size_t asize);
 static void *find_fit(size_t asize);
 static void *coalesce(void *bp);
+static int size_class(size_t size);
+static void list_insert(void *bp);
+static void list_remove(void *bp);
 
 /*
- * mm_init - initialize the malloc package.
+ * mm_init - initialize the malloc package over a heap of heap_size bytes,
+ *     flags are passed on to mem_init().
  */
 int
-mm_init(void)
+mm_init(size_t heap_size, int flags)
 {
-    mem_init();
-    /* Create the initial empty heap */
-    if ((heap_listp = mem_sbrk(4 * WSIZE)) == (void *)-1)
-        return -1;
-    PUT(heap_listp, 0);                            /* Alignment padding */
-    PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1)); /* Prologue header */
-    PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */
-    PUT(heap_listp + (3 * WSIZE), PACK(0, 1));     /* Epilogue header */
-    heap_listp += (2 * WSIZE);
+    int rc;
 
-#ifdef NEXT_FIT
-    rover = heap_listp;
-#endif
-    /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-    if (extend_heap(CHUNKSIZE / WSIZE) == NULL)
-        return -1;
-    return 0;
+    pthread_mutex_lock(&heap_lock);
+    rc = heap_init(heap_size, flags);
+    pthread_mutex_unlock(&heap_lock);
+    return rc;
 }
 
 /*
- * mm_malloc - Allocate a block by incrementing the brk pointer.
- *     Always allocate a block whose size is a multiple of the alignment.
+ * mm_malloc - Allocate a block of at least size bytes, 16-byte aligned.
+ *     Returns NULL once the arena cannot fit it.
  */
 void *
 mm_malloc(size_t size)
 {
-    size_t asize;      /* Adjusted block size */
-    size_t extendsize; /* Amount to extend heap if no fit */
+    size_t asize; /* Adjusted block size */
+    int bin;
     char *bp;
 
-    if (heap_listp == 0) {
-        mm_init();
-    }
-
     /* Ignore spurious requests */
     if (size == 0)
         return NULL;
 
-    /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= ALIGNMENT)
-        asize = MIN_BLKSIZE;
-    else
-        asize = ALIGN(size + BTAGS_SIZE);
-
-    if ((bp = find_fit(asize)) == NULL) {
-        extendsize = MAX(asize, CHUNKSIZE);
-        if ((bp = extend_heap(extendsize / WSIZE)) == NULL) {
+    asize = adjust_size(size);
+    bin = asize / ALIGNMENT - 2;
+    if (asize <= TCACHE_MAX && tcache[bin]) {
+        bp = tcache[bin];
+        tcache[bin] = SUCC(bp);
+        tcache_count[bin]--;
+    } else {
+        pthread_mutex_lock(&heap_lock);
+        if (heap_listp == 0 && heap_init(MAX_HEAP, 0) < 0) {
+            pthread_mutex_unlock(&heap_lock);
             return NULL;
         }
+        bp = heap_malloc(asize);
+        pthread_mutex_unlock(&heap_lock);
+
+        if (bp == NULL) {
+            /* Memory parked in this thread's cache might make it fit */
+            tcache_flush();
+            pthread_mutex_lock(&heap_lock);
+            bp = heap_malloc(asize);
+            pthread_mutex_unlock(&heap_lock);
+            if (bp == NULL)
+                return NULL;
+        }
     }
-    place(bp, asize);
 
+    atomic_fetch_add_explicit(&inuse, GET_SIZE(HDRP(bp)),
+                              memory_order_relaxed);
     return bp;
 }
 
 /*
- * mm_free - Free a block and coalesce if neccessary
+ * mm_free - Free a block, into the thread cache if it is small and there
+ *     is room, otherwise back to the heap
  */
 void
 mm_free(void *ptr)
 {
+    size_t size;
+    int bin;
+
     if (ptr == 0)
         return;
 
-    size_t size = GET_SIZE(HDRP(ptr));
+    size = GET_SIZE(HDRP(ptr));
+    atomic_fetch_sub_explicit(&inuse, size, memory_order_relaxed);
+
+    bin = size / ALIGNMENT - 2;
+    if (size <= TCACHE_MAX && tcache_count[bin] < TCACHE_COUNT &&
+        (tcache_used || tcache_enter())) {
+        SUCC(ptr) = tcache[bin];
+        tcache[bin] = ptr;
+        tcache_count[bin]++;
+        return;
+    }
 
-    PUT(HDRP(ptr), PACK(size, 0));
-    PUT(FTRP(ptr), PACK(size, 0));
-    coalesce(ptr);
+    pthread_mutex_lock(&heap_lock);
+    heap_free(ptr);
+    pthread_mutex_unlock(&heap_lock);
 }
 
 /*
@@ -139,31 +200,26 @@ mm_free(void *ptr)
 void *
 mm_realloc(void *ptr, size_t size)
 {
-    size_t oldsize = 0, asize = 0, extendsize = 0;
-    void *newptr = NULL;
+    size_t oldsize;
+    void *newptr;
 
     if (size == 0) {
         mm_free(ptr);
+        return NULL;
     }
 
     if (ptr == NULL) {
         return mm_malloc(size);
     }
 
-    oldsize = GET_SIZE(HDRP(ptr));
-
-    if (size <= ALIGNMENT)
-        asize = MIN_BLKSIZE;
-    else
-        asize = ALIGN(size + BTAGS_SIZE);
+    oldsize = GET_SIZE(HDRP(ptr)) - BTAGS_SIZE;
+    if (adjust_size(size) == GET_SIZE(HDRP(ptr))) {
+        return ptr;
+    }
 
-    if ((newptr = find_fit(asize)) == NULL) {
-        extendsize = MAX(asize, CHUNKSIZE);
-        if ((newptr = extend_heap(extendsize / WSIZE)) == NULL) {
-            return NULL;
-        }
+    if ((newptr = mm_malloc(size)) == NULL) {
+        return NULL;
     }
-    place(newptr, asize);
     memcpy(newptr, ptr, MIN(size, oldsize));
     mm_free(ptr);
 
@@ -171,16 +227,130 @@ mm_realloc(void *ptr, size_t size)
 }
 
 /*
- * mm_size - Return heap size
+ * mm_size - Return the bytes in allocated blocks, tags included. Blocks
+ *     freed into a thread cache no longer count.
  */
 size_t
 mm_size(void)
 {
-    return mem_heapsize();
+    return atomic_load_explicit(&inuse, memory_order_relaxed);
 }
 
 /*
- * coalesce - Boundary tag coalescing. Return ptr to coalesced block
+ * heap_init - Create the initial empty heap. Called with heap_lock held.
+ */
+static int
+heap_init(size_t heap_size, int flags)
+{
+    if (mem_init(heap_size, flags) < 0)
+        return -1;
+    if ((heap_listp = mem_sbrk(4 * WSIZE)) == (void *)-1)
+        return -1;
+    PUT(heap_listp, 0);                            /* Alignment padding */
+    PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1)); /* Prologue header */
+    PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */
+    PUT(heap_listp + (3 * WSIZE), PACK(0, 1));     /* Epilogue header */
+    heap_listp += (2 * WSIZE);
+    return 0;
+}
+
+/*
+ * adjust_size - Block size for a request of size bytes: room for the
+ *     tags, rounded up to the alignment
+ */
+static size_t
+adjust_size(size_t size)
+{
+    if (size <= ALIGNMENT)
+        return MIN_BLKSIZE;
+    return ALIGN(size + BTAGS_SIZE);
+}
+
+/*
+ * heap_malloc - Take a block of asize bytes from the heap, growing it if
+ *     nothing fits. Called with heap_lock held.
+ */
+static void *
+heap_malloc(size_t asize)
+{
+    char *bp;
+
+    if ((bp = find_fit(asize)) == NULL) {
+        if ((bp = extend_heap(asize)) == NULL) {
+            return NULL;
+        }
+    }
+    place(bp, asize);
+    return bp;
+}
+
+/*
+ * heap_free - Return a block to the heap. Called with heap_lock held.
+ */
+static void
+heap_free(void *bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+
+    PUT(HDRP(bp), PACK(size, 0));
+    PUT(FTRP(bp), PACK(size, 0));
+    list_insert(coalesce(bp));
+}
+
+/*
+ * tcache_enter - Have this thread's cache flushed when the thread exits,
+ *     before it caches its first block. Returns 0 if that cannot be done;
+ *     the thread then frees straight to the heap.
+ */
+static int
+tcache_enter(void)
+{
+    pthread_once(&tcache_once, tcache_key_init);
+    if (!tcache_keyed || pthread_setspecific(tcache_key, &tcache_used)) {
+        return 0;
+    }
+    tcache_used = 1;
+    return 1;
+}
+
+static void
+tcache_key_init(void)
+{
+    tcache_keyed = pthread_key_create(&tcache_key, tcache_exit) == 0;
+}
+
+/*
+ * tcache_exit - Key destructor, run as a thread that cached blocks exits
+ */
+static void
+tcache_exit(void *arg)
+{
+    tcache_flush();
+}
+
+/*
+ * tcache_flush - Hand every block in this thread's cache back to the heap
+ */
+static void
+tcache_flush(void)
+{
+    char *bp;
+    int bin;
+
+    pthread_mutex_lock(&heap_lock);
+    for (bin = 0; bin < TCACHE_BINS; bin++) {
+        while ((bp = tcache[bin])) {
+            tcache[bin] = SUCC(bp);
+            heap_free(bp);
+        }
+        tcache_count[bin] = 0;
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+ * coalesce - Boundary tag coalescing. Neighbours that are merged are
+ *     taken off their free lists; the result is not put on one.
  */
 static void *
 coalesce(void *bp)
@@ -194,12 +364,14 @@ coalesce(void *bp)
     }
 
     else if (prev_alloc && !next_alloc) {
+        list_remove(NEXT_BLKP(bp));
         size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
         PUT(HDRP(bp), PACK(size, 0));
         PUT(FTRP(bp), PACK(size, 0));
     }
 
     else if (!prev_alloc && next_alloc) {
+        list_remove(PREV_BLKP(bp));
         size += GET_SIZE(HDRP(PREV_BLKP(bp)));
         PUT(FTRP(bp), PACK(size, 0));
         PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
@@ -207,33 +379,37 @@ coalesce(void *bp)
     }
 
     else {
+        list_remove(PREV_BLKP(bp));
+        list_remove(NEXT_BLKP(bp));
         size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp)));
         PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
         PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
         bp = PREV_BLKP(bp);
     }
-#ifdef NEXT_FIT
-    /* Make sure the rover isn't pointing into the free block */
-    /* that we just coalesced */
-    if ((rover > (char *)bp) && (rover < NEXT_BLKP(bp)))
-        rover = bp;
-#endif
     return bp;
 }
 
 /*
- * extend_heap - Extend heap with free block and return its block pointer
+ * extend_heap - Grow the heap so that its last block is a free block of
+ *     at least asize bytes, and return that block off the free lists
  */
 static void *
-extend_heap(size_t words)
+extend_heap(size_t asize)
 {
-    char *bp;
-    size_t size;
+    char *bp, *end = (char *)mem_heap_hi() + 1; /* Epilogue's payload */
+    size_t size = asize;
 
-    /* Allocate an even number of words to maintain alignment */
-    size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-    if ((long)(bp = mem_sbrk(size)) == -1)
-        return NULL;
+    /* A free block at the end only needs topping up */
+    if (!GET_ALLOC(end - DSIZE)) {
+        size -= GET_SIZE(end - DSIZE);
+    }
+    size = MAX(size, CHUNKSIZE);
+    if ((bp = mem_sbrk(size)) == (void *)-1) {
+        /* The arena is nearly full, try for the bare minimum */
+        size = asize - (GET_ALLOC(end - DSIZE) ? 0 : GET_SIZE(end - DSIZE));
+        if ((bp = mem_sbrk(size)) == (void *)-1)
+            return NULL;
+    }
 
     /* Initialize free block header/footer and the epilogue header */
     PUT(HDRP(bp), PACK(size, 0));         /* Free block header */
@@ -245,18 +421,21 @@ extend_heap(size_t words)
 }
 
 /*
- * place - Place block of asize bytes at start of free block bp
- *         and split if remainder would be at least minimum block size
+ * place - Place block of asize bytes at start of free block bp, which is
+ *         not on a free list, and split if remainder would be at least
+ *         minimum block size
  */
 static void
 place(void *bp, size_t asize)
 {
     size_t size = GET_SIZE(HDRP(bp));
-    if ((size - asize) >= (2 * DSIZE)) {
+
+    if ((size - asize) >= MIN_BLKSIZE) {
         PUT(HDRP(bp), PACK(asize, 1));
         PUT(FTRP(bp), PACK(asize, 1));
         PUT(HDRP(NEXT_BLKP(bp)), PACK((size - asize), 0));
         PUT(FTRP(NEXT_BLKP(bp)), PACK((size - asize), 0));
+        list_insert(NEXT_BLKP(bp));
     } else {
         PUT(HDRP(bp), PACK(size, 1));
         PUT(FTRP(bp), PACK(size, 1));
@@ -264,38 +443,69 @@ place(void *bp, size_t asize)
 }
 
 /*
- * find_fit - Find a fit for a block with asize bytes
+ * find_fit - Find a free block of at least asize bytes and take it off
+ *     its list. Every block of a larger class fits, so the rest of the
+ *     own class is only searched once there are none.
  */
 static void *
 find_fit(size_t asize)
 {
-#ifdef NEXT_FIT
-    /* Next fit search */
-    char *oldrover = rover;
-
-    /* Search from the rover to the end of list */
-    for (; GET_SIZE(HDRP(rover)) > 0; rover = NEXT_BLKP(rover))
-        if (!GET_ALLOC(HDRP(rover)) && (asize <= GET_SIZE(HDRP(rover))))
-            return rover;
+    int c = size_class(asize), n;
+    uint64_t larger = nonempty & ~((2ULL << c) - 1);
+    char *bp;
 
-    /* search from start of list to old rover */
-    for (rover = heap_listp; rover < oldrover; rover = NEXT_BLKP(rover))
-        if (!GET_ALLOC(HDRP(rover)) && (asize <= GET_SIZE(HDRP(rover))))
-            return rover;
+    for (bp = free_lists[c], n = 0; bp && n < FIT_SCAN; bp = SUCC(bp), n++)
+        if (asize <= GET_SIZE(HDRP(bp)))
+            goto found;
 
-    return NULL; /* no fit found */
-#else
-    /* First fit search */
-    void *bp = heap_listp + DSIZE;
-    size_t size = GET_SIZE(HDRP(bp));
-    int alloc = GET_ALLOC(HDRP(bp));
-    for (; size > 0; bp = NEXT_BLKP(bp)) {
-        size = GET_SIZE(HDRP(bp));
-        alloc = GET_ALLOC(HDRP(bp));
-        if (size >= asize && !alloc) {
-            return bp;
-        }
+    if (larger) {
+        bp = free_lists[__builtin_ctzll(larger)];
+        goto found;
     }
+
+    for (; bp; bp = SUCC(bp))
+        if (asize <= GET_SIZE(HDRP(bp)))
+            goto found;
+
     return NULL; /* no fit found */
-#endif
+
+found:
+    list_remove(bp);
+    return bp;
+}
+
+static int
+size_class(size_t size)
+{
+    int c = 63 - __builtin_clzll(size) - 5;
+
+    return MIN(c, NCLASSES - 1);
+}
+
+static void
+list_insert(void *bp)
+{
+    int c = size_class(GET_SIZE(HDRP(bp)));
+
+    PRED(bp) = NULL;
+    SUCC(bp) = free_lists[c];
+    if (free_lists[c])
+        PRED(free_lists[c]) = bp;
+    free_lists[c] = bp;
+    nonempty |= 1ULL << c;
+}
+
+static void
+list_remove(void *bp)
+{
+    int c = size_class(GET_SIZE(HDRP(bp)));
+
+    if (PRED(bp))
+        SUCC(PRED(bp)) = SUCC(bp);
+    else
+        free_lists[c] = SUCC(bp);
+    if (SUCC(bp))
+        PRED(SUCC(bp)) = PRED(bp);
+    if (free_lists[c] == NULL)
+        nonempty &= ~(1ULL << c);
 }
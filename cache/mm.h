@@ -3,7 +3,7 @@
 
 #include <stdio.h>
 
-int mm_init(void);
+int mm_init(size_t heap_size, int flags);
 void *mm_malloc(size_t size);
 void mm_free(void *ptr);
 void *mm_realloc(void *ptr, size_t size);
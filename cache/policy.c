@@ -0,0 +1,441 @@
+/*
+ * policy.c - eviction and admission policies for cache shards.
+ *
+ * lru: one list in order of insertion; a line hit since eviction last
+ * passed over it goes back to the front instead, CLOCK style.
+ *
+ * tinylfu: W-TinyLFU. New lines enter a small LRU window. When the shard
+ * is full, the line leaving the window only gets into the main list by
+ * evicting its victim if it was asked for more often lately, going by a
+ * count-min sketch of every lookup, see sketch.c. Otherwise it is the one
+ * evicted, so a scan of one-hit URLs only churns the window.
+ *
+ * gdsf: Greedy-Dual-Size-Frequency. The line with the fewest hits per
+ * byte goes first, and each eviction raises the floor new priorities
+ * start from, so lines that stopped being hit age out.
+ */
+#include "policy.h"
+#include <stdlib.h>
+
+#define WINDOW_PERCENT 1 /* Of a shard's lines and bytes */
+
+static void list_push(CacheLinePtr *head, CacheLinePtr *tail,
+                      CacheLinePtr line);
+static void list_unlink(CacheLinePtr *head, CacheLinePtr *tail,
+                        CacheLinePtr line);
+static CacheLinePtr clock_victim(CacheLinePtr *head, CacheLinePtr *tail);
+
+static int lru_init(CacheShardPtr sp);
+static void lru_access(CacheShardPtr sp, CacheLinePtr line,
+                       unsigned long long tag);
+static void lru_insert(CacheShardPtr sp, CacheLinePtr line);
+static void lru_remove(CacheShardPtr sp, CacheLinePtr line);
+static CacheLinePtr lru_victim(CacheShardPtr sp, size_t incoming);
+static CacheLinePtr lru_next(CacheShardPtr sp, CacheLinePtr line);
+
+static int tinylfu_init(CacheShardPtr sp);
+static void tinylfu_access(CacheShardPtr sp, CacheLinePtr line,
+                           unsigned long long tag);
+static void tinylfu_insert(CacheShardPtr sp, CacheLinePtr line);
+static void tinylfu_remove(CacheShardPtr sp, CacheLinePtr line);
+static CacheLinePtr tinylfu_victim(CacheShardPtr sp, size_t incoming);
+static CacheLinePtr tinylfu_next(CacheShardPtr sp, CacheLinePtr line);
+static int window_over(CacheShardPtr sp, size_t incoming);
+static int main_room(CacheShardPtr sp, CacheLinePtr line);
+static void window_to_main(CacheShardPtr sp, CacheLinePtr line);
+
+static int gdsf_init(CacheShardPtr sp);
+static void gdsf_access(CacheShardPtr sp, CacheLinePtr line,
+                        unsigned long long tag);
+static void gdsf_insert(CacheShardPtr sp, CacheLinePtr line);
+static void gdsf_remove(CacheShardPtr sp, CacheLinePtr line);
+static CacheLinePtr gdsf_victim(CacheShardPtr sp, size_t incoming);
+static CacheLinePtr gdsf_next(CacheShardPtr sp, CacheLinePtr line);
+static double gdsf_priority(CacheShardPtr sp, CacheLinePtr line);
+static void heap_up(CacheShardPtr sp, size_t i);
+static void heap_down(CacheShardPtr sp, size_t i);
+static void heap_set(CacheShardPtr sp, size_t i, CacheLinePtr line);
+
+static const CachePolicy policies[] = {
+    [CACHE_POLICY_LRU] = {"lru", lru_init, lru_access, lru_insert,
+                          lru_remove, lru_victim, lru_next},
+    [CACHE_POLICY_TINYLFU] = {"tinylfu", tinylfu_init, tinylfu_access,
+                              tinylfu_insert, tinylfu_remove,
+                              tinylfu_victim, tinylfu_next},
+    [CACHE_POLICY_GDSF] = {"gdsf", gdsf_init, gdsf_access, gdsf_insert,
+                           gdsf_remove, gdsf_victim, gdsf_next},
+};
+
+/*
+ * policy_get - The hooks of a CACHE_POLICY_*, or NULL
+ */
+const CachePolicy *
+policy_get(int policy)
+{
+    if (policy < 0 || (size_t)policy >= sizeof(policies) / sizeof(policies[0])) {
+        return NULL;
+    }
+    return &policies[policy];
+}
+
+/*
+ * LRU
+ */
+
+static int
+lru_init(CacheShardPtr sp)
+{
+    return 0;
+}
+
+static void
+lru_access(CacheShardPtr sp, CacheLinePtr line, unsigned long long tag)
+{
+    if (line) {
+        atomic_store_explicit(&line->referenced, 1, memory_order_relaxed);
+    }
+}
+
+static void
+lru_insert(CacheShardPtr sp, CacheLinePtr line)
+{
+    atomic_store(&line->referenced, 0);
+    list_push(&sp->lru_head, &sp->lru_tail, line);
+}
+
+static void
+lru_remove(CacheShardPtr sp, CacheLinePtr line)
+{
+    list_unlink(&sp->lru_head, &sp->lru_tail, line);
+}
+
+static CacheLinePtr
+lru_victim(CacheShardPtr sp, size_t incoming)
+{
+    return clock_victim(&sp->lru_head, &sp->lru_tail);
+}
+
+static CacheLinePtr
+lru_next(CacheShardPtr sp, CacheLinePtr line)
+{
+    return line ? line->prev : sp->lru_tail;
+}
+
+/*
+ * W-TinyLFU
+ */
+
+static int
+tinylfu_init(CacheShardPtr sp)
+{
+    sp->win_max = sp->nlines * WINDOW_PERCENT / 100;
+    if (sp->win_max < 1) {
+        sp->win_max = 1;
+    }
+    sp->win_budget = sp->budget * WINDOW_PERCENT / 100;
+    return sketch_init(&sp->sketch, sp->nlines);
+}
+
+static void
+tinylfu_access(CacheShardPtr sp, CacheLinePtr line, unsigned long long tag)
+{
+    sketch_add(&sp->sketch, tag);
+    if (line) {
+        atomic_store_explicit(&line->referenced, 1, memory_order_relaxed);
+    }
+}
+
+/*
+ * tinylfu_insert - New lines go to the window. What it overflows with
+ *     moves on to the main list while that has room of its own; the rest
+ *     waits in the window to be judged by tinylfu_victim().
+ */
+static void
+tinylfu_insert(CacheShardPtr sp, CacheLinePtr line)
+{
+    atomic_store(&line->referenced, 0);
+    line->window = 1;
+    list_push(&sp->win_head, &sp->win_tail, line);
+    sp->win_lines++;
+    sp->win_size += OBJECT_SIZE(line->object);
+
+    while (window_over(sp, 0) && sp->win_tail != line &&
+           main_room(sp, sp->win_tail)) {
+        window_to_main(sp, sp->win_tail);
+    }
+}
+
+static void
+tinylfu_remove(CacheShardPtr sp, CacheLinePtr line)
+{
+    if (line->window) {
+        list_unlink(&sp->win_head, &sp->win_tail, line);
+        sp->win_lines--;
+        sp->win_size -= OBJECT_SIZE(line->object);
+    } else {
+        list_unlink(&sp->lru_head, &sp->lru_tail, line);
+        sp->main_lines--;
+        sp->main_size -= OBJECT_SIZE(line->object);
+    }
+}
+
+/*
+ * tinylfu_victim - If the window has to give up a line, it is admitted to
+ *     the main list in place of that list's victim only if its key is
+ *     more popular; the loser is evicted. Otherwise the main list makes
+ *     room.
+ */
+static CacheLinePtr
+tinylfu_victim(CacheShardPtr sp, size_t incoming)
+{
+    CacheLinePtr candidate = sp->win_tail, victim;
+
+    if (candidate && (window_over(sp, incoming) || sp->lru_tail == NULL)) {
+        if (sp->lru_tail == NULL) {
+            return candidate;
+        }
+        victim = clock_victim(&sp->lru_head, &sp->lru_tail);
+        if (sketch_estimate(&sp->sketch, candidate->tag) <=
+            sketch_estimate(&sp->sketch, victim->tag)) {
+            return candidate;
+        }
+        window_to_main(sp, candidate);
+        return victim;
+    }
+    return clock_victim(&sp->lru_head, &sp->lru_tail);
+}
+
+/*
+ * tinylfu_next - The main list from its tail, then the window, which
+ *     holds the most recent lines
+ */
+static CacheLinePtr
+tinylfu_next(CacheShardPtr sp, CacheLinePtr line)
+{
+    if (line == NULL) {
+        return sp->lru_tail ? sp->lru_tail : sp->win_tail;
+    }
+    if (line->prev == NULL && !line->window) {
+        return sp->win_tail;
+    }
+    return line->prev;
+}
+
+/*
+ * window_over - Whether the window would be over its share of the shard
+ *     with incoming more bytes in a new line
+ */
+static int
+window_over(CacheShardPtr sp, size_t incoming)
+{
+    return sp->win_lines + (incoming > 0) > sp->win_max ||
+           sp->win_size + incoming > sp->win_budget;
+}
+
+/*
+ * main_room - Whether line fits in the main list's share of the shard
+ *     without evicting anything
+ */
+static int
+main_room(CacheShardPtr sp, CacheLinePtr line)
+{
+    return sp->main_lines < sp->nlines - sp->win_max &&
+           sp->main_size + OBJECT_SIZE(line->object) <=
+               sp->budget - sp->win_budget;
+}
+
+static void
+window_to_main(CacheShardPtr sp, CacheLinePtr line)
+{
+    list_unlink(&sp->win_head, &sp->win_tail, line);
+    sp->win_lines--;
+    sp->win_size -= OBJECT_SIZE(line->object);
+    line->window = 0;
+    list_push(&sp->lru_head, &sp->lru_tail, line);
+    sp->main_lines++;
+    sp->main_size += OBJECT_SIZE(line->object);
+}
+
+/*
+ * GDSF
+ */
+
+static int
+gdsf_init(CacheShardPtr sp)
+{
+    sp->heap = calloc(sp->nlines, sizeof(CacheLinePtr));
+    return sp->heap ? 0 : -1;
+}
+
+static void
+gdsf_access(CacheShardPtr sp, CacheLinePtr line, unsigned long long tag)
+{
+    if (line) {
+        atomic_fetch_add_explicit(&line->hits, 1, memory_order_relaxed);
+    }
+}
+
+static void
+gdsf_insert(CacheShardPtr sp, CacheLinePtr line)
+{
+    atomic_store(&line->hits, 0);
+    line->scored = 0;
+    line->priority = gdsf_priority(sp, line);
+    heap_set(sp, sp->heap_len++, line);
+    heap_up(sp, line->heap_idx);
+}
+
+static void
+gdsf_remove(CacheShardPtr sp, CacheLinePtr line)
+{
+    CacheLinePtr moved;
+    size_t i = line->heap_idx;
+
+    /* The last line fills the hole, then goes whichever way it must */
+    if (i != --sp->heap_len) {
+        moved = sp->heap[sp->heap_len];
+        heap_set(sp, i, moved);
+        heap_up(sp, i);
+        heap_down(sp, moved->heap_idx);
+    }
+    sp->heap[sp->heap_len] = NULL;
+}
+
+/*
+ * gdsf_victim - The lowest priority line. Hits only bump a counter, so a
+ *     line hit since it was last scored is scored again, from the current
+ *     floor, and sifted down before it can be taken.
+ */
+static CacheLinePtr
+gdsf_victim(CacheShardPtr sp, size_t incoming)
+{
+    CacheLinePtr line;
+    unsigned int hits;
+
+    while (sp->heap_len > 0) {
+        line = sp->heap[0];
+        hits = atomic_load_explicit(&line->hits, memory_order_relaxed);
+        if (hits != line->scored) {
+            line->scored = hits;
+            line->priority = gdsf_priority(sp, line);
+            heap_down(sp, 0);
+            continue;
+        }
+        sp->inflation = line->priority;
+        return line;
+    }
+    return NULL;
+}
+
+/*
+ * gdsf_next - Heap order, which puts every line before the lines below it
+ */
+static CacheLinePtr
+gdsf_next(CacheShardPtr sp, CacheLinePtr line)
+{
+    size_t i = line ? line->heap_idx + 1 : 0;
+
+    return i < sp->heap_len ? sp->heap[i] : NULL;
+}
+
+/*
+ * gdsf_priority - The floor plus hits per KB, so that frequency weighs
+ *     against the room a line takes
+ */
+static double
+gdsf_priority(CacheShardPtr sp, CacheLinePtr line)
+{
+    return sp->inflation +
+           (line->scored + 1.0) * 1024 / OBJECT_SIZE(line->object);
+}
+
+static void
+heap_up(CacheShardPtr sp, size_t i)
+{
+    CacheLinePtr line = sp->heap[i];
+
+    while (i > 0 && sp->heap[(i - 1) / 2]->priority > line->priority) {
+        heap_set(sp, i, sp->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_set(sp, i, line);
+}
+
+static void
+heap_down(CacheShardPtr sp, size_t i)
+{
+    CacheLinePtr line = sp->heap[i];
+    size_t child;
+
+    while ((child = 2 * i + 1) < sp->heap_len) {
+        if (child + 1 < sp->heap_len &&
+            sp->heap[child + 1]->priority < sp->heap[child]->priority) {
+            child++;
+        }
+        if (sp->heap[child]->priority >= line->priority) {
+            break;
+        }
+        heap_set(sp, i, sp->heap[child]);
+        i = child;
+    }
+    heap_set(sp, i, line);
+}
+
+static void
+heap_set(CacheShardPtr sp, size_t i, CacheLinePtr line)
+{
+    sp->heap[i] = line;
+    line->heap_idx = i;
+}
+
+/*
+ * Lists, most recent at the head
+ */
+
+static void
+list_push(CacheLinePtr *head, CacheLinePtr *tail, CacheLinePtr line)
+{
+    line->prev = NULL;
+    line->next = *head;
+    if (*head) {
+        (*head)->prev = line;
+    } else {
+        *tail = line;
+    }
+    *head = line;
+}
+
+static void
+list_unlink(CacheLinePtr *head, CacheLinePtr *tail, CacheLinePtr line)
+{
+    if (line->prev) {
+        line->prev->next = line->next;
+    } else {
+        *head = line->next;
+    }
+    if (line->next) {
+        line->next->prev = line->prev;
+    } else {
+        *tail = line->prev;
+    }
+    line->prev = line->next = NULL;
+}
+
+/*
+ * clock_victim - The line at the tail, after giving every line there hit
+ *     since the last pass a second chance at the head. NULL if empty.
+ */
+static CacheLinePtr
+clock_victim(CacheLinePtr *head, CacheLinePtr *tail)
+{
+    CacheLinePtr line;
+
+    while ((line = *tail)) {
+        if (!atomic_exchange(&line->referenced, 0)) {
+            return line;
+        }
+        list_unlink(head, tail, line);
+        list_push(head, tail, line);
+    }
+    return NULL;
+}
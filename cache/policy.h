@@ -0,0 +1,29 @@
+#ifndef POLICY_h
+#define POLICY_h
+
+#include "cache.h"
+
+/*
+ * How a shard picks the line to evict. Every hook but access runs with
+ * the shard's write lock held. access runs on every lookup, with line
+ * NULL on a miss, under the shared lock, so it may only touch atomics.
+ */
+typedef struct cache_policy {
+    const char *name;
+    int (*init)(CacheShardPtr sp);
+    void (*access)(CacheShardPtr sp, CacheLinePtr line,
+                   unsigned long long tag);
+    void (*insert)(CacheShardPtr sp, CacheLinePtr line);
+    void (*remove)(CacheShardPtr sp, CacheLinePtr line);
+    /* The next line to evict to make room for incoming more bytes */
+    CacheLinePtr (*victim)(CacheShardPtr sp, size_t incoming);
+    /*
+     * The lines roughly in the order they would be evicted, the one after
+     * line, or the first if line is NULL. Only reads, under either lock.
+     */
+    CacheLinePtr (*next)(CacheShardPtr sp, CacheLinePtr line);
+} CachePolicy;
+
+const CachePolicy *policy_get(int policy);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ * sketch.c - frequency estimates for W-TinyLFU admission, see policy.c.
+ */
+#include "sketch.h"
+#include <stdlib.h>
+
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+static unsigned long long mix(unsigned long long key);
+static void sketch_halve(SketchPtr sk);
+
+/*
+ * sketch_init - Size the sketch for a cache of about nkeys keys: the
+ *     counters are halved every 10 * nkeys additions.
+ */
+int
+sketch_init(SketchPtr sk, size_t nkeys)
+{
+    size_t i;
+
+    sk->width = 64;
+    while (sk->width < 4 * nkeys) {
+        sk->width <<= 1;
+    }
+    sk->door_bits = 8 * sk->width;
+    sk->counters = calloc(SKETCH_DEPTH * sk->width, sizeof(atomic_uchar));
+    sk->door = calloc(sk->door_bits / WORD_BITS, sizeof(atomic_ulong));
+    if (sk->counters == NULL || sk->door == NULL) {
+        return -1;
+    }
+    for (i = 0; i < SKETCH_DEPTH * sk->width; i++) {
+        atomic_init(&sk->counters[i], 0);
+    }
+    for (i = 0; i < sk->door_bits / WORD_BITS; i++) {
+        atomic_init(&sk->door[i], 0);
+    }
+    atomic_init(&sk->additions, 0);
+    sk->sample_size = 10 * (nkeys ? nkeys : 1);
+    return 0;
+}
+
+/*
+ * sketch_add - Count one more request for key. The first since the last
+ *     halving only sets its doorkeeper bits.
+ */
+void
+sketch_add(SketchPtr sk, unsigned long long key)
+{
+    unsigned long long h = mix(key), h2 = (h >> 32) | 1;
+    unsigned long bit1 = h & (sk->door_bits - 1);
+    unsigned long bit2 = (h >> 20) & (sk->door_bits - 1);
+    unsigned long mask1 = 1UL << (bit1 % WORD_BITS);
+    unsigned long mask2 = 1UL << (bit2 % WORD_BITS);
+    atomic_uchar *c;
+    int i, seen;
+
+    seen = (atomic_fetch_or_explicit(&sk->door[bit1 / WORD_BITS], mask1,
+                                     memory_order_relaxed) &
+            mask1) != 0;
+    seen &= (atomic_fetch_or_explicit(&sk->door[bit2 / WORD_BITS], mask2,
+                                      memory_order_relaxed) &
+             mask2) != 0;
+    if (seen) {
+        for (i = 0; i < SKETCH_DEPTH; i++) {
+            c = &sk->counters[i * sk->width + ((h + i * h2) & (sk->width - 1))];
+            if (atomic_load_explicit(c, memory_order_relaxed) < SKETCH_MAX) {
+                atomic_fetch_add_explicit(c, 1, memory_order_relaxed);
+            }
+        }
+    }
+
+    /* Exactly one caller sees the count reach the sample size */
+    if (atomic_fetch_add_explicit(&sk->additions, 1, memory_order_relaxed) +
+            1 ==
+        sk->sample_size) {
+        sketch_halve(sk);
+    }
+}
+
+/*
+ * sketch_estimate - About how often key was added lately: the smallest of
+ *     its counters, plus one if the doorkeeper has seen it
+ */
+int
+sketch_estimate(SketchPtr sk, unsigned long long key)
+{
+    unsigned long long h = mix(key), h2 = (h >> 32) | 1;
+    unsigned long bit1 = h & (sk->door_bits - 1);
+    unsigned long bit2 = (h >> 20) & (sk->door_bits - 1);
+    int i, n, min = SKETCH_MAX + 1;
+
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        n = atomic_load_explicit(
+            &sk->counters[i * sk->width + ((h + i * h2) & (sk->width - 1))],
+            memory_order_relaxed);
+        if (n < min) {
+            min = n;
+        }
+    }
+    if ((atomic_load_explicit(&sk->door[bit1 / WORD_BITS],
+                              memory_order_relaxed) &
+         1UL << (bit1 % WORD_BITS)) &&
+        (atomic_load_explicit(&sk->door[bit2 / WORD_BITS],
+                              memory_order_relaxed) &
+         1UL << (bit2 % WORD_BITS))) {
+        min++;
+    }
+    return min;
+}
+
+/*
+ * sketch_halve - Age every count and forget the doorkeeper
+ */
+static void
+sketch_halve(SketchPtr sk)
+{
+    size_t i;
+    unsigned char n;
+
+    for (i = 0; i < SKETCH_DEPTH * sk->width; i++) {
+        n = atomic_load_explicit(&sk->counters[i], memory_order_relaxed);
+        atomic_store_explicit(&sk->counters[i], n >> 1, memory_order_relaxed);
+    }
+    for (i = 0; i < sk->door_bits / WORD_BITS; i++) {
+        atomic_store_explicit(&sk->door[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&sk->additions, 0, memory_order_relaxed);
+}
+
+/*
+ * mix - Spread the bits of a key. The tags of one shard share their high
+ *     bits, see find_shard().
+ */
+static unsigned long long
+mix(unsigned long long key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
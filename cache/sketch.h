@@ -0,0 +1,34 @@
+#ifndef SKETCH_h
+#define SKETCH_h
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define SKETCH_DEPTH 4 /* Rows, each indexed by its own hash */
+#define SKETCH_MAX 15  /* Counters saturate here, as 4-bit ones would */
+
+/*
+ * A count-min sketch of how often keys were asked for lately. Once
+ * sample_size keys have been added every counter is halved, so old
+ * popularity fades. A doorkeeper Bloom filter takes the first sighting of
+ * a key, which keeps one-hit wonders out of the counters altogether; it
+ * is cleared with each halving.
+ *
+ * Keys are added by readers holding only a shared lock, so counters are
+ * updated with relaxed atomics. An update lost to a race, or to a
+ * concurrent halving, only skews an estimate.
+ */
+typedef struct sketch {
+    atomic_uchar *counters; /* SKETCH_DEPTH rows of width */
+    size_t width;           /* A power of two */
+    atomic_ulong *door;     /* Doorkeeper bits */
+    size_t door_bits;       /* A power of two */
+    atomic_size_t additions;
+    size_t sample_size;
+} Sketch, *SketchPtr;
+
+int sketch_init(SketchPtr sk, size_t nkeys);
+void sketch_add(SketchPtr sk, unsigned long long key);
+int sketch_estimate(SketchPtr sk, unsigned long long key);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * slab.c - log-structured storage in fixed-size segments, carved from
+ *          the memlib arena.
+ *
+ * Each item is prefixed with its size so a segment can be walked when it
+ * is evicted. Allocation bumps a pointer in the open segment; when it is
+ * full it is sealed and a free segment opened. With no free segment the
+ * policy picks a sealed victim. Its items are passed to the evict
+ * callback, which drops the cache's references to them, and it becomes
+ * free once the last reader has released its items as well.
+ */
+#include "slab.h"
+#include "memlib.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+#define ITEM_HDR 16 /* Keeps items 16-byte aligned */
+#define ITEM_ALIGN(size) (((size) + 15) & ~(size_t)15)
+#define ITEM_SIZE(item) (*(size_t *)((char *)(item)-ITEM_HDR))
+
+static SlabSegment *find_segment(SlabPtr sp, void *item);
+static long find_victim(SlabPtr sp);
+static void evict_segment(SlabPtr sp, size_t idx);
+
+/*
+ * slab_init - Map an arena for at least SLAB_MIN_SEGMENTS segments
+ *     totalling about size bytes, each big enough for an item of max_item
+ *     bytes. flags are passed on to mem_init(). evict is called with arg
+ *     for every item of a segment being recycled.
+ */
+int
+slab_init(SlabPtr sp, size_t size, size_t max_item, int policy, int flags,
+          void (*evict)(void *arg, void *item), void *arg)
+{
+    size_t i, page = mem_pagesize();
+
+    sp->seg_size = size / SLAB_MIN_SEGMENTS;
+    if (sp->seg_size > SLAB_SEGMENT_MAX) {
+        sp->seg_size = SLAB_SEGMENT_MAX;
+    }
+    if (sp->seg_size < ITEM_HDR + ITEM_ALIGN(max_item)) {
+        sp->seg_size = ITEM_HDR + ITEM_ALIGN(max_item);
+    }
+    sp->seg_size = (sp->seg_size + page - 1) & ~(page - 1);
+    sp->nsegs = size / sp->seg_size;
+    if (sp->nsegs < 2) {
+        sp->nsegs = 2; /* One open while the other drains */
+    }
+
+    if (mem_init(sp->nsegs * sp->seg_size, flags) < 0) {
+        return -1;
+    }
+    if ((sp->base = mem_sbrk(sp->nsegs * sp->seg_size)) == (void *)-1) {
+        return -1;
+    }
+    if ((sp->segs = calloc(sp->nsegs, sizeof(SlabSegment))) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < sp->nsegs; i++) {
+        atomic_init(&sp->segs[i].live, 0);
+    }
+
+    sp->policy = policy;
+    sp->open = 0;
+    sp->segs[0].state = SEG_OPEN;
+    sp->seq = 0;
+    sp->evict = evict;
+    sp->arg = arg;
+    return pthread_mutex_init(&sp->lock, NULL) ? -1 : 0;
+}
+
+/*
+ * slab_alloc - Append an item of size bytes, recycling segments as
+ *     needed. Must not be called with any lock the evict callback takes.
+ *     Returns NULL only if the item cannot fit in a segment, or if
+ *     readers still pin every segment.
+ */
+void *
+slab_alloc(SlabPtr sp, size_t size)
+{
+    size_t asize = ITEM_HDR + ITEM_ALIGN(size), i;
+    SlabSegment *seg;
+    char *item;
+    long victim;
+
+    if (asize > sp->seg_size) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sp->lock);
+    while (sp->segs[sp->open].used + asize > sp->seg_size) {
+        /* Seal the open segment and move on to a free one */
+        for (i = 0; i < sp->nsegs && sp->segs[i].state != SEG_FREE; i++)
+            ;
+        if (i < sp->nsegs) {
+            sp->segs[sp->open].state = SEG_SEALED;
+            sp->segs[sp->open].seq = sp->seq++;
+            sp->open = i;
+            sp->segs[i].state = SEG_OPEN;
+            sp->segs[i].used = 0;
+            continue;
+        }
+
+        if ((victim = find_victim(sp)) < 0) {
+            pthread_mutex_unlock(&sp->lock);
+            return NULL;
+        }
+        sp->segs[victim].state = SEG_EVICTING;
+        pthread_mutex_unlock(&sp->lock);
+
+        evict_segment(sp, victim);
+
+        pthread_mutex_lock(&sp->lock);
+        seg = &sp->segs[victim];
+        seg->state = atomic_load(&seg->live) ? SEG_DRAINING : SEG_FREE;
+    }
+
+    seg = &sp->segs[sp->open];
+    item = sp->base + sp->open * sp->seg_size + seg->used + ITEM_HDR;
+    ITEM_SIZE(item) = asize;
+    seg->used += asize;
+    atomic_fetch_add(&seg->live, asize);
+    pthread_mutex_unlock(&sp->lock);
+
+    return item;
+}
+
+/*
+ * slab_free - The item is no longer referenced. The last item of an
+ *     evicted segment frees the segment.
+ */
+void
+slab_free(SlabPtr sp, void *item)
+{
+    SlabSegment *seg = find_segment(sp, item);
+    size_t size = ITEM_SIZE(item);
+
+    if (atomic_fetch_sub(&seg->live, size) == size) {
+        pthread_mutex_lock(&sp->lock);
+        if (seg->state == SEG_DRAINING) {
+            seg->state = SEG_FREE;
+        }
+        pthread_mutex_unlock(&sp->lock);
+    }
+}
+
+/*
+ * slab_size - Bytes held by items not yet freed, headers included
+ */
+size_t
+slab_size(SlabPtr sp)
+{
+    size_t i, size = 0;
+
+    for (i = 0; i < sp->nsegs; i++) {
+        size += atomic_load_explicit(&sp->segs[i].live, memory_order_relaxed);
+    }
+    return size;
+}
+
+static SlabSegment *
+find_segment(SlabPtr sp, void *item)
+{
+    return &sp->segs[((char *)item - sp->base) / sp->seg_size];
+}
+
+/*
+ * find_victim - Index of the sealed segment to recycle, or -1 if there is
+ *     none. Called with sp->lock held.
+ */
+static long
+find_victim(SlabPtr sp)
+{
+    size_t i, live, best_live = 0;
+    long best = -1;
+
+    for (i = 0; i < sp->nsegs; i++) {
+        if (sp->segs[i].state != SEG_SEALED) {
+            continue;
+        }
+        live = sp->policy == SLAB_FIFO ? 0 : atomic_load(&sp->segs[i].live);
+        if (best < 0 || live < best_live ||
+            (live == best_live && sp->segs[i].seq < sp->segs[best].seq)) {
+            best = i;
+            best_live = live;
+        }
+    }
+    return best;
+}
+
+/*
+ * evict_segment - Pass every item of segment idx to the evict callback.
+ *     Items already freed are passed too; the callback has to tell.
+ */
+static void
+evict_segment(SlabPtr sp, size_t idx)
+{
+    char *start = sp->base + idx * sp->seg_size;
+    char *end = start + sp->segs[idx].used;
+    char *item;
+
+    for (item = start + ITEM_HDR; item < end; item += ITEM_SIZE(item)) {
+        sp->evict(sp->arg, item);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef SLAB_h
+#define SLAB_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define SLAB_SEGMENT_MAX (8UL << 20) /* Upper bound on the segment size */
+#define SLAB_MIN_SEGMENTS 8
+
+/* Which sealed segment slab_alloc() recycles when none is free */
+#define SLAB_LEAST_USED 0 /* Fewest live bytes, oldest on a tie */
+#define SLAB_FIFO 1       /* Oldest */
+
+/* Segment states */
+#define SEG_FREE 0
+#define SEG_OPEN 1     /* Being appended to */
+#define SEG_SEALED 2   /* Full, its items may still be live */
+#define SEG_EVICTING 3 /* Its items are being dropped from the cache */
+#define SEG_DRAINING 4 /* Evicted, waiting for readers to let go */
+
+typedef struct slab_segment {
+    int state;
+    unsigned long seq;  /* Order in which segments were sealed */
+    size_t used;        /* Bytes appended so far */
+    atomic_size_t live; /* Bytes of items not yet freed */
+} SlabSegment;
+
+/*
+ * Log-structured storage: items are appended to the open segment and
+ * never freed one by one, so there is no external fragmentation. Space
+ * comes back a whole segment at a time. Evicting a segment hands every
+ * item in it to the evict callback; the segment is reused once all its
+ * items have been passed to slab_free().
+ */
+typedef struct slab {
+    char *base;
+    size_t seg_size, nsegs;
+    SlabSegment *segs;
+    int policy;
+    pthread_mutex_t lock;
+    size_t open; /* Index of the open segment */
+    unsigned long seq;
+    void (*evict)(void *arg, void *item);
+    void *arg;
+} Slab, *SlabPtr;
+
+int slab_init(SlabPtr sp, size_t size, size_t max_item, int policy,
+              int flags, void (*evict)(void *arg, void *item), void *arg);
+void *slab_alloc(SlabPtr sp, size_t size);
+void slab_free(SlabPtr sp, void *item);
+size_t slab_size(SlabPtr sp);
+
+#endif
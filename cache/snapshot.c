@@ -0,0 +1,249 @@
+/*
+ * snapshot.c - the memory tier of the cache saved to a file, and loaded
+ *              back when the proxy starts.
+ *
+ * snapshot_save() takes each shard's objects under its read lock, in the
+ * order the shard would evict them, and writes them once the lock is
+ * dropped, to a temporary file renamed over the old snapshot when it is
+ * complete. A crash midway leaves the previous snapshot.
+ *
+ * snapshot_load() maps the file and has a few threads insert the records
+ * with cache_restore(), section by section, least valuable first so the
+ * policy ends up ranking them as before. The proxy serves meanwhile, and
+ * a response cached again in the meantime is not replaced.
+ */
+#define _GNU_SOURCE
+#include "snapshot.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_LOADERS 8 /* Most threads loading sections at once */
+
+/* A mapped snapshot being loaded, freed by the last loader to finish */
+typedef struct loader {
+    CachePtr cp;
+    char *map;
+    size_t size;
+    SnapshotSection *sections;
+    uint32_t nsections;
+    atomic_uint next;  /* Section the next idle loader takes */
+    atomic_int active; /* Loaders still running */
+} Loader;
+
+static void *loader_thread(void *vargp);
+static void load_section(Loader *lp, SnapshotSection *sec);
+static int write_shard(CachePtr cp, size_t i, FILE *fp, CacheObjectPtr *ops,
+                       time_t *expires, SnapshotSection *sec);
+
+/*
+ * snapshot_save - Write the objects in memory to path. Returns how many
+ *     were saved, or -1 with the old snapshot left as it was.
+ */
+long
+snapshot_save(CachePtr cp, const char *path)
+{
+    char tmp[PATH_MAX];
+    SnapshotHeader hdr = {.magic = SNAPSHOT_MAGIC};
+    SnapshotSection *sections;
+    CacheObjectPtr *ops;
+    time_t *expires;
+    size_t i, nlines = 0;
+    long saved = 0;
+    FILE *fp = NULL;
+    int err = 0;
+
+    for (i = 0; i < cp->nshards; i++) {
+        if (cp->shards[i].nlines > nlines) {
+            nlines = cp->shards[i].nlines;
+        }
+    }
+    sections = calloc(cp->nshards, sizeof(SnapshotSection));
+    ops = malloc(nlines * sizeof(CacheObjectPtr));
+    expires = malloc(nlines * sizeof(time_t));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (sections == NULL || ops == NULL || expires == NULL ||
+        (fp = fopen(tmp, "w")) == NULL) {
+        err = 1;
+    }
+
+    /* The header and section table are written again once known */
+    hdr.nsections = cp->nshards;
+    err = err || fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+          fwrite(sections, sizeof(SnapshotSection), cp->nshards, fp) !=
+              cp->nshards;
+    for (i = 0; i < cp->nshards && !err; i++) {
+        err = write_shard(cp, i, fp, ops, expires, &sections[i]) < 0;
+        saved += sections[i].count;
+    }
+    err = err || fseeko(fp, sizeof(hdr), SEEK_SET) < 0 ||
+          fwrite(sections, sizeof(SnapshotSection), cp->nshards, fp) !=
+              cp->nshards ||
+          fflush(fp) == EOF || fsync(fileno(fp)) < 0;
+
+    if (fp && fclose(fp) == EOF) {
+        err = 1;
+    }
+    if (fp && (err || rename(tmp, path) < 0)) {
+        unlink(tmp);
+        err = 1;
+    }
+    free(sections);
+    free(ops);
+    free(expires);
+    return err ? -1 : saved;
+}
+
+/*
+ * snapshot_load - Map the snapshot at path and start loading it into the
+ *     cache in the background. Returns how many objects it holds, or -1
+ *     if there is none or it is not a snapshot.
+ */
+long
+snapshot_load(CachePtr cp, const char *path)
+{
+    SnapshotHeader hdr;
+    Loader *lp;
+    pthread_t tid;
+    struct stat st;
+    long count = 0;
+    uint32_t i, nthreads;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr) ||
+        (lp = calloc(1, sizeof(Loader))) == NULL) {
+        close(fd);
+        return -1;
+    }
+    lp->cp = cp;
+    lp->size = st.st_size;
+    lp->map = mmap(NULL, lp->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (lp->map == MAP_FAILED) {
+        free(lp);
+        return -1;
+    }
+
+    memcpy(&hdr, lp->map, sizeof(hdr));
+    if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+        hdr.nsections > (lp->size - sizeof(hdr)) / sizeof(SnapshotSection)) {
+        munmap(lp->map, lp->size);
+        free(lp);
+        return -1;
+    }
+    madvise(lp->map, lp->size, MADV_SEQUENTIAL);
+    lp->sections = (SnapshotSection *)(lp->map + sizeof(hdr));
+    lp->nsections = hdr.nsections;
+    for (i = 0; i < lp->nsections; i++) {
+        count += lp->sections[i].count;
+    }
+
+    nthreads = lp->nsections < SNAPSHOT_LOADERS ? lp->nsections
+                                                : SNAPSHOT_LOADERS;
+    atomic_init(&lp->next, 0);
+    atomic_init(&lp->active, nthreads + 1);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&tid, NULL, loader_thread, lp) != 0) {
+            atomic_fetch_sub(&lp->active, 1);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    /* Let go of our own count, in case no loader could be started */
+    if (atomic_fetch_sub(&lp->active, 1) == 1) {
+        munmap(lp->map, lp->size);
+        free(lp);
+    }
+    return count;
+}
+
+/*
+ * loader_thread - Load sections until none is left
+ */
+static void *
+loader_thread(void *vargp)
+{
+    Loader *lp = (Loader *)vargp;
+    unsigned int i;
+
+    while ((i = atomic_fetch_add(&lp->next, 1)) < lp->nsections) {
+        load_section(lp, &lp->sections[i]);
+    }
+    if (atomic_fetch_sub(&lp->active, 1) == 1) {
+        munmap(lp->map, lp->size);
+        free(lp);
+    }
+    return NULL;
+}
+
+/*
+ * load_section - Insert the records of sec, stopping at the first one
+ *     that runs past the end of the file
+ */
+static void
+load_section(Loader *lp, SnapshotSection *sec)
+{
+    SnapshotRecord rec;
+    size_t off = sec->offset, left;
+    uint64_t i;
+    char *data;
+
+    for (i = 0; i < sec->count; i++) {
+        if (off > lp->size || lp->size - off < sizeof(rec)) {
+            return;
+        }
+        memcpy(&rec, lp->map + off, sizeof(rec)); /* May be unaligned */
+        off += sizeof(rec);
+        left = lp->size - off;
+        if (rec.hdr_len > left || rec.content_length > left - rec.hdr_len ||
+            rec.key_len > left - rec.hdr_len - rec.content_length) {
+            return;
+        }
+        data = lp->map + off;
+        cache_restore(lp->cp, data + rec.hdr_len + rec.content_length,
+                      rec.key_len, data, rec.hdr_len, data + rec.hdr_len,
+                      rec.content_length, rec.expires);
+        off += rec.hdr_len + rec.content_length + rec.key_len;
+    }
+}
+
+/*
+ * write_shard - Append the records of shard i to fp, filling in sec.
+ *     ops and expires have room for the shard's lines. Returns -1 on a
+ *     write error.
+ */
+static int
+write_shard(CachePtr cp, size_t i, FILE *fp, CacheObjectPtr *ops,
+            time_t *expires, SnapshotSection *sec)
+{
+    SnapshotRecord rec;
+    CacheObjectPtr op;
+    size_t j, n, len;
+    off_t offset;
+    int err = 0;
+
+    if ((offset = ftello(fp)) < 0) {
+        return -1;
+    }
+    sec->offset = offset;
+    n = cache_export(cp, i, ops, expires);
+    for (j = 0; j < n; j++) {
+        op = ops[j];
+        rec.expires = expires[j];
+        rec.hdr_len = op->hdr_len;
+        rec.content_length = op->content_length;
+        rec.key_len = op->key_len;
+        len = op->hdr_len + op->content_length + op->key_len;
+        /* Headers, body and key are laid out one after the other */
+        err = err || fwrite(&rec, sizeof(rec), 1, fp) != 1 ||
+              fwrite(OBJECT_HDRS(op), 1, len, fp) != len;
+        cache_release(cp, op);
+    }
+    sec->count = n;
+    return err ? -1 : 0;
+}
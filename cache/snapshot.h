@@ -0,0 +1,36 @@
+#ifndef SNAPSHOT_h
+#define SNAPSHOT_h
+
+#include "cache.h"
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC "PXSNAP01"
+#define SNAPSHOT_INTERVAL 0 /* Default seconds between snapshots, 0: on exit */
+
+/*
+ * A snapshot file: this header, a SnapshotSection per shard saved, then
+ * the sections' records. Each record is followed by the headers, body
+ * and key of its object, and sections list them in the order the shard
+ * would have evicted them. Fields are in host byte order, a snapshot is
+ * only meant for the machine that wrote it.
+ */
+typedef struct snapshot_header {
+    char magic[8];
+    uint32_t nsections;
+    uint32_t reserved;
+} SnapshotHeader;
+
+typedef struct snapshot_section {
+    uint64_t offset; /* Of its first record, from the start of the file */
+    uint64_t count;
+} SnapshotSection;
+
+typedef struct snapshot_record {
+    int64_t expires;
+    uint64_t hdr_len, content_length, key_len;
+} SnapshotRecord;
+
+long snapshot_save(CachePtr cp, const char *path);
+long snapshot_load(CachePtr cp, const char *path);
+
+#endif
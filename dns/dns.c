@@ -0,0 +1,429 @@
+/*
+ * dns.c - cache of resolved origin addresses.
+ *
+ * Names are resolved with getaddrinfo(), so /etc/hosts and numeric
+ * addresses work as before. getaddrinfo() does not report TTLs, so a name
+ * that resolved is also queried with res_query() for the TTL of its
+ * answer; if that fails the entry gets DNS_DEFAULT_TTL. Lookups copy the
+ * addresses out under the shard's read lock. Refreshes are queued for one
+ * background thread, at most once per entry, and a failed refresh leaves
+ * the old answer in place until it expires.
+ *
+ * dns_resolve() queues a name for that thread too, for the event loops,
+ * which must not block in getaddrinfo(). A name already queued or being
+ * resolved is not queued again, the caller's wakeup is only added to it,
+ * and once the answer is stored, failures included, every wakeup is run.
+ */
+#define _GNU_SOURCE
+#include "dns.h"
+#include "../metrics/metrics.h"
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <resolv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static DnsShard *find_shard(DnsCachePtr dc, const char *host,
+                            DnsEntry ***bucket);
+static DnsEntry **find_entry(DnsEntry **bucket, const char *host);
+static DnsEntry *resolve(DnsCachePtr dc, char *host);
+static time_t answer_ttl(char *host, int family);
+static void store(DnsCachePtr dc, DnsEntry *ep);
+static int copy_addrs(DnsEntry *ep, DnsAddr *addrs, int max);
+static DnsRefresh *queue_resolve(DnsCachePtr dc, char *host);
+static void *refresh_loop(void *vargp);
+static void free_entry(DnsEntry *ep);
+static time_t now_sec(void);
+
+int
+dns_init(DnsCachePtr dc, int min_ttl)
+{
+    pthread_t tid;
+    int i;
+
+    memset(dc->shards, 0, sizeof(dc->shards));
+    for (i = 0; i < DNS_SHARDS; i++) {
+        if (pthread_rwlock_init(&dc->shards[i].lock, NULL)) {
+            return -1;
+        }
+    }
+    dc->min_ttl = min_ttl;
+    dc->queue = dc->current = NULL;
+    if (pthread_mutex_init(&dc->lock, NULL) ||
+        pthread_cond_init(&dc->ready, NULL)) {
+        return -1;
+    }
+    if (pthread_create(&tid, NULL, refresh_loop, dc)) {
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/*
+ * dns_lookup - Copy up to max addresses of host into addrs, resolving it
+ *     first if it is not cached or has expired. Returns how many were
+ *     copied, or -1 if host does not resolve.
+ */
+int
+dns_lookup(DnsCachePtr dc, char *host, DnsAddr *addrs, int max)
+{
+    DnsEntry *ep;
+    int n;
+
+    if ((n = dns_cached(dc, host, addrs, max)) != DNS_PENDING) {
+        return n;
+    }
+    if ((ep = resolve(dc, host)) == NULL) {
+        return -1;
+    }
+    n = copy_addrs(ep, addrs, max);
+    store(dc, ep);
+    return n;
+}
+
+/*
+ * dns_cached - Like dns_lookup(), but never resolves: returns DNS_PENDING
+ *     if host is not cached or has expired
+ */
+int
+dns_cached(DnsCachePtr dc, char *host, DnsAddr *addrs, int max)
+{
+    time_t now = now_sec();
+    DnsEntry **bucket, *ep;
+    DnsShard *sp = find_shard(dc, host, &bucket);
+    int n, expected = 0, refresh = 0;
+
+    pthread_rwlock_rdlock(&sp->lock);
+    if ((ep = *find_entry(bucket, host)) && now < ep->expires) {
+        n = copy_addrs(ep, addrs, max);
+        /* Still in use this close to expiring, so worth keeping warm */
+        if (ep->error == 0 &&
+            ep->expires - now <= ep->ttl / DNS_REFRESH_AHEAD + 1) {
+            refresh = atomic_compare_exchange_strong(&ep->refreshing,
+                                                     &expected, 1);
+        }
+        pthread_rwlock_unlock(&sp->lock);
+        if (refresh) {
+            pthread_mutex_lock(&dc->lock);
+            queue_resolve(dc, host);
+            pthread_mutex_unlock(&dc->lock);
+        }
+        return n;
+    }
+    pthread_rwlock_unlock(&sp->lock);
+    return DNS_PENDING;
+}
+
+/*
+ * dns_resolve - Resolve host on the refresh thread, which then calls
+ *     wake(arg) from there. A caller asking again before that, with the
+ *     same arg, is only woken once.
+ */
+int
+dns_resolve(DnsCachePtr dc, char *host, void (*wake)(void *arg), void *arg)
+{
+    DnsRefresh *rp;
+    DnsWaiter *wp;
+    int rc;
+
+    pthread_mutex_lock(&dc->lock);
+    if ((rp = queue_resolve(dc, host)) == NULL) {
+        rc = -1;
+    } else {
+        for (wp = rp->waiters; wp && (wp->wake != wake || wp->arg != arg);
+             wp = wp->next)
+            ;
+        if (wp == NULL && (wp = malloc(sizeof(DnsWaiter)))) {
+            wp->wake = wake;
+            wp->arg = arg;
+            wp->next = rp->waiters;
+            rp->waiters = wp;
+        }
+        rc = wp ? 0 : -1;
+    }
+    pthread_mutex_unlock(&dc->lock);
+    return rc;
+}
+
+/*
+ * dns_connect - Like open_clientfd(), with the addresses from the cache
+ */
+int
+dns_connect(DnsCachePtr dc, char *host, char *port)
+{
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    unsigned long start = metrics_now();
+    int i, n, fd;
+
+    if ((n = dns_lookup(dc, host, addrs, DNS_MAX_ADDRS)) < 0) {
+        return -1;
+    }
+    start = metrics_stage(STAGE_DNS, start);
+
+    for (i = 0; i < n; i++) {
+        if ((fd = dns_connect_addr(&addrs[i], port, 0)) >= 0) {
+            metrics_stage(STAGE_CONNECT, start);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/*
+ * dns_connect_addr - Connect to port of the address da. With nonblock set
+ *     the descriptor is non-blocking, and the connect may still be in
+ *     progress on return.
+ */
+int
+dns_connect_addr(DnsAddr *da, char *port, int nonblock)
+{
+    struct sockaddr *sa = (struct sockaddr *)&da->addr;
+    int fd;
+
+    if (sa->sa_family == AF_INET) {
+        ((struct sockaddr_in *)sa)->sin_port = htons(atoi(port));
+    } else {
+        ((struct sockaddr_in6 *)sa)->sin6_port = htons(atoi(port));
+    }
+    if ((fd = socket(sa->sa_family,
+                     SOCK_STREAM | (nonblock ? SOCK_NONBLOCK : 0), 0)) < 0) {
+        return -1;
+    }
+    if (connect(fd, sa, da->len) == 0 || (nonblock && errno == EINPROGRESS)) {
+        return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+static DnsShard *
+find_shard(DnsCachePtr dc, const char *host, DnsEntry ***bucket)
+{
+    unsigned long hash = 5381;
+    const char *p;
+    DnsShard *sp;
+
+    for (p = host; *p; p++) {
+        hash = hash * 33 + (unsigned char)*p;
+    }
+    sp = &dc->shards[hash % DNS_SHARDS];
+    *bucket = &sp->buckets[(hash / DNS_SHARDS) % DNS_BUCKETS];
+    return sp;
+}
+
+static DnsEntry **
+find_entry(DnsEntry **bucket, const char *host)
+{
+    while (*bucket && strcmp((*bucket)->host, host)) {
+        bucket = &(*bucket)->next;
+    }
+    return bucket;
+}
+
+/*
+ * resolve - A new entry for host, negative if it does not resolve.
+ *     Returns NULL only if out of memory.
+ */
+static DnsEntry *
+resolve(DnsCachePtr dc, char *host)
+{
+    struct addrinfo hints, *listp, *p;
+    DnsEntry *ep;
+
+    if ((ep = calloc(1, sizeof(DnsEntry))) == NULL ||
+        (ep->host = strdup(host)) == NULL) {
+        free(ep);
+        return NULL;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    if ((ep->error = getaddrinfo(host, NULL, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(ep->error));
+        ep->ttl = DNS_NEGATIVE_TTL;
+    } else {
+        for (p = listp; p && ep->naddrs < DNS_MAX_ADDRS; p = p->ai_next) {
+            memcpy(&ep->addrs[ep->naddrs].addr, p->ai_addr, p->ai_addrlen);
+            ep->addrs[ep->naddrs++].len = p->ai_addrlen;
+        }
+        ep->ttl = answer_ttl(host, listp->ai_family);
+        freeaddrinfo(listp);
+        if (ep->ttl < dc->min_ttl) {
+            ep->ttl = dc->min_ttl;
+        }
+    }
+    ep->expires = now_sec() + ep->ttl;
+    atomic_init(&ep->refreshing, 0);
+    return ep;
+}
+
+/*
+ * answer_ttl - The smallest TTL in the DNS answer for host, CNAMEs
+ *     included. Numeric addresses never change.
+ */
+static time_t
+answer_ttl(char *host, int family)
+{
+    unsigned char answer[NS_PACKETSZ * 4], addr[sizeof(struct in6_addr)];
+    ns_msg msg;
+    ns_rr rr;
+    int len, i;
+    time_t ttl = -1;
+
+    if (inet_pton(AF_INET, host, addr) == 1 ||
+        inet_pton(AF_INET6, host, addr) == 1) {
+        return DNS_NUMERIC_TTL;
+    }
+    if ((len = res_query(host, ns_c_in, family == AF_INET6 ? ns_t_aaaa : ns_t_a,
+                         answer, sizeof(answer))) < 0 ||
+        ns_initparse(answer, len, &msg) < 0) {
+        return DNS_DEFAULT_TTL;
+    }
+    for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+        if (ns_parserr(&msg, ns_s_an, i, &rr) == 0 &&
+            (ttl < 0 || ns_rr_ttl(rr) < ttl)) {
+            ttl = ns_rr_ttl(rr);
+        }
+    }
+    return ttl < 0 ? DNS_DEFAULT_TTL : ttl;
+}
+
+/*
+ * store - Insert ep, replacing any entry for the same host. Expired
+ *     entries met on the way are dropped, which keeps the buckets short.
+ */
+static void
+store(DnsCachePtr dc, DnsEntry *ep)
+{
+    time_t now = now_sec();
+    DnsEntry **bucket, **epp, *old;
+    DnsShard *sp = find_shard(dc, ep->host, &bucket);
+
+    pthread_rwlock_wrlock(&sp->lock);
+    for (epp = bucket; (old = *epp);) {
+        if (!strcmp(old->host, ep->host) || old->expires <= now) {
+            *epp = old->next;
+            free_entry(old);
+        } else {
+            epp = &old->next;
+        }
+    }
+    ep->next = *bucket;
+    *bucket = ep;
+    pthread_rwlock_unlock(&sp->lock);
+}
+
+static int
+copy_addrs(DnsEntry *ep, DnsAddr *addrs, int max)
+{
+    int n = ep->naddrs < max ? ep->naddrs : max;
+
+    if (ep->error) {
+        return -1;
+    }
+    memcpy(addrs, ep->addrs, n * sizeof(DnsAddr));
+    return n;
+}
+
+/*
+ * queue_resolve - The refresh queue's request for host, queued now unless
+ *     it is queued or being resolved already. The caller holds dc->lock.
+ *     Returns NULL only if out of memory; a refreshed entry just expires.
+ */
+static DnsRefresh *
+queue_resolve(DnsCachePtr dc, char *host)
+{
+    DnsRefresh *rp;
+
+    if (dc->current && !strcmp(dc->current->host, host)) {
+        return dc->current;
+    }
+    for (rp = dc->queue; rp && strcmp(rp->host, host); rp = rp->next)
+        ;
+    if (rp) {
+        return rp;
+    }
+    if ((rp = malloc(sizeof(DnsRefresh))) == NULL ||
+        (rp->host = strdup(host)) == NULL) {
+        free(rp);
+        return NULL;
+    }
+    rp->waiters = NULL;
+    rp->next = dc->queue;
+    dc->queue = rp;
+    pthread_cond_signal(&dc->ready);
+    return rp;
+}
+
+/*
+ * refresh_loop - Resolve queued names again and swap in the new answers.
+ *     If a name no longer resolves the old answer is kept until it
+ *     expires, and the first lookup after that resolves it again; unless
+ *     someone waits for it, who gets the failure.
+ */
+static void *
+refresh_loop(void *vargp)
+{
+    DnsCachePtr dc = (DnsCachePtr)vargp;
+    DnsWaiter *wp, *next;
+    DnsEntry *ep;
+    DnsRefresh *rp;
+
+    while (1) {
+        pthread_mutex_lock(&dc->lock);
+        while (dc->queue == NULL) {
+            pthread_cond_wait(&dc->ready, &dc->lock);
+        }
+        rp = dc->queue;
+        dc->queue = rp->next;
+        dc->current = rp;
+        pthread_mutex_unlock(&dc->lock);
+
+        ep = resolve(dc, rp->host);
+
+        /* From here on another request for the name is queued anew */
+        pthread_mutex_lock(&dc->lock);
+        dc->current = NULL;
+        pthread_mutex_unlock(&dc->lock);
+
+        /* A failed refresh leaves the old entry marked, so it is not retried */
+        if (ep && (ep->error == 0 || rp->waiters)) {
+            store(dc, ep);
+        } else {
+            free_entry(ep);
+        }
+        for (wp = rp->waiters; wp; wp = next) {
+            next = wp->next;
+            wp->wake(wp->arg);
+            free(wp);
+        }
+        free(rp->host);
+        free(rp);
+    }
+    return NULL;
+}
+
+static void
+free_entry(DnsEntry *ep)
+{
+    if (ep) {
+        free(ep->host);
+        free(ep);
+    }
+}
+
+static time_t
+now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
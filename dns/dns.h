@@ -0,0 +1,78 @@
+#ifndef DNS_h
+#define DNS_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define DNS_SHARDS 8
+#define DNS_BUCKETS 64      /* Per shard */
+#define DNS_MAX_ADDRS 8     /* Addresses kept per name */
+#define DNS_MIN_TTL 10      /* Default floor on cached TTLs, in seconds */
+#define DNS_DEFAULT_TTL 60  /* For answers that carry none, e.g. /etc/hosts */
+#define DNS_NUMERIC_TTL 86400
+#define DNS_NEGATIVE_TTL 5  /* Failed lookups */
+#define DNS_REFRESH_AHEAD 4 /* Refresh names used in the last 1/4 of the TTL */
+#define DNS_PENDING -2      /* dns_cached(): not resolved yet, or expired */
+
+typedef struct dns_addr {
+    socklen_t len;
+    struct sockaddr_storage addr; /* Port left 0 */
+} DnsAddr;
+
+typedef struct dns_entry {
+    char *host;
+    int error; /* getaddrinfo() error of a negative entry, else 0 */
+    int naddrs;
+    DnsAddr addrs[DNS_MAX_ADDRS];
+    time_t ttl, expires;
+    atomic_int refreshing; /* Queued for the refresh thread */
+    struct dns_entry *next;
+} DnsEntry;
+
+typedef struct dns_shard {
+    pthread_rwlock_t lock;
+    DnsEntry *buckets[DNS_BUCKETS];
+} __attribute__((aligned(64))) DnsShard;
+
+/* Called once a name dns_resolve() was asked for is resolved */
+typedef struct dns_waiter {
+    void (*wake)(void *arg);
+    void *arg;
+    struct dns_waiter *next;
+} DnsWaiter;
+
+typedef struct dns_refresh {
+    char *host;
+    DnsWaiter *waiters; /* None for a refresh ahead of expiry */
+    struct dns_refresh *next;
+} DnsRefresh;
+
+/*
+ * Resolved origin addresses, keyed by hostname and shared by every thread.
+ * Entries live for the TTL of their DNS answer, but at least min_ttl
+ * seconds; failures are remembered for DNS_NEGATIVE_TTL. A name looked up
+ * in the last part of its TTL is resolved again by a background thread,
+ * so names in steady use never expire in front of a request. The same
+ * thread resolves names for callers that must not block, and each name
+ * is resolved once however many of them ask for it meanwhile.
+ */
+typedef struct dns_cache {
+    DnsShard shards[DNS_SHARDS];
+    int min_ttl;
+    pthread_mutex_t lock; /* Protects the refresh queue and current */
+    pthread_cond_t ready;
+    DnsRefresh *queue;
+    DnsRefresh *current; /* Being resolved */
+} DnsCache, *DnsCachePtr;
+
+int dns_init(DnsCachePtr dc, int min_ttl);
+int dns_lookup(DnsCachePtr dc, char *host, DnsAddr *addrs, int max);
+int dns_cached(DnsCachePtr dc, char *host, DnsAddr *addrs, int max);
+int dns_resolve(DnsCachePtr dc, char *host, void (*wake)(void *arg),
+                void *arg);
+int dns_connect(DnsCachePtr dc, char *host, char *port);
+int dns_connect_addr(DnsAddr *da, char *port, int nonblock);
+
+#endif
@@ -0,0 +1,1420 @@
+/*
+ * event.c - edge-triggered epoll engine.
+ *
+ * Every loop runs on its own thread and owns the connections it accepts
+ * for their whole life, so connection state is never shared between
+ * threads; only the cache is. Each connection walks a small state
+ * machine that mirrors serve_request() in proxy.c:
+ *
+ *   READ_REQUEST -> (cache hit)  SEND_CACHED
+ *                -> (in flight)  FOLLOW
+ *                -> (cache miss) [[RESOLVE] -> CONNECT] -> SEND_REQUEST
+ *                                -> READ_RESPONSE -> RELAY
+ *                                                 -> (304) SEND_CACHED
+ *
+ * A stale hit is revalidated: the request goes to the origin with its
+ * validators, and a 304 sends the refreshed copy.
+ *
+ * CONNECT is skipped when an idle origin connection is taken from the
+ * upstream pool. If that connection turns out to be stale before any of
+ * the response arrives, the request is sent again on a new one.
+ *
+ * RESOLVE is skipped when the origin's name is cached. Otherwise the name
+ * is resolved on the DNS cache's refresh thread, which wakes the loop
+ * through its eventfd, as a flight does. A connect that fails or times
+ * out moves on to the name's next address.
+ *
+ * A miss on a request another connection is already fetching FOLLOWs that
+ * flight instead, see flight.c. The leader may run on any loop; it wakes
+ * the loops of its followers through their eventfd, and each loop then
+ * drives all of its followers.
+ *
+ * Once a response is sent, a client that keeps its connection goes back
+ * to READ_REQUEST, where a pipelined request may already be waiting.
+ *
+ * Every state has a deadline. A client gets the idle timeout to send its
+ * whole next request, an origin CONNECT_TIMEOUT to resolve, and as much
+ * for each address to accept, and every
+ * other state TRANSFER_TIMEOUT since its last progress; a connection
+ * that misses its deadline is closed. A leader that is closed fails its
+ * flight, and the followers fetch on their own.
+ *
+ * A state handler returns 1 when it advanced the state, 0 when it would
+ * block, and -1 when the connection is finished (or failed) and must be
+ * closed. Handlers always retry their I/O until EAGAIN, which is what
+ * edge-triggered notification requires.
+ */
+#define _GNU_SOURCE
+#include "event.h"
+#include "../pool/pool.h"
+#include "../proxy.h"
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define MAX_EVENTS 64
+
+typedef enum {
+    CONN_READ_REQUEST,  /* Accumulating the request line and headers */
+    CONN_SEND_CACHED,   /* Writing a cache hit back to the client */
+    CONN_RESOLVE,       /* Waiting for the origin's name to resolve */
+    CONN_CONNECT,       /* Waiting for the upstream connect to complete */
+    CONN_SEND_REQUEST,  /* Writing the rewritten request upstream */
+    CONN_READ_RESPONSE, /* Accumulating the upstream response headers */
+    CONN_RELAY,         /* Relaying the response body to the client */
+    CONN_FOLLOW,        /* Sending a response another connection fetches */
+} ConnState;
+
+typedef struct conn Conn;
+
+/* What a connection is waiting for, each with its own timeout */
+typedef enum {
+    WAIT_REQUEST,  /* A complete request from the client */
+    WAIT_CONNECT,  /* The origin to resolve, or to accept */
+    WAIT_TRANSFER, /* Either peer to move the response along */
+    WAIT_KINDS
+} WaitKind;
+
+/* The connections waiting for one kind of thing, oldest first */
+typedef struct wait_list {
+    Conn *head, *tail;
+    int timeout; /* Seconds */
+} WaitList;
+
+/* What epoll hands back: a descriptor and the connection owning it */
+typedef struct endpoint {
+    int fd;
+    Conn *conn; /* NULL for the listening socket */
+} Endpoint;
+
+struct conn {
+    ConnState state;
+    int closed;
+    Endpoint client, server;
+    Conn *next_closed;
+    Conn *idle_prev, *idle_next;
+    time_t idle_since; /* Since the state began, or last made progress */
+    WaitList *idle;    /* The list it is on, NULL if none */
+
+    /*
+     * Request accumulation. The head of the current request stays at the
+     * front until its response is sent, since the request upstream points
+     * into it; pipelined ones follow.
+     */
+    char req[MAXLINE];
+    size_t reqlen;
+    HttpHead reqhead;
+    char in[MAXLINE]; /* Response head accumulation */
+    size_t inlen;
+    HttpHead resphead;
+
+    struct iovec iov[REQUEST_IOV]; /* Output still pending for the peer */
+    int iovcnt;
+    int persist; /* What the client allows, then whether it stays open */
+
+    char *key;           /* Cache key: the request line as received */
+    char *response_hdrs; /* Response headers, kept for the cache */
+    CacheObjectPtr hit;  /* Cache hit being sent, released on close */
+    CacheObjectPtr stale; /* Cached copy being revalidated */
+
+    FlightPtr flight;            /* Being led or followed */
+    int leader;
+    FlightWaiter waiter;         /* While following */
+    Conn *follow_prev, *follow_next;
+    Conn *resolve_prev, *resolve_next;
+
+    char *host, *port;      /* Origin, to pool the connection under */
+    char *path;             /* Request target on the origin */
+    DnsAddr addrs[DNS_MAX_ADDRS]; /* The origin's, tried in turn */
+    int naddrs, addr;       /* How many, and the next one to try */
+    int reused;             /* The origin connection came from the pool */
+    int reusable;           /* It may go back once the body is relayed */
+
+    ssize_t content_length; /* Body bytes announced, or BODY_* */
+    size_t relayed;         /* Body bytes read from the origin so far */
+    ChunkScan chunks;       /* Framing of a BODY_CHUNKED body */
+    CacheFill fill;         /* Copy of the body for the cache */
+    char buf[MAXBUF];       /* Relay buffer */
+
+    int pipefd[2];   /* Splice pipe for bodies that will not be cached */
+    size_t piped;    /* Bytes sitting in the pipe */
+    int spliced;     /* splice() has worked for this connection */
+    int nosplice;    /* splice() is not supported, copy instead */
+
+    unsigned long parse_ns; /* Spent parsing the request head so far */
+    unsigned long started;  /* When its head was in, 0 between requests */
+    unsigned long stage_at; /* When the stage in progress began */
+    int result;             /* How it is being served, LOG_* */
+};
+
+typedef struct event_loop {
+    pthread_t tid;
+    int id;
+    int pin;
+    int epfd;
+    Endpoint listener;
+    CachePtr cache;
+    UpstreamPoolPtr upstream;
+    DnsCachePtr dns;
+    int wakefd; /* eventfd, signalled by followed flights and resolved names */
+    Endpoint waker;
+    Conn *followers;
+    Conn *resolving; /* Waiting for their origin's name */
+    Conn *closed; /* Connections to free once the current batch is done */
+    WaitList waiting[WAIT_KINDS];
+    time_t last_sweep;
+
+    /* Scratch space for the request helpers in proxy.c */
+    char key[MAXLINE], headers[MAXLINE], host[MAXLINE], port[MAXLINE];
+    char path[MAXLINE];
+} EventLoop;
+
+static void *loop_thread(void *vargp);
+static void loop_run(EventLoop *lp);
+static void accept_conns(EventLoop *lp);
+static void conn_drive(EventLoop *lp, Conn *c);
+static void conn_close(EventLoop *lp, Conn *c);
+static int conn_reset(EventLoop *lp, Conn *c);
+static void conn_log(Conn *c);
+static void idle_add(EventLoop *lp, Conn *c);
+static void idle_remove(EventLoop *lp, Conn *c);
+static void idle_sweep(EventLoop *lp);
+static int conn_flush(Conn *c, int fd);
+static int on_read_request(EventLoop *lp, Conn *c);
+static int on_send_cached(EventLoop *lp, Conn *c);
+static int on_resolve(EventLoop *lp, Conn *c);
+static int on_connect(EventLoop *lp, Conn *c);
+static int on_send_request(EventLoop *lp, Conn *c);
+static int on_read_response(EventLoop *lp, Conn *c);
+static int on_relay(EventLoop *lp, Conn *c);
+static int on_follow(EventLoop *lp, Conn *c);
+static void follow_add(EventLoop *lp, Conn *c);
+static void follow_remove(EventLoop *lp, Conn *c);
+static void resolve_add(EventLoop *lp, Conn *c);
+static void resolve_remove(EventLoop *lp, Conn *c);
+static void flight_drop(EventLoop *lp, Conn *c);
+static void loop_wake(void *arg);
+static void wake_waiters(EventLoop *lp);
+static int open_upstream(EventLoop *lp, Conn *c, int pooled);
+static int start_connect(EventLoop *lp, Conn *c);
+static int connect_next(EventLoop *lp, Conn *c);
+static int connect_failed(EventLoop *lp, Conn *c);
+static int send_cached(Conn *c, CacheObjectPtr op);
+static int serve_stale(EventLoop *lp, Conn *c);
+static int revalidated(EventLoop *lp, Conn *c, int keepalive);
+static ssize_t relay_body(EventLoop *lp, Conn *c, ssize_t n);
+static int body_done(Conn *c);
+static int relay_splice(EventLoop *lp, Conn *c);
+static int relay_done(EventLoop *lp, Conn *c);
+static int frame_response(Conn *c);
+static int fill_head(int fd, char *buf, size_t size, size_t *len,
+                     HttpHead *hp, unsigned long *parse_ns);
+static int watch(EventLoop *lp, Endpoint *ep);
+static time_t now_sec(void);
+
+int
+event_run(int *listenfds, int nloops, int pin, int idle_timeout, CachePtr cp,
+          UpstreamPoolPtr up, DnsCachePtr dc)
+{
+    EventLoop *loops;
+    int i;
+
+    if (nloops < 1) {
+        return -1;
+    }
+    if ((loops = calloc(nloops, sizeof(EventLoop))) == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < nloops; i++) {
+        struct epoll_event ev;
+
+        loops[i].id = i;
+        loops[i].pin = pin;
+        loops[i].cache = cp;
+        loops[i].upstream = up;
+        loops[i].dns = dc;
+        loops[i].waiting[WAIT_REQUEST].timeout = idle_timeout;
+        loops[i].waiting[WAIT_CONNECT].timeout = CONNECT_TIMEOUT;
+        loops[i].waiting[WAIT_TRANSFER].timeout = TRANSFER_TIMEOUT;
+        loops[i].last_sweep = now_sec();
+        loops[i].listener.fd = listenfds[i];
+        loops[i].listener.conn = NULL;
+        if (set_nonblocking(listenfds[i]) < 0) {
+            fprintf(stderr, "%s: %s\n", "fcntl error", strerror(errno));
+            return -1;
+        }
+        if ((loops[i].epfd = epoll_create1(0)) < 0) {
+            fprintf(stderr, "%s: %s\n", "epoll_create error", strerror(errno));
+            return -1;
+        }
+        /* Wake only one loop per incoming connection on a shared socket */
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &loops[i].listener;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, listenfds[i], &ev) < 0) {
+            fprintf(stderr, "%s: %s\n", "epoll_ctl error", strerror(errno));
+            return -1;
+        }
+        if ((loops[i].wakefd = eventfd(0, EFD_NONBLOCK)) < 0) {
+            fprintf(stderr, "%s: %s\n", "eventfd error", strerror(errno));
+            return -1;
+        }
+        loops[i].waker.fd = loops[i].wakefd;
+        loops[i].waker.conn = NULL;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &loops[i].waker;
+        if (epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, loops[i].wakefd, &ev) <
+            0) {
+            fprintf(stderr, "%s: %s\n", "epoll_ctl error", strerror(errno));
+            return -1;
+        }
+    }
+
+    for (i = 1; i < nloops; i++) {
+        pthread_create(&loops[i].tid, NULL, loop_thread, &loops[i]);
+    }
+    loop_run(&loops[0]);
+
+    return 0;
+}
+
+static void *
+loop_thread(void *vargp)
+{
+    loop_run((EventLoop *)vargp);
+    return NULL;
+}
+
+static void
+loop_run(EventLoop *lp)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int i, n;
+    Conn *c;
+
+    if (lp->pin) {
+        pin_to_cpu(lp->id);
+    }
+
+    while (1) {
+        /* Wake up at least once a second to sweep stalled connections */
+        if ((n = epoll_wait(lp->epfd, events, MAX_EVENTS, 1000)) < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "%s: %s\n", "epoll_wait error",
+                        strerror(errno));
+            }
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            Endpoint *ep = events[i].data.ptr;
+            if (ep == &lp->waker) {
+                wake_waiters(lp);
+            } else if (ep->conn == NULL) {
+                accept_conns(lp);
+            } else if (!ep->conn->closed) {
+                conn_drive(lp, ep->conn);
+            }
+        }
+        idle_sweep(lp);
+
+        /* Nothing in this batch can reference them any more */
+        while ((c = lp->closed)) {
+            lp->closed = c->next_closed;
+            free(c);
+        }
+    }
+}
+
+static void
+accept_conns(EventLoop *lp)
+{
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    int connfd;
+    Conn *c;
+
+    while (1) {
+        clientlen = sizeof(struct sockaddr_storage);
+        if ((connfd = accept4(lp->listener.fd, (SA *)&clientaddr, &clientlen,
+                              SOCK_NONBLOCK)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "%s: %s\n", "accept error", strerror(errno));
+            }
+            return;
+        }
+
+        if ((c = calloc(1, sizeof(Conn))) == NULL) {
+            close(connfd);
+            continue;
+        }
+        c->state = CONN_READ_REQUEST;
+        c->client.fd = connfd;
+        c->client.conn = c;
+        c->server.fd = -1;
+        c->server.conn = c;
+        c->pipefd[0] = c->pipefd[1] = -1;
+        http_init(&c->reqhead);
+        if (watch(lp, &c->client) < 0) {
+            close(connfd);
+            free(c);
+            continue;
+        }
+        idle_add(lp, c);
+        /* The request may already be waiting */
+        conn_drive(lp, c);
+    }
+}
+
+/*
+ * watch - Register an endpoint for edge-triggered read and write events.
+ *     Both directions are always watched; the state machine ignores the
+ *     wakeups it does not need.
+ */
+static int
+watch(EventLoop *lp, Endpoint *ep)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = ep;
+    return epoll_ctl(lp->epfd, EPOLL_CTL_ADD, ep->fd, &ev);
+}
+
+/*
+ * conn_drive - Run the state machine as far as it goes. Anything but a
+ *     client still sending its request has made progress, and gets its
+ *     full timeout again. A follower with nothing left to send waits on
+ *     the leader, whose own deadline fails the flight, and a connection
+ *     waiting for its origin's name keeps the deadline it began with.
+ */
+static void
+conn_drive(EventLoop *lp, Conn *c)
+{
+    int rc;
+
+    do {
+        switch (c->state) {
+        case CONN_READ_REQUEST:
+            rc = on_read_request(lp, c);
+            break;
+        case CONN_SEND_CACHED:
+            rc = on_send_cached(lp, c);
+            break;
+        case CONN_RESOLVE:
+            rc = on_resolve(lp, c);
+            break;
+        case CONN_CONNECT:
+            rc = on_connect(lp, c);
+            break;
+        case CONN_SEND_REQUEST:
+            rc = on_send_request(lp, c);
+            break;
+        case CONN_READ_RESPONSE:
+            rc = on_read_response(lp, c);
+            break;
+        case CONN_RELAY:
+            rc = on_relay(lp, c);
+            break;
+        case CONN_FOLLOW:
+            rc = on_follow(lp, c);
+            break;
+        default:
+            rc = -1;
+        }
+    } while (rc > 0);
+
+    if (rc < 0) {
+        conn_close(lp, c);
+    } else if (c->state == CONN_FOLLOW && c->iovcnt == 0) {
+        idle_remove(lp, c);
+    } else if (c->state == CONN_RESOLVE) {
+        /* Being woken to find it still unresolved is no progress */
+        if (c->idle != &lp->waiting[WAIT_CONNECT]) {
+            idle_add(lp, c);
+        }
+    } else if (c->state != CONN_READ_REQUEST) {
+        idle_add(lp, c);
+    }
+}
+
+static void
+conn_close(EventLoop *lp, Conn *c)
+{
+    if (c->started) {
+        conn_log(c);
+    }
+    idle_remove(lp, c);
+    flight_drop(lp, c);
+    if (c->state == CONN_RESOLVE) {
+        resolve_remove(lp, c);
+    }
+    /* Closing the descriptors also removes them from the epoll set */
+    close(c->client.fd);
+    if (c->server.fd >= 0) {
+        close(c->server.fd);
+    }
+    if (c->pipefd[0] >= 0) {
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+    }
+    free(c->key);
+    free(c->host);
+    free(c->port);
+    free(c->path);
+    free(c->response_hdrs);
+    if (c->hit) {
+        cache_release(lp->cache, c->hit);
+    }
+    if (c->stale) {
+        cache_release(lp->cache, c->stale);
+    }
+    cache_fill_free(&c->fill);
+
+    c->closed = 1;
+    c->next_closed = lp->closed;
+    lp->closed = c;
+}
+
+/*
+ * conn_reset - The response is sent and the client keeps the connection:
+ *     drop what belonged to the request and go back to reading, where the
+ *     next request may already be buffered
+ */
+static int
+conn_reset(EventLoop *lp, Conn *c)
+{
+    conn_log(c);
+    c->started = 0;
+    flight_drop(lp, c);
+    if (c->server.fd >= 0) {
+        close(c->server.fd);
+        c->server.fd = -1;
+    }
+    free(c->key);
+    free(c->host);
+    free(c->port);
+    free(c->path);
+    free(c->response_hdrs);
+    c->key = c->host = c->port = c->path = c->response_hdrs = NULL;
+    if (c->hit) {
+        cache_release(lp->cache, c->hit);
+        c->hit = NULL;
+    }
+    if (c->stale) {
+        cache_release(lp->cache, c->stale);
+        c->stale = NULL;
+    }
+    cache_fill_free(&c->fill);
+
+    /* Whatever follows the request's head is the next one */
+    c->reqlen -= c->reqhead.len;
+    memmove(c->req, c->req + c->reqhead.len, c->reqlen);
+    http_init(&c->reqhead);
+
+    c->inlen = 0;
+    c->iovcnt = 0;
+    c->reused = c->reusable = 0;
+    c->content_length = 0;
+    c->relayed = 0;
+    c->state = CONN_READ_REQUEST;
+    idle_add(lp, c);
+    return 1;
+}
+
+/*
+ * conn_log - The request is over, however it went: record how long it
+ *     took and log it
+ */
+static void
+conn_log(Conn *c)
+{
+    unsigned long end = metrics_stage(STAGE_TOTAL, c->started);
+
+    if (c->hit) {
+        log_access(&c->reqhead, c->req, c->result,
+                   response_status(OBJECT_HDRS(c->hit)),
+                   c->hit->content_length, end - c->started);
+    } else {
+        log_access(&c->reqhead, c->req, c->result,
+                   c->response_hdrs ? response_status(c->response_hdrs) : 0,
+                   c->response_hdrs ? c->content_length : -1,
+                   end - c->started);
+    }
+}
+
+/*
+ * idle_add - Start the clock on c in its current state, restarting it if
+ *     it was already running
+ */
+static void
+idle_add(EventLoop *lp, Conn *c)
+{
+    WaitList *wl;
+
+    switch (c->state) {
+    case CONN_READ_REQUEST:
+        wl = &lp->waiting[WAIT_REQUEST];
+        break;
+    case CONN_RESOLVE:
+    case CONN_CONNECT:
+        wl = &lp->waiting[WAIT_CONNECT];
+        break;
+    default:
+        wl = &lp->waiting[WAIT_TRANSFER];
+    }
+
+    idle_remove(lp, c);
+    c->idle = wl;
+    c->idle_since = now_sec();
+    c->idle_next = NULL;
+    c->idle_prev = wl->tail;
+    if (wl->tail) {
+        wl->tail->idle_next = c;
+    } else {
+        wl->head = c;
+    }
+    wl->tail = c;
+}
+
+static void
+idle_remove(EventLoop *lp, Conn *c)
+{
+    WaitList *wl = c->idle;
+
+    if (wl == NULL) {
+        return;
+    }
+    if (c->idle_prev) {
+        c->idle_prev->idle_next = c->idle_next;
+    } else {
+        wl->head = c->idle_next;
+    }
+    if (c->idle_next) {
+        c->idle_next->idle_prev = c->idle_prev;
+    } else {
+        wl->tail = c->idle_prev;
+    }
+    c->idle = NULL;
+}
+
+/*
+ * idle_sweep - Close the connections past their deadline, at most once a
+ *     second. An origin address that does not accept in time only makes
+ *     way for the next one.
+ */
+static void
+idle_sweep(EventLoop *lp)
+{
+    time_t now = now_sec();
+    WaitList *wl;
+    Conn *c;
+
+    if (now == lp->last_sweep) {
+        return;
+    }
+    lp->last_sweep = now;
+    for (wl = lp->waiting; wl < lp->waiting + WAIT_KINDS; wl++) {
+        while ((c = wl->head) && now - c->idle_since >= wl->timeout) {
+            if (c->state == CONN_CONNECT && c->addr < c->naddrs &&
+                connect_failed(lp, c) > 0) {
+                conn_drive(lp, c); /* Restarts its clock */
+            } else {
+                conn_close(lp, c);
+            }
+        }
+    }
+}
+
+/*
+ * conn_flush - Write the pending iovecs to fd. Returns 1 once everything
+ *     is written, 0 if fd would block, and -1 on error.
+ */
+static int
+conn_flush(Conn *c, int fd)
+{
+    ssize_t n;
+    int i;
+
+    while (c->iovcnt > 0) {
+        if ((n = writev(fd, c->iov, c->iovcnt)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        /* Drop what was written from the front of the vector */
+        for (i = 0; i < c->iovcnt && (size_t)n >= c->iov[i].iov_len; i++) {
+            n -= c->iov[i].iov_len;
+        }
+        if (i > 0) {
+            memmove(c->iov, c->iov + i, (c->iovcnt - i) * sizeof(c->iov[0]));
+            c->iovcnt -= i;
+        }
+        if (c->iovcnt > 0) {
+            c->iov[0].iov_base = (char *)c->iov[0].iov_base + n;
+            c->iov[0].iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+/*
+ * fill_head - Read from fd into buf, which holds *len bytes of size, until
+ *     hp is a complete head; it may be already. The time spent parsing is
+ *     added to *parse_ns, unless it is NULL. Returns 1 once it is, 0 if fd
+ *     would block first, and -1 on EOF, error, or a bad head or one that
+ *     does not fit.
+ */
+static int
+fill_head(int fd, char *buf, size_t size, size_t *len, HttpHead *hp,
+          unsigned long *parse_ns)
+{
+    unsigned long start;
+    ssize_t n;
+    int rc;
+
+    while (1) {
+        start = parse_ns ? metrics_now() : 0;
+        rc = http_parse(hp, buf, *len);
+        if (parse_ns) {
+            *parse_ns += metrics_now() - start;
+        }
+        if (rc != 0) {
+            return rc;
+        }
+        if (*len == size) {
+            return -1;
+        }
+        if ((n = read(fd, buf + *len, size - *len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        } else if (n == 0) {
+            return -1;
+        }
+        *len += n;
+    }
+}
+
+static int
+on_read_request(EventLoop *lp, Conn *c)
+{
+    time_t expires;
+    int rc;
+
+    if ((rc = fill_head(c->client.fd, c->req, sizeof(c->req), &c->reqlen,
+                        &c->reqhead, &c->parse_ns)) <= 0) {
+        return rc;
+    }
+    metrics_record(STAGE_PARSE, c->parse_ns);
+    c->parse_ns = 0;
+    c->started = metrics_now();
+    c->result = LOG_MISS;
+
+    c->persist = client_persistence(&c->reqhead, c->req);
+    if (cache_key(&c->reqhead, c->req, lp->key, sizeof(lp->key)) < 0 ||
+        (c->key = strdup(lp->key)) == NULL) {
+        return -1;
+    }
+
+    /* A stale copy is kept to be revalidated rather than fetched again */
+    c->stale = cache_read(lp->cache, c->key, &expires);
+    metrics_stage(STAGE_LOOKUP, c->started);
+    if (c->stale && cache_fresh(&c->reqhead, c->req, expires)) {
+        c->result = LOG_HIT;
+        send_cached(c, c->stale);
+        c->stale = NULL;
+        return 1;
+    }
+
+    if (parse_request(&c->reqhead, c->req, lp->host, lp->port, lp->path) <
+        0) {
+        return -1;
+    }
+    if ((c->host = strdup(lp->host)) == NULL ||
+        (c->port = strdup(lp->port)) == NULL ||
+        (c->path = strdup(lp->path)) == NULL) {
+        return -1;
+    }
+
+    /* Concurrent misses on the same request share one fetch */
+    c->waiter.wake = loop_wake;
+    c->waiter.arg = lp;
+    if (request_shareable(&c->reqhead, c->req) &&
+        (c->flight = flight_join(&lp->cache->flights, c->key,
+                                 lp->cache->max_object, &c->waiter,
+                                 &c->leader)) &&
+        !c->leader) {
+        follow_add(lp, c);
+        c->result = LOG_COALESCED;
+        c->state = CONN_FOLLOW;
+        return 1;
+    }
+    if ((rc = open_upstream(lp, c, 1)) < 0) {
+        return serve_stale(lp, c);
+    }
+    return rc;
+}
+
+/*
+ * send_cached - Send the cached op, whose reference the connection takes.
+ *     The body of a disk object follows the headers with sendfile().
+ */
+static int
+send_cached(Conn *c, CacheObjectPtr op)
+{
+    c->hit = op;
+    c->persist = cached_persistent(c->persist, op);
+    c->iov[0].iov_base = OBJECT_HDRS(op);
+    c->iov[0].iov_len = op->hdr_len - 2; /* Without the blank line */
+    c->iov[1].iov_base = connection_header(c->persist);
+    c->iov[1].iov_len = strlen(c->iov[1].iov_base);
+    c->iov[2].iov_base = OBJECT_CONTENT(op);
+    c->iov[2].iov_len = op->content_length;
+    c->iovcnt = OBJECT_ON_DISK(op) ? 2 : 3;
+    c->relayed = 0;
+    c->state = CONN_SEND_CACHED;
+    return 1;
+}
+
+/*
+ * serve_stale - The origin cannot be reached: better the stale copy, if
+ *     there is one, than nothing
+ */
+static int
+serve_stale(EventLoop *lp, Conn *c)
+{
+    if (c->stale == NULL) {
+        return -1;
+    }
+    flight_drop(lp, c);
+    if (c->server.fd >= 0) {
+        close(c->server.fd);
+        c->server.fd = -1;
+    }
+    c->result = LOG_STALE;
+    send_cached(c, c->stale);
+    c->stale = NULL;
+    return 1;
+}
+
+/*
+ * open_upstream - Get an origin connection for the request: an idle one
+ *     from the pool if pooled is set and there is one, else a new one.
+ *     A name that is not cached, or expired, is resolved off the loop.
+ */
+static int
+open_upstream(EventLoop *lp, Conn *c, int pooled)
+{
+    c->iovcnt = request_iov(&c->reqhead, c->req, c->path, c->host, c->stale,
+                            c->iov);
+    print_request(c->iov, c->iovcnt);
+
+    c->reused = pooled && (c->server.fd = upstream_get(
+                               lp->upstream, c->host, c->port)) >= 0;
+    if (c->reused) {
+        c->state = CONN_SEND_REQUEST;
+        return watch(lp, &c->server) < 0 ? -1 : 1;
+    }
+    c->stage_at = metrics_now();
+    if ((c->naddrs = dns_cached(lp->dns, c->host, c->addrs, DNS_MAX_ADDRS)) ==
+        DNS_PENDING) {
+        if (dns_resolve(lp->dns, c->host, loop_wake, lp) < 0) {
+            return -1;
+        }
+        resolve_add(lp, c);
+        c->state = CONN_RESOLVE;
+        return 0;
+    }
+    return start_connect(lp, c);
+}
+
+/*
+ * start_connect - The origin's name resolved to c->naddrs addresses, or
+ *     to -1 if it does not resolve: connect to the first that can be
+ *     connected to
+ */
+static int
+start_connect(EventLoop *lp, Conn *c)
+{
+    c->stage_at = metrics_stage(STAGE_DNS, c->stage_at);
+    c->state = CONN_CONNECT;
+    c->addr = 0;
+    return connect_next(lp, c);
+}
+
+/*
+ * connect_next - Start connecting to the next address of the origin that
+ *     takes it. Returns -1 when none is left.
+ */
+static int
+connect_next(EventLoop *lp, Conn *c)
+{
+    while (c->addr < c->naddrs) {
+        if ((c->server.fd = dns_connect_addr(&c->addrs[c->addr++], c->port,
+                                             1)) >= 0) {
+            return watch(lp, &c->server) < 0 ? -1 : 1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * connect_failed - The origin address being connected to failed: try the
+ *     next ones, and once none is left, the stale copy if there is one
+ */
+static int
+connect_failed(EventLoop *lp, Conn *c)
+{
+    close(c->server.fd); /* Which also takes it off the epoll set */
+    c->server.fd = -1;
+    if (connect_next(lp, c) < 0) {
+        return serve_stale(lp, c);
+    }
+    return 1;
+}
+
+static int
+on_send_cached(EventLoop *lp, Conn *c)
+{
+    CacheObjectPtr op = c->hit;
+    off_t offset;
+    ssize_t n;
+    int rc;
+
+    if ((rc = conn_flush(c, c->client.fd)) <= 0) {
+        return rc;
+    }
+    while (OBJECT_ON_DISK(op) && c->relayed < op->content_length) {
+        offset = op->offset + c->relayed;
+        if ((n = sendfile(c->client.fd, op->fd, &offset,
+                          op->content_length - c->relayed)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return n < 0 && errno == EAGAIN ? 0 : -1;
+        }
+        c->relayed += n;
+    }
+    return c->persist ? conn_reset(lp, c) : -1;
+}
+
+static int
+on_resolve(EventLoop *lp, Conn *c)
+{
+    if ((c->naddrs = dns_cached(lp->dns, c->host, c->addrs, DNS_MAX_ADDRS)) ==
+        DNS_PENDING) {
+        return 0;
+    }
+    resolve_remove(lp, c);
+    if (start_connect(lp, c) < 0) {
+        return serve_stale(lp, c);
+    }
+    return 1;
+}
+
+static int
+on_connect(EventLoop *lp, Conn *c)
+{
+    struct pollfd pfd = {.fd = c->server.fd, .events = POLLOUT};
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (poll(&pfd, 1, 0) == 0) {
+        return 0; /* Still connecting */
+    }
+    if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+        err != 0) {
+        return connect_failed(lp, c);
+    }
+
+    metrics_stage(STAGE_CONNECT, c->stage_at);
+    c->state = CONN_SEND_REQUEST;
+    return 1;
+}
+
+static int
+on_send_request(EventLoop *lp, Conn *c)
+{
+    int rc;
+
+    /* Before writing: the origin may well answer before we run again */
+    c->stage_at = metrics_now();
+    if ((rc = conn_flush(c, c->server.fd)) < 0 && c->reused) {
+        /* The pooled connection went stale, GET is safe to resend */
+        close(c->server.fd);
+        c->server.fd = -1;
+        return open_upstream(lp, c, 0);
+    } else if (rc <= 0) {
+        return rc;
+    }
+    c->inlen = 0;
+    http_init(&c->resphead);
+    c->state = CONN_READ_RESPONSE;
+    return 1;
+}
+
+static int
+on_read_response(EventLoop *lp, Conn *c)
+{
+    ssize_t extra;
+    int rc, keepalive, storable;
+
+    if ((rc = fill_head(c->server.fd, c->in, sizeof(c->in), &c->inlen,
+                        &c->resphead, NULL)) < 0 &&
+        c->reused &&
+        c->inlen == 0) {
+        close(c->server.fd);
+        c->server.fd = -1;
+        return open_upstream(lp, c, 0);
+    } else if (rc <= 0) {
+        return rc;
+    }
+    c->stage_at = metrics_stage(STAGE_TTFB, c->stage_at);
+
+    /* The origin's Connection header is about server.fd, not client.fd */
+    keepalive = upstream_keepalive(&c->resphead, c->in);
+    if ((c->content_length = http_body_length(&c->resphead, c->in)) ==
+        BODY_MALFORMED) {
+        return -1;
+    }
+    if (c->stale && c->resphead.status == 304) {
+        return revalidated(lp, c, keepalive);
+    }
+    if (copy_head(&c->resphead, c->in, lp->headers, sizeof(lp->headers)) <
+            0 ||
+        (c->response_hdrs = strdup(lp->headers)) == NULL) {
+        return -1;
+    }
+    print_response(c->response_hdrs);
+
+    c->reusable = c->content_length != BODY_EOF && keepalive;
+    c->persist = response_persistent(c->persist, c->content_length);
+    /* Followers only get what a shared cache could have given them */
+    storable = response_expiry(c->response_hdrs, lp->cache->heuristic,
+                               request_shareable(&c->reqhead, c->req)) >= 0;
+    if (c->flight &&
+        (!storable ||
+         !flight_headers(&lp->cache->flights, c->flight, c->response_hdrs,
+                         c->content_length))) {
+        flight_drop(lp, c); /* They fetch on their own */
+    }
+    /* What the cache will not keep need not be copied */
+    cache_fill_init(lp->cache, &c->fill, storable ? c->content_length : 0);
+    if (!storable) {
+        c->fill.abandoned = 1;
+    }
+    /* The cache gets a chunked body de-chunked, see frame_headers() */
+    chunk_scan_init(&c->chunks, fill_chunk, &c->fill);
+
+    /* Body bytes that arrived together with the headers */
+    extra = c->inlen - c->resphead.len;
+    memmove(c->buf, c->in + c->resphead.len, extra);
+    if ((extra = relay_body(lp, c, extra)) < 0) {
+        return -1;
+    }
+
+    c->iov[0].iov_base = c->response_hdrs;
+    c->iov[0].iov_len = strlen(c->response_hdrs) - 2; /* No blank line */
+    c->iov[1].iov_base = connection_header(c->persist);
+    c->iov[1].iov_len = strlen(c->iov[1].iov_base);
+    c->iov[2].iov_base = c->buf;
+    c->iov[2].iov_len = extra;
+    c->iovcnt = extra ? 3 : 2;
+    c->state = CONN_RELAY;
+    return 1;
+}
+
+/*
+ * revalidated - The origin answered 304 for the stale copy: refresh it,
+ *     pool the origin connection if it is clean, and send the copy to the
+ *     client and to any followers
+ */
+static int
+revalidated(EventLoop *lp, Conn *c, int keepalive)
+{
+    cache_refresh(lp->cache, c->stale,
+                  refreshed_expiry(&c->resphead, c->in, c->stale,
+                                   lp->cache->heuristic));
+    if (keepalive && c->inlen == c->resphead.len) {
+        /* Closing no longer unregisters it, and another loop may take it */
+        epoll_ctl(lp->epfd, EPOLL_CTL_DEL, c->server.fd, NULL);
+        upstream_put(lp->upstream, c->host, c->port, c->server.fd);
+        c->server.fd = -1;
+    }
+    if (c->flight) {
+        publish_object(lp->cache, c->flight, c->stale);
+        flight_finish(&lp->cache->flights, c->flight, 1);
+        c->flight = NULL;
+    }
+    c->result = LOG_REVALIDATED;
+    send_cached(c, c->stale);
+    c->stale = NULL;
+    return 1;
+}
+
+static int
+on_relay(EventLoop *lp, Conn *c)
+{
+    size_t want;
+    ssize_t n;
+    int rc;
+
+    while (1) {
+        if ((rc = conn_flush(c, c->client.fd)) <= 0) {
+            return rc;
+        }
+
+        if (body_done(c)) {
+            return relay_done(lp, c);
+        }
+
+        /* Once the body will not be cached it need not enter user space */
+        if (c->fill.abandoned && c->flight == NULL && !c->nosplice &&
+            c->content_length != BODY_CHUNKED) {
+            /* 1 is also a finished body whose connection was reset */
+            if ((rc = relay_splice(lp, c)) != 1 || c->state != CONN_RELAY) {
+                return rc;
+            }
+            c->nosplice = 1; /* Fall back to copying */
+        }
+
+        want = sizeof(c->buf);
+        if (c->content_length >= 0 && c->content_length - c->relayed < want) {
+            want = c->content_length - c->relayed;
+        }
+        if ((n = read(c->server.fd, c->buf, want)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        } else if (n == 0) {
+            /* Fine if the body is delimited by EOF, truncated otherwise */
+            return c->content_length == BODY_EOF ? relay_done(lp, c) : -1;
+        }
+
+        if ((n = relay_body(lp, c, n)) < 0) {
+            return -1;
+        }
+        c->iov[0].iov_base = c->buf;
+        c->iov[0].iov_len = n;
+        c->iovcnt = 1;
+    }
+}
+
+/*
+ * on_follow - Send the response of the flight as it arrives. If its
+ *     leader got no response it could share, fetch it after all.
+ */
+static int
+on_follow(EventLoop *lp, Conn *c)
+{
+    size_t n;
+    int rc, state;
+
+    if (c->response_hdrs == NULL) {
+        if (flight_response(c->flight, lp->headers, sizeof(lp->headers),
+                            &c->content_length, &state) < 0) {
+            if (state == FLIGHT_PENDING) {
+                return 0;
+            }
+            flight_drop(lp, c);
+            c->result = LOG_MISS; /* The leader got nothing, fetch it */
+            return open_upstream(lp, c, 1);
+        }
+        if ((c->response_hdrs = strdup(lp->headers)) == NULL) {
+            return -1;
+        }
+        c->persist = response_persistent(c->persist, c->content_length);
+        c->iov[0].iov_base = c->response_hdrs;
+        c->iov[0].iov_len = strlen(c->response_hdrs) - 2; /* No blank line */
+        c->iov[1].iov_base = connection_header(c->persist);
+        c->iov[1].iov_len = strlen(c->iov[1].iov_base);
+        c->iovcnt = 2;
+    }
+
+    while (1) {
+        if ((rc = conn_flush(c, c->client.fd)) <= 0) {
+            return rc;
+        }
+        if ((n = flight_read(c->flight, c->relayed, c->buf, sizeof(c->buf),
+                             &state)) > 0) {
+            c->relayed += n;
+            c->iov[0].iov_base = c->buf;
+            c->iov[0].iov_len = n;
+            c->iovcnt = 1;
+            continue;
+        }
+        if (state == FLIGHT_DONE) {
+            flight_drop(lp, c);
+            return c->persist ? conn_reset(lp, c) : -1;
+        }
+        return state == FLIGHT_FAILED ? -1 : 0;
+    }
+}
+
+static void
+follow_add(EventLoop *lp, Conn *c)
+{
+    c->follow_prev = NULL;
+    c->follow_next = lp->followers;
+    if (lp->followers) {
+        lp->followers->follow_prev = c;
+    }
+    lp->followers = c;
+}
+
+static void
+follow_remove(EventLoop *lp, Conn *c)
+{
+    if (c->follow_prev) {
+        c->follow_prev->follow_next = c->follow_next;
+    } else {
+        lp->followers = c->follow_next;
+    }
+    if (c->follow_next) {
+        c->follow_next->follow_prev = c->follow_prev;
+    }
+}
+
+static void
+resolve_add(EventLoop *lp, Conn *c)
+{
+    c->resolve_prev = NULL;
+    c->resolve_next = lp->resolving;
+    if (lp->resolving) {
+        lp->resolving->resolve_prev = c;
+    }
+    lp->resolving = c;
+}
+
+static void
+resolve_remove(EventLoop *lp, Conn *c)
+{
+    if (c->resolve_prev) {
+        c->resolve_prev->resolve_next = c->resolve_next;
+    } else {
+        lp->resolving = c->resolve_next;
+    }
+    if (c->resolve_next) {
+        c->resolve_next->resolve_prev = c->resolve_prev;
+    }
+}
+
+/*
+ * flight_drop - Let go of the connection's flight: a leader gives it up,
+ *     a follower leaves it
+ */
+static void
+flight_drop(EventLoop *lp, Conn *c)
+{
+    if (c->flight == NULL) {
+        return;
+    }
+    if (c->leader) {
+        flight_finish(&lp->cache->flights, c->flight, 0);
+    } else {
+        flight_leave(c->flight, &c->waiter);
+        follow_remove(lp, c);
+    }
+    c->flight = NULL;
+}
+
+/*
+ * loop_wake - FlightWaiter and dns_resolve() callback, run by the leader
+ *     or the DNS refresh thread
+ */
+static void
+loop_wake(void *arg)
+{
+    EventLoop *lp = arg;
+    uint64_t one = 1;
+
+    /* Can only fail if the counter is full, when a wakeup is pending */
+    write(lp->wakefd, &one, sizeof(one));
+}
+
+/*
+ * wake_waiters - Some flight made progress, or some name resolved: drive
+ *     every connection that follows a flight or waits for a name
+ */
+static void
+wake_waiters(EventLoop *lp)
+{
+    uint64_t count;
+    Conn *c, *next;
+
+    while (read(lp->wakefd, &count, sizeof(count)) > 0)
+        ;
+    for (c = lp->followers; c; c = next) {
+        next = c->follow_next;
+        conn_drive(lp, c);
+    }
+    for (c = lp->resolving; c; c = next) {
+        next = c->resolve_next;
+        conn_drive(lp, c);
+    }
+}
+
+/*
+ * relay_body - Account for n bytes just read into c->buf and tee them
+ *     into the cache copy and the flight. Returns how many belong to the body, which is
+ *     fewer than n only if the origin sent more than the response; the
+ *     connection cannot be reused then. Returns -1 on bad chunk framing.
+ */
+static ssize_t
+relay_body(EventLoop *lp, Conn *c, ssize_t n)
+{
+    ssize_t body = n;
+
+    if (c->content_length == BODY_CHUNKED) {
+        if ((body = chunk_scan(&c->chunks, c->buf, n)) < 0) {
+            return -1;
+        }
+    } else if (c->content_length >= 0 &&
+               body > c->content_length - (ssize_t)c->relayed) {
+        body = c->content_length - c->relayed;
+    }
+    if (body < n) {
+        c->reusable = 0;
+    }
+    if (c->content_length != BODY_CHUNKED) {
+        cache_fill_append(&c->fill, c->buf, body);
+    }
+    if (c->flight &&
+        !flight_append(&lp->cache->flights, c->flight, c->buf, body)) {
+        flight_drop(lp, c);
+    }
+    c->relayed += body;
+    return body;
+}
+
+static int
+body_done(Conn *c)
+{
+    if (c->content_length == BODY_CHUNKED) {
+        return c->chunks.done;
+    }
+    return c->content_length >= 0 && c->relayed == c->content_length;
+}
+
+/*
+ * relay_splice - Relay the rest of the body through the connection's pipe
+ *     with non-blocking splice(). Returns like the state handlers, or 1
+ *     if splice() is not supported here and nothing was consumed yet.
+ */
+static int
+relay_splice(EventLoop *lp, Conn *c)
+{
+    ssize_t n;
+    size_t want;
+
+    if (c->pipefd[0] < 0 && pipe2(c->pipefd, O_NONBLOCK) < 0) {
+        return 1;
+    }
+
+    while (1) {
+        if (c->piped > 0) {
+            if ((n = splice(c->pipefd[0], NULL, c->client.fd, NULL, c->piped,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN ? 0 : -1;
+            }
+            c->piped -= n;
+            continue;
+        }
+
+        if (c->content_length >= 0 && c->relayed == c->content_length) {
+            return relay_done(lp, c);
+        }
+
+        want = RIO_PIPESIZE;
+        if (c->content_length >= 0 && c->content_length - c->relayed < want) {
+            want = c->content_length - c->relayed;
+        }
+        if ((n = splice(c->server.fd, NULL, c->pipefd[1], NULL, want,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && !c->spliced) {
+                return 1;
+            }
+            return errno == EAGAIN ? 0 : -1;
+        } else if (n == 0) {
+            return c->content_length == BODY_EOF ? relay_done(lp, c) : -1;
+        }
+        c->spliced = 1;
+        c->relayed += n;
+        c->piped += n;
+    }
+}
+
+/*
+ * relay_done - The whole body reached the client; cache it if it fit and
+ *     pool the origin connection if it is clean. Then either wait for the
+ *     client's next request or close.
+ */
+static int
+relay_done(EventLoop *lp, Conn *c)
+{
+    time_t expires;
+
+    metrics_stage(STAGE_RELAY, c->stage_at);
+    if (c->reusable) {
+        /* Closing no longer unregisters it, and another loop may take it */
+        epoll_ctl(lp->epfd, EPOLL_CTL_DEL, c->server.fd, NULL);
+        upstream_put(lp->upstream, c->host, c->port, c->server.fd);
+        c->server.fd = -1;
+    }
+    /* Cached copies are self-delimiting whatever the origin sent */
+    if (!c->fill.abandoned &&
+        (expires = response_expiry(c->response_hdrs, lp->cache->heuristic,
+                                   request_shareable(&c->reqhead,
+                                                     c->req))) >= 0 &&
+        (c->content_length >= 0 || frame_response(c) == 0)) {
+        cache_fill_commit(lp->cache, &c->fill, c->key, c->response_hdrs,
+                          expires);
+        print_cache_usage(lp->cache);
+    }
+    /* Only now, so that requests arriving from here on hit the cache */
+    if (c->flight) {
+        flight_finish(&lp->cache->flights, c->flight, 1);
+        c->flight = NULL;
+    }
+    return c->persist ? conn_reset(lp, c) : -1;
+}
+
+/*
+ * frame_response - Give the response headers kept for the cache the
+ *     Content-Length of the EOF-delimited or de-chunked body
+ */
+static int
+frame_response(Conn *c)
+{
+    size_t size = strlen(c->response_hdrs) + 64;
+    char *hdrs;
+
+    if ((hdrs = realloc(c->response_hdrs, size)) == NULL) {
+        return -1;
+    }
+    c->response_hdrs = hdrs;
+    return frame_headers(hdrs, size, c->fill.len);
+}
+
+static time_t
+now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
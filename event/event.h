@@ -0,0 +1,20 @@
+#ifndef EVENT_h
+#define EVENT_h
+
+#include "../cache/cache.h"
+#include "../dns/dns.h"
+#include "../upstream/upstream.h"
+
+/*
+ * Run nloops edge-triggered epoll loops, one per thread, loop i accepting
+ * from listenfds[i]. The descriptors may all be the same socket, or one
+ * SO_REUSEPORT listener per loop. With pin set, loop i is bound to CPU i.
+ * Client connections are kept across requests, and closed after waiting
+ * idle_timeout seconds for one. Origin connections are taken from and
+ * returned to up, and new ones opened to addresses looked up in dc.
+ * Only returns if the loops could not be started.
+ */
+int event_run(int *listenfds, int nloops, int pin, int idle_timeout,
+              CachePtr cp, UpstreamPoolPtr up, DnsCachePtr dc);
+
+#endif
@@ -0,0 +1,489 @@
+/*
+ * http.c - incremental, in-place parsing of HTTP/1.x heads.
+ *
+ * The parser works a line at a time: it looks for the next LF from where
+ * it stopped and, once a line is whole, splits it into slices at its
+ * spaces or colon. All three delimiters are found with scan_char(). A head
+ * that arrives in pieces is parsed by calling http_parse() again with the
+ * same buffer, longer; lines already parsed are not looked at again. The
+ * fields the proxy acts on are indexed as they are parsed, so finding them
+ * afterwards does not search the head.
+ */
+#define _GNU_SOURCE
+#include "http.h"
+#include "../scan/scan.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static int parse_start(HttpHead *hp, const char *buf, size_t eol);
+static int parse_field(HttpHead *hp, const char *buf, size_t start,
+                       size_t eol);
+static int known_field(const char *name, size_t len);
+static int slice_has_token(const char *s, size_t len, const char *token);
+static int slice_directive(const char *s, size_t len, const char *name,
+                           long *value);
+static int cacheable_status(int status);
+static int http_minor(const char *s, size_t len);
+
+static const struct {
+    const char *name;
+    size_t len;
+} known_names[HDR_NKNOWN] = {
+    {"host", 4},
+    {"connection", 10},
+    {"proxy-connection", 16},
+    {"keep-alive", 10},
+    {"content-length", 14},
+    {"transfer-encoding", 17},
+    {"user-agent", 10},
+    {"cache-control", 13},
+    {"pragma", 6},
+    {"expires", 7},
+    {"date", 4},
+    {"age", 3},
+    {"etag", 4},
+    {"last-modified", 13},
+    {"if-none-match", 13},
+    {"if-modified-since", 17},
+    {"authorization", 13},
+    {"cookie", 6},
+    {"set-cookie", 10},
+};
+
+void
+http_init(HttpHead *hp)
+{
+    int i;
+
+    memset(hp->start, 0, sizeof(hp->start));
+    hp->minor = -1;
+    hp->status = 0;
+    hp->line_end = 0;
+    hp->nfields = 0;
+    for (i = 0; i < HDR_NKNOWN; i++) {
+        hp->known[i] = -1;
+    }
+    hp->len = 0;
+    hp->pos = 0;
+}
+
+/*
+ * http_parse - Parse on from where the last call stopped, buf holding the
+ *     first n bytes of the head and possibly more after it. Returns 1 once
+ *     the head is complete, 0 if it needs more bytes, -1 if it is bad.
+ */
+int
+http_parse(HttpHead *hp, const char *buf, size_t n)
+{
+    const char *nl;
+    size_t eol;
+
+    if (hp->len) {
+        return 1;
+    }
+    while (hp->pos < n &&
+           (nl = scan_char(buf + hp->pos, n - hp->pos, '\n')) != NULL) {
+        eol = nl - buf;
+        if (hp->pos == 0) {
+            if (parse_start(hp, buf, eol) < 0) {
+                return -1;
+            }
+        } else if (eol == hp->pos ||
+                   (eol == hp->pos + 1 && buf[hp->pos] == '\r')) {
+            hp->len = eol + 1;
+            return 1;
+        } else if (parse_field(hp, buf, hp->pos, eol) < 0) {
+            return -1;
+        }
+        hp->pos = eol + 1;
+    }
+    return 0;
+}
+
+/*
+ * http_has_token - Whether any hdr field of the head lists token, as in
+ *     Connection: close
+ */
+int
+http_has_token(HttpHead *hp, const char *head, int hdr, const char *token)
+{
+    HttpField *f;
+    int i;
+
+    for (i = hp->known[hdr]; i >= 0; i = f->next) {
+        f = &hp->fields[i];
+        if (slice_has_token(head + f->value.off, f->value.len, token)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * http_body_length - How the body of a response head is delimited: its
+ *     length, or BODY_CHUNKED or BODY_EOF. Returns BODY_MALFORMED for a
+ *     Content-Length that is not all digits, empty included, or does not
+ *     fit in an ssize_t.
+ */
+ssize_t
+http_body_length(HttpHead *hp, const char *head)
+{
+    HttpField *f;
+    ssize_t len = 0;
+    size_t i;
+    int d;
+
+    /* These never have a body, whatever the headers say */
+    if ((hp->status >= 100 && hp->status < 200) || hp->status == 204 ||
+        hp->status == 304) {
+        return 0;
+    }
+    if (http_has_token(hp, head, HDR_TRANSFER_ENCODING, "chunked")) {
+        return BODY_CHUNKED;
+    }
+    if (hp->known[HDR_CONTENT_LENGTH] < 0) {
+        return BODY_EOF;
+    }
+    f = &hp->fields[hp->known[HDR_CONTENT_LENGTH]];
+    if (f->value.len == 0) {
+        return BODY_MALFORMED;
+    }
+    for (i = 0; i < f->value.len; i++) {
+        if (head[f->value.off + i] < '0' || head[f->value.off + i] > '9') {
+            return BODY_MALFORMED;
+        }
+        d = head[f->value.off + i] - '0';
+        if (len > (SSIZE_MAX - d) / 10) {
+            return BODY_MALFORMED;
+        }
+        len = len * 10 + d;
+    }
+    return len;
+}
+
+/*
+ * http_directive - Whether a hdr field of the head, Cache-Control say,
+ *     has the directive name. If it has a number, as in max-age=60, and
+ *     value is not NULL, the number is put there, else -1.
+ */
+int
+http_directive(HttpHead *hp, const char *head, int hdr, const char *name,
+               long *value)
+{
+    HttpField *f;
+    int i;
+
+    for (i = hp->known[hdr]; i >= 0; i = f->next) {
+        f = &hp->fields[i];
+        if (slice_directive(head + f->value.off, f->value.len, name, value)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * http_date - The time in the first hdr field of the head, or -1 if there
+ *     is none or it is not an HTTP date. Only the preferred format,
+ *     "Sun, 06 Nov 1994 08:49:37 GMT", is understood.
+ */
+time_t
+http_date(HttpHead *hp, const char *head, int hdr)
+{
+    char date[64], *end;
+    struct tm tm;
+    HttpField *f;
+
+    if (hp->known[hdr] < 0) {
+        return -1;
+    }
+    f = &hp->fields[hp->known[hdr]];
+    if (f->value.len >= sizeof(date)) {
+        return -1;
+    }
+    memcpy(date, head + f->value.off, f->value.len);
+    date[f->value.len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    if ((end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm)) == NULL ||
+        *end) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+/*
+ * http_lifetime - For how many more seconds, from now, a response with
+ *     this head may be served from a shared cache without asking the
+ *     origin: s-maxage or max-age, else Expires, less the Age it already
+ *     has. With none of them it is a tenth of the time since
+ *     Last-Modified, but at most heuristic seconds, or heuristic without
+ *     Last-Modified either. 0 means it may be stored but has to be
+ *     revalidated every time; -1 that it must not be stored.
+ */
+long
+http_lifetime(HttpHead *hp, const char *head, time_t now, long heuristic)
+{
+    time_t date, expires, modified;
+    long lifetime, age = 0;
+
+    /* A Set-Cookie is meant for the one client that asked */
+    if (!cacheable_status(hp->status) || hp->known[HDR_SET_COOKIE] >= 0 ||
+        http_directive(hp, head, HDR_CACHE_CONTROL, "no-store", NULL) ||
+        http_directive(hp, head, HDR_CACHE_CONTROL, "private", NULL)) {
+        return -1;
+    }
+    if (http_directive(hp, head, HDR_CACHE_CONTROL, "no-cache", NULL) ||
+        http_directive(hp, head, HDR_PRAGMA, "no-cache", NULL)) {
+        return 0;
+    }
+
+    if ((date = http_date(hp, head, HDR_DATE)) < 0) {
+        date = now;
+    }
+    if ((http_directive(hp, head, HDR_CACHE_CONTROL, "s-maxage",
+                        &lifetime) ||
+         http_directive(hp, head, HDR_CACHE_CONTROL, "max-age", &lifetime)) &&
+        lifetime >= 0) {
+        /* Taken as is */
+    } else if (hp->known[HDR_EXPIRES] >= 0) {
+        /* An invalid date, 0 say, means already expired */
+        expires = http_date(hp, head, HDR_EXPIRES);
+        lifetime = expires > date ? expires - date : 0;
+    } else if ((modified = http_date(hp, head, HDR_LAST_MODIFIED)) >= 0 &&
+               modified < date) {
+        lifetime = (date - modified) / 10;
+        if (lifetime > heuristic) {
+            lifetime = heuristic;
+        }
+    } else {
+        lifetime = heuristic;
+    }
+
+    if (hp->known[HDR_AGE] >= 0) {
+        age = strtol(head + hp->fields[hp->known[HDR_AGE]].value.off, NULL,
+                     10);
+    }
+    return lifetime > age ? lifetime - age : 0;
+}
+
+/*
+ * parse_start - Split the start line at its first two spaces. A response
+ *     may have no reason phrase.
+ */
+static int
+parse_start(HttpHead *hp, const char *buf, size_t eol)
+{
+    const char *sp1, *sp2;
+    size_t end = eol;
+    int i;
+
+    if (end > 0 && buf[end - 1] == '\r') {
+        end--;
+    }
+    if ((sp1 = scan_char(buf, end, ' ')) == NULL || sp1 == buf) {
+        return -1;
+    }
+    hp->start[0].off = 0;
+    hp->start[0].len = sp1 - buf;
+    hp->start[1].off = sp1 + 1 - buf;
+    if ((sp2 = scan_char(sp1 + 1, end - hp->start[1].off, ' ')) != NULL) {
+        hp->start[1].len = sp2 - sp1 - 1;
+        hp->start[2].off = sp2 + 1 - buf;
+        hp->start[2].len = end - hp->start[2].off;
+    } else {
+        hp->start[1].len = end - hp->start[1].off;
+        hp->start[2].off = end;
+        hp->start[2].len = 0;
+    }
+    hp->line_end = eol + 1;
+
+    if (hp->start[0].len > 5 && !strncmp(buf, "HTTP/", 5)) {
+        hp->minor = http_minor(buf, hp->start[0].len);
+        if (hp->start[1].len != 3) {
+            return -1;
+        }
+        for (i = 0; i < 3; i++) {
+            if (buf[hp->start[1].off + i] < '0' ||
+                buf[hp->start[1].off + i] > '9') {
+                return -1;
+            }
+            hp->status = hp->status * 10 + (buf[hp->start[1].off + i] - '0');
+        }
+    } else {
+        hp->minor = http_minor(buf + hp->start[2].off, hp->start[2].len);
+    }
+    return 0;
+}
+
+/*
+ * parse_field - Slice the field on the line from start to the LF at eol,
+ *     and index it if it is one the proxy acts on.
+ */
+static int
+parse_field(HttpHead *hp, const char *buf, size_t start, size_t eol)
+{
+    const char *colon;
+    HttpField *f;
+    size_t vstart, vend = eol;
+    int i;
+
+    if (hp->nfields == HTTP_MAX_FIELDS) {
+        return -1;
+    }
+    /* No name, or a folded continuation line */
+    if ((colon = scan_char(buf + start, eol - start, ':')) == NULL ||
+        colon == buf + start || buf[start] == ' ' || buf[start] == '\t') {
+        return -1;
+    }
+
+    f = &hp->fields[hp->nfields];
+    f->name.off = start;
+    f->name.len = colon - buf - start;
+    vstart = colon + 1 - buf;
+    while (vstart < vend && (buf[vstart] == ' ' || buf[vstart] == '\t')) {
+        vstart++;
+    }
+    while (vend > vstart && (buf[vend - 1] == '\r' || buf[vend - 1] == ' ' ||
+                             buf[vend - 1] == '\t')) {
+        vend--;
+    }
+    f->value.off = vstart;
+    f->value.len = vend - vstart;
+    f->end = eol + 1;
+    f->next = -1;
+
+    if ((f->known = known_field(buf + start, f->name.len)) >= 0) {
+        if ((i = hp->known[f->known]) < 0) {
+            hp->known[f->known] = hp->nfields;
+        } else {
+            while (hp->fields[i].next >= 0) {
+                i = hp->fields[i].next;
+            }
+            hp->fields[i].next = hp->nfields;
+        }
+    }
+    hp->nfields++;
+    return 0;
+}
+
+static int
+known_field(const char *name, size_t len)
+{
+    int i;
+
+    for (i = 0; i < HDR_NKNOWN; i++) {
+        if (known_names[i].len == len &&
+            !strncasecmp(name, known_names[i].name, len)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * slice_has_token - Whether the comma separated list s holds token
+ */
+static int
+slice_has_token(const char *s, size_t len, const char *token)
+{
+    size_t tlen = strlen(token), i = 0, end;
+
+    while (i < len) {
+        while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == ',')) {
+            i++;
+        }
+        for (end = i; end < len && s[end] != ','; end++)
+            ;
+        while (end > i && (s[end - 1] == ' ' || s[end - 1] == '\t')) {
+            end--;
+        }
+        if (end - i == tlen && !strncasecmp(s + i, token, tlen)) {
+            return 1;
+        }
+        while (i < len && s[i] != ',') {
+            i++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * slice_directive - Whether the comma separated list s has the directive
+ *     name, see http_directive()
+ */
+static int
+slice_directive(const char *s, size_t len, const char *name, long *value)
+{
+    size_t nlen = strlen(name), i = 0, end;
+
+    while (i < len) {
+        while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == ',')) {
+            i++;
+        }
+        for (end = i; end < len && s[end] != ',' && s[end] != '=' &&
+                      s[end] != ' ' && s[end] != '\t';
+             end++)
+            ;
+        if (end - i == nlen && !strncasecmp(s + i, name, nlen)) {
+            if (value) {
+                *value = -1;
+                while (end < len && (s[end] == ' ' || s[end] == '=' ||
+                                     s[end] == '"')) {
+                    end++;
+                }
+                if (end < len && s[end] >= '0' && s[end] <= '9') {
+                    for (*value = 0; end < len && s[end] >= '0' &&
+                                     s[end] <= '9' && *value < 1L << 40;
+                         end++) {
+                        *value = *value * 10 + (s[end] - '0');
+                    }
+                }
+            }
+            return 1;
+        }
+        while (i < len && s[i] != ',') {
+            i++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * cacheable_status - The statuses RFC 9110 lets be cached by default.
+ *     Responses with any other are not cached at all. A 304 is not stored
+ *     itself but its freshness is that of the response it revalidates.
+ */
+static int
+cacheable_status(int status)
+{
+    switch (status) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 304:
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * http_minor - x of an "HTTP/1.x" version, or -1
+ */
+static int
+http_minor(const char *s, size_t len)
+{
+    if (len != 8 || strncmp(s, "HTTP/1.", 7) || s[7] < '0' || s[7] > '9') {
+        return -1;
+    }
+    return s[7] - '0';
+}
@@ -0,0 +1,79 @@
+#ifndef HTTP_h
+#define HTTP_h
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define HTTP_MAX_FIELDS 64
+
+/* http_body_length() results other than a byte count */
+#define BODY_EOF -1       /* Delimited by the origin closing the connection */
+#define BODY_CHUNKED -2   /* Transfer-Encoding: chunked */
+#define BODY_MALFORMED -3 /* A Content-Length that is no byte count */
+
+/* Header fields the proxy acts on, indexed in HttpHead.known */
+#define HDR_HOST 0
+#define HDR_CONNECTION 1
+#define HDR_PROXY_CONNECTION 2
+#define HDR_KEEP_ALIVE 3
+#define HDR_CONTENT_LENGTH 4
+#define HDR_TRANSFER_ENCODING 5
+#define HDR_USER_AGENT 6
+#define HDR_CACHE_CONTROL 7
+#define HDR_PRAGMA 8
+#define HDR_EXPIRES 9
+#define HDR_DATE 10
+#define HDR_AGE 11
+#define HDR_ETAG 12
+#define HDR_LAST_MODIFIED 13
+#define HDR_IF_NONE_MATCH 14
+#define HDR_IF_MODIFIED_SINCE 15
+#define HDR_AUTHORIZATION 16
+#define HDR_COOKIE 17
+#define HDR_SET_COOKIE 18
+#define HDR_NKNOWN 19
+
+/* A piece of the head, as an offset from its first byte */
+typedef struct http_slice {
+    unsigned int off, len;
+} HttpSlice;
+
+typedef struct http_field {
+    HttpSlice name, value; /* The value without surrounding whitespace */
+    unsigned int end;      /* Just past the field's line ending */
+    int known;             /* HDR_*, or -1 */
+    int next;              /* Next field with the same known name, or -1 */
+} HttpField;
+
+/*
+ * A request or response head parsed in place: everything is a slice of
+ * the buffer it was parsed from, nothing is copied. The parser can be fed
+ * the same buffer again as more of the head arrives, and picks up at the
+ * line where it stopped.
+ */
+typedef struct http_head {
+    HttpSlice start[3];    /* Method, target, version; or version, status,
+                              reason */
+    int minor;             /* x of HTTP/1.x, -1 for anything else */
+    int status;            /* Responses only */
+    unsigned int line_end; /* Just past the start line */
+    HttpField fields[HTTP_MAX_FIELDS];
+    int nfields;
+    int known[HDR_NKNOWN]; /* First field of each, or -1 */
+    size_t len;            /* Of the whole head, once parsed */
+    size_t pos;            /* Start of the first line not parsed yet */
+} HttpHead;
+
+void http_init(HttpHead *hp);
+int http_parse(HttpHead *hp, const char *buf, size_t n);
+int http_has_token(HttpHead *hp, const char *head, int hdr,
+                   const char *token);
+ssize_t http_body_length(HttpHead *hp, const char *head);
+int http_directive(HttpHead *hp, const char *head, int hdr, const char *name,
+                   long *value);
+time_t http_date(HttpHead *hp, const char *head, int hdr);
+long http_lifetime(HttpHead *hp, const char *head, time_t now,
+                   long heuristic);
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * log.c - access log, a line per request, written in the background.
+ *
+ * A thread serving requests formats the line straight into a ring of its
+ * own and moves on: no lock, no system call. A writer thread wakes every
+ * LOG_FLUSH_MS, points one writev() at whatever the rings hold and hands
+ * the entries back once it is written. A thread whose ring is full drops
+ * the line and counts it rather than wait for the disk, and with sampling
+ * only one request in so many is logged at all.
+ */
+#define _GNU_SOURCE
+#include "log.h"
+#include "../rio/rio.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *results[] = {
+    "hit", "miss", "revalidated", "stale", "coalesced",
+};
+
+static int log_fd = -1;
+static unsigned int log_sample = 1;
+static atomic_ulong written;
+static LogRing *_Atomic rings;
+static __thread LogRing *self;
+
+static LogRing *thread_ring(void);
+static void *writer_loop(void *vargp);
+static void flush(struct iovec *iov, int iovcnt, LogRing *first,
+                  LogRing *last);
+static char *number(char *buf, size_t size, long v);
+
+/*
+ * log_open - Append the access log to path from now on, logging one
+ *     request in sample. Returns -1 if it cannot be opened.
+ */
+int
+log_open(const char *path, unsigned int sample)
+{
+    pthread_t tid;
+
+    if ((log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                       0644)) < 0) {
+        return -1;
+    }
+    log_sample = sample ? sample : 1;
+    if (pthread_create(&tid, NULL, writer_loop, NULL) != 0) {
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/*
+ * log_access - Log the request in head: how it was served, the status and
+ *     body bytes sent (or -1 if unknown) and how long it took
+ */
+void
+log_access(HttpHead *req, const char *head, int result, int status,
+           ssize_t bytes, unsigned long ns)
+{
+    char code[16], size[24];
+    struct timespec ts;
+    unsigned long h;
+    LogRing *rp;
+    LogEntry *ep;
+    int n;
+
+    if (log_fd < 0 || (rp = thread_ring()) == NULL ||
+        rp->seen++ % log_sample) {
+        return;
+    }
+    h = atomic_load_explicit(&rp->head, memory_order_relaxed);
+    if (h - atomic_load_explicit(&rp->tail, memory_order_acquire) ==
+        LOG_RING) {
+        /* Only this thread writes it */
+        atomic_store_explicit(
+            &rp->dropped,
+            atomic_load_explicit(&rp->dropped, memory_order_relaxed) + 1,
+            memory_order_relaxed);
+        return;
+    }
+
+    ep = &rp->entries[h & (LOG_RING - 1)];
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    n = snprintf(ep->line, LOG_LINE,
+                 "time=%ld.%03ld method=%.*s uri=%.*s status=%s bytes=%s "
+                 "cache=%s us=%lu\n",
+                 (long)ts.tv_sec, ts.tv_nsec / 1000000,
+                 (int)req->start[0].len, head + req->start[0].off,
+                 (int)req->start[1].len, head + req->start[1].off,
+                 number(code, sizeof(code), status > 0 ? status : -1),
+                 number(size, sizeof(size), bytes), results[result],
+                 ns / 1000);
+    if (n >= LOG_LINE) {
+        n = LOG_LINE;
+        ep->line[n - 1] = '\n'; /* Over the terminating NUL */
+    }
+    ep->len = n;
+    atomic_store_explicit(&rp->head, h + 1, memory_order_release);
+}
+
+/*
+ * log_counts - Lines written so far, and lost to full rings
+ */
+void
+log_counts(unsigned long *nwritten, unsigned long *ndropped)
+{
+    LogRing *rp;
+
+    *nwritten = atomic_load(&written);
+    *ndropped = 0;
+    for (rp = atomic_load(&rings); rp; rp = rp->next) {
+        *ndropped += atomic_load_explicit(&rp->dropped, memory_order_relaxed);
+    }
+}
+
+/*
+ * thread_ring - This thread's ring, made and linked in on first use
+ */
+static LogRing *
+thread_ring(void)
+{
+    LogRing *rp;
+
+    if (self) {
+        return self;
+    }
+    if ((rp = calloc(1, sizeof(LogRing))) == NULL) {
+        return NULL;
+    }
+    rp->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &rp->next, rp))
+        ;
+    return self = rp;
+}
+
+/*
+ * writer_loop - Write what the rings hold every LOG_FLUSH_MS. The rings
+ *     seen on a pass are a stretch of the list, since new ones are only
+ *     pushed at its front, and get their entries back together.
+ */
+static void *
+writer_loop(void *vargp)
+{
+    struct timespec pause = {.tv_nsec = LOG_FLUSH_MS * 1000000L};
+    struct iovec iov[IOV_MAX];
+    unsigned long head;
+    LogRing *first, *rp;
+    LogEntry *ep;
+    int n;
+
+    while (1) {
+        n = 0;
+        first = atomic_load(&rings);
+        for (rp = first; rp; rp = rp->next) {
+            rp->taken = atomic_load_explicit(&rp->tail, memory_order_relaxed);
+            head = atomic_load_explicit(&rp->head, memory_order_acquire);
+            while (rp->taken != head) {
+                if (n == IOV_MAX) {
+                    flush(iov, n, first, rp);
+                    n = 0;
+                    first = rp;
+                }
+                ep = &rp->entries[rp->taken++ & (LOG_RING - 1)];
+                iov[n].iov_base = ep->line;
+                iov[n++].iov_len = ep->len;
+            }
+        }
+        if (n > 0) {
+            flush(iov, n, first, NULL);
+        }
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * flush - Write iov, then give the rings from first to last (or the end
+ *     of the list) back the entries taken from them. A line that could not
+ *     be written is lost, the ring is not held up for it.
+ */
+static void
+flush(struct iovec *iov, int iovcnt, LogRing *first, LogRing *last)
+{
+    LogRing *rp;
+
+    if (rio_writevn(log_fd, iov, iovcnt) >= 0) {
+        atomic_fetch_add(&written, iovcnt);
+    }
+    for (rp = first; rp; rp = rp->next) {
+        atomic_store_explicit(&rp->tail, rp->taken, memory_order_release);
+        if (rp == last) {
+            break;
+        }
+    }
+}
+
+/*
+ * number - v in buf, or "-" if it is negative
+ */
+static char *
+number(char *buf, size_t size, long v)
+{
+    if (v < 0) {
+        return "-";
+    }
+    snprintf(buf, size, "%ld", v);
+    return buf;
+}
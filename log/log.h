@@ -0,0 +1,43 @@
+#ifndef LOG_h
+#define LOG_h
+
+#include "../http/http.h"
+#include <stdatomic.h>
+
+#define LOG_RING 1024    /* Lines each thread may have waiting, a power of 2 */
+#define LOG_LINE 256     /* Longest line, longer ones are cut short */
+#define LOG_FLUSH_MS 10  /* How often the writer drains the rings */
+
+/* How a request was served */
+#define LOG_HIT 0         /* From the cache */
+#define LOG_MISS 1        /* From the origin */
+#define LOG_REVALIDATED 2 /* From the cache, after the origin said it is current */
+#define LOG_STALE 3       /* From the cache, stale, the origin unreachable */
+#define LOG_COALESCED 4   /* From another request's fetch */
+
+typedef struct log_entry {
+    unsigned int len;
+    char line[LOG_LINE];
+} LogEntry;
+
+/*
+ * One thread's lines, waiting to be written. The thread fills entries at
+ * head and the writer empties them at tail; each index has a single
+ * writer, and the entries keep the two apart in memory.
+ */
+typedef struct log_ring {
+    atomic_ulong head;
+    unsigned long seen; /* Requests, for sampling */
+    LogEntry entries[LOG_RING];
+    atomic_ulong tail;
+    atomic_ulong dropped; /* Lines lost to a full ring */
+    unsigned long taken;  /* The writer's, up to where it is writing */
+    struct log_ring *next;
+} LogRing;
+
+int log_open(const char *path, unsigned int sample);
+void log_access(HttpHead *req, const char *head, int result, int status,
+                ssize_t bytes, unsigned long ns);
+void log_counts(unsigned long *written, unsigned long *dropped);
+
+#endif
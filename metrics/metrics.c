@@ -0,0 +1,451 @@
+/*
+ * metrics.c - request stage latencies and cache counters, served in the
+ *             Prometheus text format on a local admin port.
+ *
+ * Each thread that times something gets its own histograms on first use
+ * and links them into a list that is never shortened; recording is a few
+ * relaxed loads and stores to memory no other thread writes. The admin
+ * thread adds every thread's histograms up on each scrape, and reads the
+ * cache's counters from cache_stats(), the access log's from
+ * log_counts(), and the worker pool's from pool_stats() once the threaded
+ * mode has registered it.
+ */
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "../log/log.h"
+#include "../rio/rio.h"
+#include "../sock_interface/sock_interface.h"
+#include <time.h>
+
+#define METRICS_PATH "/metrics"
+#define PROM_MIN_EXP 10 /* Coarsest exported bucket bounds: 2^10 ns... */
+#define PROM_MAX_EXP 36 /* ...to 2^36 ns, about a minute */
+
+static const char *stage_names[STAGES] = {
+    "parse", "lookup", "dns", "connect", "ttfb", "relay", "total",
+};
+static const double quantiles[] = {0.5, 0.99, 0.999};
+
+static MetricsThread *_Atomic threads;
+static Pool *_Atomic pool; /* Only in the threaded mode */
+static __thread MetricsThread *self;
+
+static MetricsThread *thread_metrics(void);
+static size_t bucket_of(unsigned long ns);
+static unsigned long bucket_max(size_t idx);
+static void *admin_loop(void *vargp);
+static void admin_reply(int connfd, CachePtr cp);
+static void write_metrics(FILE *fp, CachePtr cp);
+static void write_histogram(FILE *fp, int stage, unsigned long *merged,
+                            unsigned long sum_ns);
+static void write_quantiles(FILE *fp, int stage, unsigned long *merged);
+static int open_admin_listenfd(char *port);
+
+typedef struct admin {
+    int listenfd;
+    CachePtr cp;
+} Admin;
+
+unsigned long
+metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * metrics_stage - Record that stage took from start until now, which is
+ *     returned so the next stage can start from it
+ */
+unsigned long
+metrics_stage(int stage, unsigned long start)
+{
+    unsigned long now = metrics_now();
+
+    metrics_record(stage, now > start ? now - start : 0);
+    return now;
+}
+
+void
+metrics_record(int stage, unsigned long ns)
+{
+    MetricsThread *mt;
+    atomic_ulong *count;
+
+    if ((mt = thread_metrics()) == NULL) {
+        return;
+    }
+    /* Only this thread writes, a plain increment cannot lose updates */
+    count = &mt->counts[stage][bucket_of(ns)];
+    atomic_store_explicit(
+        count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    atomic_store_explicit(
+        &mt->sum_ns[stage],
+        atomic_load_explicit(&mt->sum_ns[stage], memory_order_relaxed) + ns,
+        memory_order_relaxed);
+}
+
+/*
+ * metrics_serve - Serve the metrics of cp over HTTP on 127.0.0.1:port,
+ *     from a thread of its own
+ */
+int
+metrics_serve(char *port, CachePtr cp)
+{
+    pthread_t tid;
+    Admin *ap;
+
+    if ((ap = malloc(sizeof(Admin))) == NULL) {
+        return -1;
+    }
+    ap->cp = cp;
+    if ((ap->listenfd = open_admin_listenfd(port)) < 0) {
+        free(ap);
+        return -1;
+    }
+    if (pthread_create(&tid, NULL, admin_loop, ap) != 0) {
+        close(ap->listenfd);
+        free(ap);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+/*
+ * metrics_pool - Export the queue of pp too, from now on. pp must be
+ *     initialized already.
+ */
+void
+metrics_pool(PoolPtr pp)
+{
+    atomic_store(&pool, pp);
+}
+
+/*
+ * thread_metrics - The calling thread's histograms, created and listed
+ *     on first use
+ */
+static MetricsThread *
+thread_metrics(void)
+{
+    MetricsThread *head;
+
+    if (self == NULL && (self = calloc(1, sizeof(MetricsThread)))) {
+        head = atomic_load(&threads);
+        do {
+            self->next = head;
+        } while (!atomic_compare_exchange_weak(&threads, &head, self));
+    }
+    return self;
+}
+
+static size_t
+bucket_of(unsigned long ns)
+{
+    int e;
+    size_t idx;
+
+    if (ns < 2 * METRICS_SUB) {
+        return ns;
+    }
+    e = 63 - __builtin_clzl(ns); /* ns is in [2^e, 2^(e+1)) */
+    if (e >= METRICS_MAX_EXP) {
+        return METRICS_BUCKETS - 1;
+    }
+    idx = 2 * METRICS_SUB + (e - METRICS_SUB_BITS - 1) * METRICS_SUB +
+          ((ns >> (e - METRICS_SUB_BITS)) & (METRICS_SUB - 1));
+    return idx;
+}
+
+/*
+ * bucket_max - The largest value counted in bucket idx
+ */
+static unsigned long
+bucket_max(size_t idx)
+{
+    size_t group, sub;
+    int shift;
+
+    if (idx < 2 * METRICS_SUB) {
+        return idx;
+    }
+    group = (idx - 2 * METRICS_SUB) / METRICS_SUB;
+    sub = (idx - 2 * METRICS_SUB) % METRICS_SUB;
+    shift = group + 1;
+    return ((METRICS_SUB + sub + 1UL) << shift) - 1;
+}
+
+static void *
+admin_loop(void *vargp)
+{
+    Admin *ap = (Admin *)vargp;
+    int connfd;
+
+    while (1) {
+        if ((connfd = accept(ap->listenfd, NULL, NULL)) < 0) {
+            continue;
+        }
+        admin_reply(connfd, ap->cp);
+        close(connfd);
+    }
+    return NULL;
+}
+
+/*
+ * admin_reply - Answer one scrape. Anything but GET /metrics is a 404.
+ */
+static void
+admin_reply(int connfd, CachePtr cp)
+{
+    struct timeval timeout = {.tv_sec = 1};
+    char req[MAXLINE], head[MAXLINE], *body = NULL;
+    size_t len = 0, body_len = 0;
+    ssize_t n;
+    FILE *fp;
+    int found;
+
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (len < sizeof(req) - 1) {
+        if ((n = read(connfd, req + len, sizeof(req) - 1 - len)) <= 0) {
+            return;
+        }
+        len += n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+            break;
+        }
+    }
+    found = !strncmp(req, "GET " METRICS_PATH, strlen("GET " METRICS_PATH)) &&
+            strchr(" ?", req[strlen("GET " METRICS_PATH)]);
+
+    if (found && (fp = open_memstream(&body, &body_len))) {
+        write_metrics(fp, cp);
+        fclose(fp);
+    }
+    if (body == NULL) {
+        found = 0;
+    }
+    n = snprintf(head, sizeof(head),
+                 "HTTP/1.1 %s\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n",
+                 found ? "200 OK" : "404 Not Found", found ? body_len : 0);
+    if (rio_writen(connfd, head, n) >= 0 && found) {
+        rio_writen(connfd, body, body_len);
+    }
+    free(body);
+}
+
+static void
+write_metrics(FILE *fp, CachePtr cp)
+{
+    unsigned long *merged, sum_ns, logged, dropped;
+    atomic_ulong *counts;
+    MetricsThread *mt;
+    CacheStats st;
+    PoolStats ps;
+    PoolPtr pp;
+    size_t allocated;
+    int stage, i;
+
+    fprintf(fp, "# HELP proxy_stage_duration_seconds Time spent in each "
+                "stage of a request.\n"
+                "# TYPE proxy_stage_duration_seconds histogram\n");
+    merged = calloc(STAGES * METRICS_BUCKETS, sizeof(unsigned long));
+    for (stage = 0; merged && stage < STAGES; stage++) {
+        sum_ns = 0;
+        for (mt = atomic_load(&threads); mt; mt = mt->next) {
+            counts = mt->counts[stage];
+            for (i = 0; i < METRICS_BUCKETS; i++) {
+                merged[stage * METRICS_BUCKETS + i] +=
+                    atomic_load_explicit(&counts[i], memory_order_relaxed);
+            }
+            sum_ns +=
+                atomic_load_explicit(&mt->sum_ns[stage], memory_order_relaxed);
+        }
+        write_histogram(fp, stage, &merged[stage * METRICS_BUCKETS], sum_ns);
+    }
+    fprintf(fp, "# HELP proxy_stage_duration_quantile_seconds Quantiles of "
+                "each stage, at the histograms' full resolution.\n"
+                "# TYPE proxy_stage_duration_quantile_seconds gauge\n");
+    for (stage = 0; merged && stage < STAGES; stage++) {
+        write_quantiles(fp, stage, &merged[stage * METRICS_BUCKETS]);
+    }
+    free(merged);
+
+    cache_stats(cp, &st);
+    allocated = cache_size(cp);
+    fprintf(fp,
+            "# HELP proxy_cache_lookups_total Cache lookups by result.\n"
+            "# TYPE proxy_cache_lookups_total counter\n"
+            "proxy_cache_lookups_total{result=\"hit\"} %lu\n"
+            "proxy_cache_lookups_total{result=\"miss\"} %lu\n"
+            "# HELP proxy_cache_bytes_total Body bytes served from the cache "
+            "and fetched on misses.\n"
+            "# TYPE proxy_cache_bytes_total counter\n"
+            "proxy_cache_bytes_total{result=\"hit\"} %lu\n"
+            "proxy_cache_bytes_total{result=\"miss\"} %lu\n"
+            "# HELP proxy_cache_evictions_total Objects evicted from memory.\n"
+            "# TYPE proxy_cache_evictions_total counter\n"
+            "proxy_cache_evictions_total %lu\n"
+            "# HELP proxy_cache_capacity_bytes Bytes the cache may hold.\n"
+            "# TYPE proxy_cache_capacity_bytes gauge\n"
+            "proxy_cache_capacity_bytes %zu\n"
+            "# HELP proxy_cache_stored_bytes Bytes of the cached objects.\n"
+            "# TYPE proxy_cache_stored_bytes gauge\n"
+            "proxy_cache_stored_bytes %zu\n"
+            "# HELP proxy_cache_allocated_bytes Bytes the allocator has "
+            "handed out, including evicted objects still being sent.\n"
+            "# TYPE proxy_cache_allocated_bytes gauge\n"
+            "proxy_cache_allocated_bytes %zu\n"
+            "# HELP proxy_cache_fragmentation_ratio Share of the allocated "
+            "bytes not holding cached objects.\n"
+            "# TYPE proxy_cache_fragmentation_ratio gauge\n"
+            "proxy_cache_fragmentation_ratio %.4f\n",
+            st.hits, st.misses, st.hit_bytes, st.miss_bytes, st.evictions,
+            cp->max_size, st.stored, allocated,
+            allocated > st.stored ? 1.0 - (double)st.stored / allocated : 0.0);
+
+    log_counts(&logged, &dropped);
+    fprintf(fp,
+            "# HELP proxy_access_log_lines_total Access log lines written.\n"
+            "# TYPE proxy_access_log_lines_total counter\n"
+            "proxy_access_log_lines_total %lu\n"
+            "# HELP proxy_access_log_dropped_total Access log lines dropped "
+            "because the writer fell behind.\n"
+            "# TYPE proxy_access_log_dropped_total counter\n"
+            "proxy_access_log_dropped_total %lu\n",
+            logged, dropped);
+
+    if ((pp = atomic_load(&pool)) == NULL) {
+        return;
+    }
+    pool_stats(pp, &ps);
+    fprintf(fp,
+            "# HELP proxy_pool_workers Worker threads serving connections.\n"
+            "# TYPE proxy_pool_workers gauge\n"
+            "proxy_pool_workers %d\n"
+            "# HELP proxy_pool_queue_depth Accepted connections waiting for "
+            "a worker.\n"
+            "# TYPE proxy_pool_queue_depth gauge\n"
+            "proxy_pool_queue_depth %zu\n"
+            "# HELP proxy_pool_queue_capacity Connections that can wait.\n"
+            "# TYPE proxy_pool_queue_capacity gauge\n"
+            "proxy_pool_queue_capacity %zu\n"
+            "# HELP proxy_pool_rejected_total Connections refused because "
+            "the queue was full.\n"
+            "# TYPE proxy_pool_rejected_total counter\n"
+            "proxy_pool_rejected_total %llu\n"
+            "# HELP proxy_pool_queue_wait_seconds Time connections waited "
+            "for a worker.\n"
+            "# TYPE proxy_pool_queue_wait_seconds summary\n"
+            "proxy_pool_queue_wait_seconds_sum %.9f\n"
+            "proxy_pool_queue_wait_seconds_count %llu\n"
+            "# HELP proxy_pool_queue_wait_max_seconds Longest wait for a "
+            "worker.\n"
+            "# TYPE proxy_pool_queue_wait_max_seconds gauge\n"
+            "proxy_pool_queue_wait_max_seconds %.9f\n",
+            ps.nworkers, ps.queued, ps.capacity, ps.rejected,
+            ps.wait_total / 1e9, ps.dispatched, ps.wait_max / 1e9);
+}
+
+/*
+ * write_histogram - Write the merged buckets of stage as a Prometheus
+ *     histogram, on a coarser scale of powers of two
+ */
+static void
+write_histogram(FILE *fp, int stage, unsigned long *merged,
+                unsigned long sum_ns)
+{
+    unsigned long cum = 0, bound;
+    size_t i = 0;
+    int e;
+
+    /* Fine buckets end right below each power of two, so these are exact */
+    for (e = PROM_MIN_EXP; e <= PROM_MAX_EXP; e++) {
+        bound = 1UL << e;
+        while (i < METRICS_BUCKETS && bucket_max(i) < bound) {
+            cum += merged[i++];
+        }
+        fprintf(fp,
+                "proxy_stage_duration_seconds_bucket{stage=\"%s\","
+                "le=\"%.9g\"} %lu\n",
+                stage_names[stage], bound / 1e9, cum);
+    }
+    while (i < METRICS_BUCKETS) {
+        cum += merged[i++];
+    }
+    fprintf(fp,
+            "proxy_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} "
+            "%lu\n"
+            "proxy_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n"
+            "proxy_stage_duration_seconds_count{stage=\"%s\"} %lu\n",
+            stage_names[stage], cum, stage_names[stage], sum_ns / 1e9,
+            stage_names[stage], cum);
+}
+
+/*
+ * write_quantiles - Write the quantiles of stage from its merged buckets,
+ *     each as the upper bound of the bucket holding it
+ */
+static void
+write_quantiles(FILE *fp, int stage, unsigned long *merged)
+{
+    unsigned long total = 0, cum = 0;
+    size_t i, q;
+
+    for (i = 0; i < METRICS_BUCKETS; i++) {
+        total += merged[i];
+    }
+    if (total == 0) {
+        return;
+    }
+    for (q = 0, i = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        while (i < METRICS_BUCKETS - 1 &&
+               cum + merged[i] < quantiles[q] * total) {
+            cum += merged[i++];
+        }
+        fprintf(fp,
+                "proxy_stage_duration_quantile_seconds{stage=\"%s\","
+                "quantile=\"%g\"} %.9f\n",
+                stage_names[stage], quantiles[q], bucket_max(i) / 1e9);
+    }
+}
+
+/*
+ * open_admin_listenfd - A listening socket on port of the loopback
+ *     interface only
+ */
+static int
+open_admin_listenfd(char *port)
+{
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    if (getaddrinfo("127.0.0.1", port, &hints, &listp) != 0) {
+        return -1;
+    }
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) <
+            0) {
+            continue;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0 &&
+            listen(listenfd, LISTENQ) == 0) {
+            break;
+        }
+        close(listenfd);
+        listenfd = -1;
+    }
+    freeaddrinfo(listp);
+    return listenfd;
+}
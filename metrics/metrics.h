@@ -0,0 +1,46 @@
+#ifndef METRICS_h
+#define METRICS_h
+
+#include "../cache/cache.h"
+#include "../pool/pool.h"
+#include <stdatomic.h>
+
+/* Stages of a request that are timed */
+#define STAGE_PARSE 0   /* Parsing the request head */
+#define STAGE_LOOKUP 1  /* Looking it up in the cache */
+#define STAGE_DNS 2     /* Resolving the origin */
+#define STAGE_CONNECT 3 /* Connecting to it */
+#define STAGE_TTFB 4    /* From the request sent to the response head in */
+#define STAGE_RELAY 5   /* From the response head to the end of the body */
+#define STAGE_TOTAL 6   /* From the request head in to the response sent */
+#define STAGES 7
+
+/*
+ * Log-linear buckets of nanoseconds, HDR style: values below
+ * 2 * METRICS_SUB are counted exactly, every power of two above that is
+ * split into METRICS_SUB buckets, up to 2^METRICS_MAX_EXP.
+ */
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_EXP 40 /* About 18 minutes */
+#define METRICS_BUCKETS                                                       \
+    (2 * METRICS_SUB + (METRICS_MAX_EXP - METRICS_SUB_BITS) * METRICS_SUB)
+
+/*
+ * One thread's histograms. Only the owner writes them, so no update
+ * needs a locked instruction; a scrape reads every thread's and adds
+ * them up.
+ */
+typedef struct metrics_thread {
+    atomic_ulong counts[STAGES][METRICS_BUCKETS];
+    atomic_ulong sum_ns[STAGES];
+    struct metrics_thread *next; /* Every thread that recorded something */
+} MetricsThread;
+
+unsigned long metrics_now(void);
+unsigned long metrics_stage(int stage, unsigned long start);
+void metrics_record(int stage, unsigned long ns);
+int metrics_serve(char *port, CachePtr cp);
+void metrics_pool(PoolPtr pp);
+
+#endif
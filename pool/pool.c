@@ -0,0 +1,209 @@
+/*
+ * pool.c - fixed-size pool of worker threads fed from a bounded,
+ *     lock-free multi-producer/multi-consumer queue of accepted sockets.
+ *
+ * The queue is a ring of cells, each stamped with a sequence number that
+ * says whether it is ready to be written (seq == pos) or read
+ * (seq == pos + 1) for the lap that pos is on. Producers and consumers
+ * claim positions with a CAS on tail/head and never take a lock. Idle
+ * workers sleep on a counting semaphore rather than spinning.
+ */
+#define _GNU_SOURCE
+#include "pool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void *worker(void *vargp);
+static int dequeue(PoolPtr pp, int *connfd, struct timespec *accepted);
+static unsigned long long elapsed_ns(struct timespec *from);
+
+/*
+ * pool_init - Start nworkers threads that call handler for each queued
+ *     connection. At most depth connections (rounded up to a power of
+ *     two, and to at least two) can wait in the queue.
+ */
+int
+pool_init(PoolPtr pp, int nworkers, size_t depth, void (*handler)(int connfd))
+{
+    size_t capacity = 2, i; /* One cell cannot tell "full" from "ready" */
+    pthread_t tid;
+
+    while (capacity < depth) {
+        capacity <<= 1;
+    }
+    if ((pp->cells = calloc(capacity, sizeof(PoolCell))) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < capacity; i++) {
+        atomic_init(&pp->cells[i].seq, i);
+    }
+    pp->mask = capacity - 1;
+    atomic_init(&pp->head, 0);
+    atomic_init(&pp->tail, 0);
+    sem_init(&pp->items, 0, 0);
+    pp->handler = handler;
+    pp->nworkers = nworkers;
+    atomic_init(&pp->dispatched, 0);
+    atomic_init(&pp->rejected, 0);
+    atomic_init(&pp->wait_total, 0);
+    atomic_init(&pp->wait_max, 0);
+
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&tid, NULL, worker, pp) != 0) {
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+/*
+ * pool_submit - Queue connfd for the next free worker. Returns -1 without
+ *     blocking if the queue is full; the caller still owns connfd then.
+ */
+int
+pool_submit(PoolPtr pp, int connfd)
+{
+    size_t pos = atomic_load_explicit(&pp->tail, memory_order_relaxed);
+    PoolCell *cell;
+    intptr_t diff;
+
+    while (1) {
+        cell = &pp->cells[pos & pp->mask];
+        diff = (intptr_t)atomic_load_explicit(&cell->seq,
+                                              memory_order_acquire) -
+               (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &pp->tail, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add(&pp->rejected, 1);
+            return -1; /* Full */
+        } else {
+            pos = atomic_load_explicit(&pp->tail, memory_order_relaxed);
+        }
+    }
+
+    cell->connfd = connfd;
+    clock_gettime(CLOCK_MONOTONIC, &cell->accepted);
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    sem_post(&pp->items);
+    return 0;
+}
+
+/*
+ * pool_stats - A snapshot of the pool's counters. The queue depth counts
+ *     positions claimed by producers, some of which may not be published
+ *     yet, and head is read first so it never comes out negative.
+ */
+void
+pool_stats(PoolPtr pp, PoolStats *st)
+{
+    size_t head = atomic_load(&pp->head);
+
+    st->queued = atomic_load(&pp->tail) - head;
+    st->capacity = pp->mask + 1;
+    st->nworkers = pp->nworkers;
+    st->dispatched = atomic_load(&pp->dispatched);
+    st->rejected = atomic_load(&pp->rejected);
+    st->wait_total = atomic_load(&pp->wait_total);
+    st->wait_max = atomic_load(&pp->wait_max);
+}
+
+/*
+ * pin_to_cpu - Bind the calling thread to one CPU, wrapping around the
+ *     online CPUs
+ */
+int
+pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *
+worker(void *vargp)
+{
+    PoolPtr pp = (PoolPtr)vargp;
+    unsigned long long wait, max;
+    struct timespec accepted;
+    int connfd;
+
+    while (1) {
+        while (sem_wait(&pp->items) < 0)
+            ; /* Interrupted by a signal */
+
+        /*
+         * The semaphore guarantees an item was published, but the cell at
+         * head may belong to a producer that has not finished yet.
+         */
+        while (dequeue(pp, &connfd, &accepted) < 0) {
+            sched_yield();
+        }
+
+        /* Record how long the connection sat in the queue */
+        wait = elapsed_ns(&accepted);
+        atomic_fetch_add(&pp->dispatched, 1);
+        atomic_fetch_add(&pp->wait_total, wait);
+        max = atomic_load(&pp->wait_max);
+        while (wait > max &&
+               !atomic_compare_exchange_weak(&pp->wait_max, &max, wait))
+            ;
+
+        pp->handler(connfd);
+    }
+    return NULL;
+}
+
+static int
+dequeue(PoolPtr pp, int *connfd, struct timespec *accepted)
+{
+    size_t pos = atomic_load_explicit(&pp->head, memory_order_relaxed);
+    PoolCell *cell;
+    intptr_t diff;
+
+    while (1) {
+        cell = &pp->cells[pos & pp->mask];
+        diff = (intptr_t)atomic_load_explicit(&cell->seq,
+                                              memory_order_acquire) -
+               (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &pp->head, &pos, pos + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return -1; /* Empty */
+        } else {
+            pos = atomic_load_explicit(&pp->head, memory_order_relaxed);
+        }
+    }
+
+    *connfd = cell->connfd;
+    *accepted = cell->accepted;
+    /* Hand the cell back to producers for the next lap */
+    atomic_store_explicit(&cell->seq, pos + pp->mask + 1,
+                          memory_order_release);
+    return 0;
+}
+
+static unsigned long long
+elapsed_ns(struct timespec *from)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) * 1000000000ULL +
+           (now.tv_nsec - from->tv_nsec);
+}
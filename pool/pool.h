@@ -0,0 +1,43 @@
+#ifndef POOL_h
+#define POOL_h
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+/* One queued connection and the time it was accepted */
+typedef struct pool_cell {
+    atomic_size_t seq;
+    int connfd;
+    struct timespec accepted;
+} PoolCell;
+
+/* Counters kept by the pool; all times are in nanoseconds */
+typedef struct pool_stats {
+    unsigned long long dispatched; /* Connections handed to a worker */
+    unsigned long long rejected;   /* Connections refused, queue full */
+    unsigned long long wait_total; /* Sum of the queue waits */
+    unsigned long long wait_max;   /* Longest queue wait seen */
+    size_t queued;                 /* Connections waiting right now */
+    size_t capacity;               /* Most that can wait */
+    int nworkers;
+} PoolStats;
+
+typedef struct pool {
+    PoolCell *cells; /* Bounded MPMC ring, capacity is a power of two */
+    size_t mask;
+    atomic_size_t head, tail;
+    sem_t items; /* Number of queued connections */
+    void (*handler)(int connfd);
+    int nworkers;
+    atomic_ullong dispatched, rejected, wait_total, wait_max;
+} Pool, *PoolPtr;
+
+int pool_init(PoolPtr pp, int nworkers, size_t depth,
+              void (*handler)(int connfd));
+int pool_submit(PoolPtr pp, int connfd);
+void pool_stats(PoolPtr pp, PoolStats *st);
+int pin_to_cpu(int cpu);
+
+#endif
@@ -1,261 +1,1505 @@
 #define _GNU_SOURCE
-#include "cache/cache.h"
-#include "rio/rio.h"
-#include "sock_interface/sock_interface.h"
-
-void *thread(void *vargp);
-void read_request(int connfd, char *request, char *headers);
-void append_version(char *request);
-void parse_request(int connfd, char *request, char *headers, char *host,
-                   char *port);
-void read_requesthdrs(Rio *rp, char *request_headers);
-void parse_uri(char *uri, char *hostname, char *port, char *request);
-int serve_client(int connfd, char *request, char *headers, char **content);
-void forward_response(int listenfd, char *headers, char *content,
-                      int content_length);
+#include "proxy.h"
+#include "event/event.h"
+#include "pool/pool.h"
+#include "cache/snapshot.h"
+
+#define DEFAULT_WORKERS 32
+#define DEFAULT_QUEUE_DEPTH 1024
+
+typedef struct acceptor {
+    int id;
+    int listenfd;
+    int pin;
+} Acceptor;
+
+static void serve_threaded(int *listenfds, int nacceptors, int pin,
+                           int nworkers, size_t depth);
+static void *accept_loop(void *vargp);
+static void reject_client(int connfd);
+static int serve_request(int connfd, Rio *rp);
+static int follow_flight(int connfd, FlightPtr fp, int client, char *headers,
+                         int *persist);
+static int splice_body(int connfd, int clientfd, ssize_t content_length);
+static int serve_miss(int connfd, HttpHead *req, char *head, char *key,
+                      int client, CacheObjectPtr stale, char *headers,
+                      int *result);
+static int field_iov(HttpHead *hp, char *head, unsigned int skip,
+                     struct iovec *iov);
+static int validator_iov(CacheObjectPtr op, struct iovec *iov);
+static void set_iov(struct iovec *iov, char *base, size_t len);
+static void set_transfer_timeout(int fd);
+static void start_snapshots(void);
+static void *snapshot_loop(void *vargp);
+static size_t parse_size(char *s);
+static void usage(char *prog);
 
 static Cache cache;
+static Pool pool;
+static UpstreamPool upstream;
+static DnsCache dns;
+static int client_timeout = CLIENT_IDLE_TIMEOUT;
+static char *snapshot_path;
+static int snapshot_interval = SNAPSHOT_INTERVAL;
+static sigset_t snapshot_signals; /* Handled by snapshot_loop() alone */
+
+/* Per-worker pipe for splicing bodies that will not be cached */
+static __thread int relay_pipe[2] = {-1, -1};
 
 int
 main(int argc, char *argv[])
 {
-    int listenfd, *connfdp = NULL;
-    struct sockaddr_storage clientaddr;
-    socklen_t clientlen;
-    pthread_t tid;
+    int *listenfds, opt, i, nloops = sysconf(_SC_NPROCESSORS_ONLN);
+    int nworkers = DEFAULT_WORKERS, reuseport = 0;
+    int max_idle = UPSTREAM_MAX_IDLE, idle_timeout = UPSTREAM_IDLE_TIMEOUT;
+    int min_ttl = DNS_MIN_TTL;
+    size_t depth = DEFAULT_QUEUE_DEPTH;
+    CacheOpts opts = {.nlines = CACHE_LINES,
+                      .nshards = CACHE_SHARDS,
+                      .max_size = MAX_CACHE_SIZE,
+                      .max_object = MAX_OBJECT_SIZE,
+                      .heuristic = CACHE_HEURISTIC,
+                      .engine = CACHE_ENGINE_MM,
+                      .slab_policy = SLAB_LEAST_USED,
+                      .policy = CACHE_POLICY_LRU,
+                      .disk_size = DISK_SIZE};
+    char *engine = "mm", *policy = "lru";
+    char *mode = "epoll", *admin_port = NULL, *access_log = NULL;
+    int sample = 1;
+    long restored;
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(0);
+    while ((opt = getopt(argc, argv, "m:n:w:q:rl:s:c:o:HLe:p:D:Z:S:T:a:A:R:k:t:i:d:f:")) !=
+           -1) {
+        switch (opt) {
+        case 'm':
+            mode = optarg;
+            break;
+        case 'n':
+            nloops = atoi(optarg);
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'r':
+            reuseport = 1;
+            break;
+        case 'l':
+            opts.nlines = atol(optarg);
+            break;
+        case 's':
+            opts.nshards = atol(optarg);
+            break;
+        case 'c':
+            opts.max_size = parse_size(optarg);
+            break;
+        case 'o':
+            opts.max_object = parse_size(optarg);
+            break;
+        case 'H':
+            opts.arena_flags |= MEM_HUGEPAGES;
+            break;
+        case 'L':
+            opts.arena_flags |= MEM_LOCKED;
+            break;
+        case 'e':
+            engine = optarg;
+            break;
+        case 'p':
+            policy = optarg;
+            break;
+        case 'D':
+            opts.disk_dir = optarg;
+            break;
+        case 'Z':
+            opts.disk_size = parse_size(optarg);
+            break;
+        case 'S':
+            snapshot_path = optarg;
+            break;
+        case 'T':
+            snapshot_interval = atoi(optarg);
+            break;
+        case 'a':
+            admin_port = optarg;
+            break;
+        case 'A':
+            access_log = optarg;
+            break;
+        case 'R':
+            sample = atoi(optarg);
+            break;
+        case 'k':
+            max_idle = atoi(optarg);
+            break;
+        case 't':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'i':
+            client_timeout = atoi(optarg);
+            break;
+        case 'd':
+            min_ttl = atoi(optarg);
+            break;
+        case 'f':
+            opts.heuristic = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || nloops < 1 || nworkers < 1 || depth < 1 ||
+        opts.nlines < 1 || opts.nshards < 1 || opts.max_size < 1 ||
+        opts.max_object < 1 || opts.disk_size < 1 || max_idle < 0 || idle_timeout < 1 ||
+        client_timeout < 1 || min_ttl < 0 || opts.heuristic < 0 ||
+        snapshot_interval < 0 || sample < 1 ||
+        (strcmp(mode, "epoll") && strcmp(mode, "thread"))) {
+        usage(argv[0]);
+    }
+    if (!strcmp(engine, "slab")) {
+        opts.engine = CACHE_ENGINE_SLAB;
+    } else if (!strcmp(engine, "slab-fifo")) {
+        opts.engine = CACHE_ENGINE_SLAB;
+        opts.slab_policy = SLAB_FIFO;
+    } else if (strcmp(engine, "mm")) {
+        usage(argv[0]);
+    }
+    if (!strcmp(policy, "tinylfu")) {
+        opts.policy = CACHE_POLICY_TINYLFU;
+    } else if (!strcmp(policy, "gdsf")) {
+        opts.policy = CACHE_POLICY_GDSF;
+    } else if (strcmp(policy, "lru")) {
+        usage(argv[0]);
     }
 
-    if ((listenfd = open_listenfd(argv[1])) < 0) {
-        fprintf(stderr, "%s: %s\n", "open_clientfd error", strerror(errno));
-        exit(-1);
+    /*
+     * Either one socket shared by every loop (or acceptor), or with -r one
+     * SO_REUSEPORT socket each so they never contend on the same queue.
+     */
+    listenfds = malloc(nloops * sizeof(int));
+    for (i = 0; i < nloops; i++) {
+        if (i > 0 && !reuseport) {
+            listenfds[i] = listenfds[0];
+            continue;
+        }
+        listenfds[i] = reuseport ? open_listenfd_reuseport(argv[optind])
+                                 : open_listenfd(argv[optind]);
+        if (listenfds[i] < 0) {
+            fprintf(stderr, "%s: %s\n", "open_listenfd error",
+                    strerror(errno));
+            exit(-1);
+        }
     }
 
     /* Ignore SIGPIPE signal if trying to write to a closed socket */
     signal(SIGPIPE, SIG_IGN);
-    cache_init(&cache);
 
-    while (1) {
-        clientlen = sizeof(struct sockaddr_storage);
-        connfdp = (int *)malloc(sizeof(int));
+    /*
+     * With a snapshot, SIGTERM and SIGINT are only taken by the thread
+     * that saves it, so they are blocked before any other thread starts.
+     */
+    sigemptyset(&snapshot_signals);
+    sigaddset(&snapshot_signals, SIGTERM);
+    sigaddset(&snapshot_signals, SIGINT);
+    if (snapshot_path) {
+        pthread_sigmask(SIG_BLOCK, &snapshot_signals, NULL);
+    }
 
-        if ((*connfdp = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
-            fprintf(stderr, "%s: %s\n", "accept error", strerror(errno));
-            continue;
+    if (cache_init(&cache, &opts) < 0) {
+        fprintf(stderr, "%s: %s\n", "cache_init error", strerror(errno));
+        exit(-1);
+    }
+    if (snapshot_path) {
+        if ((restored = snapshot_load(&cache, snapshot_path)) >= 0) {
+            printf("Restoring %ld objects from %s\n", restored,
+                   snapshot_path);
         }
+        start_snapshots();
+    }
+    if (admin_port && metrics_serve(admin_port, &cache) < 0) {
+        fprintf(stderr, "%s: %s\n", "metrics_serve error", strerror(errno));
+        exit(-1);
+    }
+    if (access_log && log_open(access_log, sample) < 0) {
+        fprintf(stderr, "%s: %s\n", "log_open error", strerror(errno));
+        exit(-1);
+    }
+
+    upstream_init(&upstream, max_idle, idle_timeout);
+    if (dns_init(&dns, min_ttl) < 0) {
+        fprintf(stderr, "%s: %s\n", "dns_init error", strerror(errno));
+        exit(-1);
+    }
 
-        pthread_create(&tid, NULL, thread, (void *)connfdp);
+    if (!strcmp(mode, "epoll")) {
+        event_run(listenfds, nloops, reuseport, client_timeout, &cache,
+                  &upstream, &dns);
+    } else {
+        serve_threaded(listenfds, reuseport ? nloops : 1, reuseport, nworkers,
+                       depth);
     }
 
     return 0;
 }
 
-void *
-thread(void *vargp)
+static void
+usage(char *prog)
 {
-    int connfd = *((int *)vargp), clientfd;
-    pthread_detach(pthread_self());
-    free(vargp);
+    fprintf(stderr,
+            "usage: %s [-m epoll|thread] [-n loops] [-w workers] "
+            "[-q depth] [-r] [-l lines] [-s shards] [-c size] [-o size] "
+            "[-H] [-L] [-e mm|slab|slab-fifo] [-p lru|tinylfu|gdsf] "
+            "[-D dir] [-Z size] [-S file] [-T secs] [-a port] [-k idle] "
+            "[-t secs] [-i secs] [-d secs] [-f secs] <port>\n",
+            prog);
+    fprintf(stderr, "  -m  epoll: one event loop per core (default)\n");
+    fprintf(stderr, "      thread: a pool of blocking worker threads\n");
+    fprintf(stderr, "  -n  number of event loops, or of acceptors with -r "
+                    "(default: online CPUs)\n");
+    fprintf(stderr, "  -w  number of worker threads (default: %d)\n",
+            DEFAULT_WORKERS);
+    fprintf(stderr, "  -q  accepted connections that may wait for a worker "
+                    "(default: %d)\n",
+            DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "  -r  one SO_REUSEPORT listener per loop or acceptor, "
+                    "each pinned to a CPU\n");
+    fprintf(stderr, "  -l  number of cache lines (default: %d)\n",
+            CACHE_LINES);
+    fprintf(stderr, "  -s  number of cache shards, each with its own lock "
+                    "(default: %d)\n",
+            CACHE_SHARDS);
+    fprintf(stderr, "  -c  cache capacity in bytes, K, M or G suffix allowed "
+                    "(default: %d)\n",
+            MAX_CACHE_SIZE);
+    fprintf(stderr, "  -o  largest body that is cached (default: %d)\n",
+            MAX_OBJECT_SIZE);
+    fprintf(stderr, "  -H  back the cache with huge pages\n");
+    fprintf(stderr, "  -L  lock the cache in memory\n");
+    fprintf(stderr, "  -e  mm: each object in its own heap block (default)\n");
+    fprintf(stderr, "      slab: objects appended to segments, the least "
+                    "used segment evicted whole\n");
+    fprintf(stderr, "      slab-fifo: the same, oldest segment evicted\n");
+    fprintf(stderr, "  -p  lru: evict the least recently used line (default)\n");
+    fprintf(stderr, "      tinylfu: only let a line in over one asked for "
+                    "more often lately\n");
+    fprintf(stderr, "      gdsf: evict the line with the fewest hits per "
+                    "byte\n");
+    fprintf(stderr, "  -D  directory for a disk tier behind the cache, for "
+                    "bigger bodies\n      and evicted ones (default: none)\n");
+    fprintf(stderr, "  -Z  disk tier size (default: %lu)\n", DISK_SIZE);
+    fprintf(stderr, "  -S  snapshot file the cache is loaded from at start "
+                    "and saved to\n      on SIGTERM or SIGINT (default: "
+                    "none)\n");
+    fprintf(stderr, "  -T  seconds between snapshots as well, 0 for only on "
+                    "exit (default: %d)\n",
+            SNAPSHOT_INTERVAL);
+    fprintf(stderr, "  -a  local port serving Prometheus metrics at /metrics "
+                    "(default: none)\n");
+    fprintf(stderr, "  -A  file the access log is appended to (default: "
+                    "none)\n");
+    fprintf(stderr, "  -R  log one request in this many (default: 1)\n");
+    fprintf(stderr, "  -k  idle connections kept per origin, 0 to disable "
+                    "(default: %d)\n",
+            UPSTREAM_MAX_IDLE);
+    fprintf(stderr, "  -t  seconds an idle origin connection is kept "
+                    "(default: %d)\n",
+            UPSTREAM_IDLE_TIMEOUT);
+    fprintf(stderr, "  -i  seconds a client connection may idle between "
+                    "requests (default: %d)\n",
+            CLIENT_IDLE_TIMEOUT);
+    fprintf(stderr, "  -d  least seconds a resolved origin address is cached "
+                    "(default: %d)\n",
+            DNS_MIN_TTL);
+    fprintf(stderr, "  -f  most seconds a response without explicit freshness "
+                    "is served\n      without revalidating (default: %d)\n",
+            CACHE_HEURISTIC);
+    exit(0);
+}
 
-    char buf[MAXLINE];
-    char request[MAXLINE], headers[MAXLINE], host[MAXLINE], port[MAXLINE];
-    char *content, *respone_hdrs;
-    ssize_t content_length;
+/*
+ * start_snapshots - Start the thread saving the cache to snapshot_path
+ *     every snapshot_interval seconds, and on the snapshot_signals every
+ *     other thread blocks, before exiting
+ */
+static void
+start_snapshots(void)
+{
+    pthread_t tid;
 
-    read_request(connfd, request, headers);
-    append_version(request);
+    if (pthread_create(&tid, NULL, snapshot_loop, NULL) != 0) {
+        fprintf(stderr, "%s: %s\n", "snapshot thread error", strerror(errno));
+        exit(-1);
+    }
+    pthread_detach(tid);
+}
 
-    content_length = cache_read(&cache, request, &respone_hdrs, &content);
-    if (content_length < 0) {
-        strcpy(buf, request);
-        parse_request(connfd, request, headers, host, port);
+static void *
+snapshot_loop(void *vargp)
+{
+    struct timespec interval = {.tv_sec = snapshot_interval};
+    long saved;
+    int sig;
 
-        if ((clientfd = open_clientfd(host, port)) < 0) {
-            close(connfd);
-            return NULL;
+    for (;;) {
+        sig = snapshot_interval > 0
+                  ? sigtimedwait(&snapshot_signals, NULL, &interval)
+                  : sigwaitinfo(&snapshot_signals, NULL);
+        if (sig < 0 && errno == EINTR) {
+            continue;
+        }
+        if ((saved = snapshot_save(&cache, snapshot_path)) < 0) {
+            fprintf(stderr, "%s: %s\n", "snapshot_save error",
+                    strerror(errno));
+        } else {
+            printf("Saved %ld objects to %s\n", saved, snapshot_path);
+        }
+        if (sig > 0) {
+            fflush(stdout);
+            exit(0);
         }
-        content_length = serve_client(clientfd, request, headers, &content);
-        forward_response(connfd, headers, content, content_length);
-        cache_write(&cache, buf, headers, content, content_length);
-        printf("Using: %zu\r\nRemaining: %zu\r\n", cache_size(&cache),
-               MAX_CACHE_SIZE - cache_size(&cache));
-        free(content);
-    } else {
-        forward_response(connfd, respone_hdrs, content, content_length);
     }
+    return NULL;
+}
 
-    close(connfd);
+/*
+ * parse_size - Parse a byte count with an optional K, M or G suffix.
+ *     Returns 0 if s is not one.
+ */
+static size_t
+parse_size(char *s)
+{
+    char *end;
+    size_t n = strtoull(s, &end, 10);
+
+    switch (*end) {
+    case 'G':
+    case 'g':
+        n <<= 10;
+        /* Fall through */
+    case 'M':
+    case 'm':
+        n <<= 10;
+        /* Fall through */
+    case 'K':
+    case 'k':
+        n <<= 10;
+        end++;
+    }
+    return (end == s || *end) ? 0 : n;
+}
+
+/*
+ * serve_threaded - Start the worker pool, then accept on every listener,
+ *     each from its own thread. The calling thread runs the first one.
+ */
+static void
+serve_threaded(int *listenfds, int nacceptors, int pin, int nworkers,
+               size_t depth)
+{
+    Acceptor *acceptors;
+    pthread_t tid;
+    int i;
+
+    if (pool_init(&pool, nworkers, depth, handle_client) < 0) {
+        fprintf(stderr, "%s: %s\n", "pool_init error", strerror(errno));
+        exit(-1);
+    }
+    metrics_pool(&pool);
+
+    acceptors = malloc(nacceptors * sizeof(Acceptor));
+    for (i = 0; i < nacceptors; i++) {
+        acceptors[i].id = i;
+        acceptors[i].listenfd = listenfds[i];
+        acceptors[i].pin = pin;
+    }
+    for (i = 1; i < nacceptors; i++) {
+        pthread_create(&tid, NULL, accept_loop, &acceptors[i]);
+    }
+    accept_loop(&acceptors[0]);
+}
+
+/*
+ * accept_loop - Accept connections forever and queue them for the worker
+ *     pool. When the queue is full the client gets a 503 right away
+ *     instead of waiting behind the backlog.
+ */
+static void *
+accept_loop(void *vargp)
+{
+    Acceptor *ap = (Acceptor *)vargp;
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    int connfd;
+
+    if (ap->pin) {
+        pin_to_cpu(ap->id);
+    }
+
+    while (1) {
+        clientlen = sizeof(struct sockaddr_storage);
+        if ((connfd = accept(ap->listenfd, (SA *)&clientaddr, &clientlen)) <
+            0) {
+            fprintf(stderr, "%s: %s\n", "accept error", strerror(errno));
+            continue;
+        }
+
+        if (pool_submit(&pool, connfd) < 0) {
+            reject_client(connfd);
+        }
+    }
     return NULL;
 }
 
+/*
+ * handle_client - Serve requests on connfd in the order they arrive until
+ *     the client or a response ends the connection, or the client idles
+ *     for client_timeout seconds, or takes none of a response for
+ *     TRANSFER_TIMEOUT, then close it
+ */
 void
-read_request(int connfd, char *request, char *headers)
+handle_client(int connfd)
 {
+    struct timeval timeout = {.tv_sec = client_timeout};
+    struct timeval transfer = {.tv_sec = TRANSFER_TIMEOUT};
     Rio rio;
 
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &transfer, sizeof(transfer));
+    /* One buffer for the whole connection keeps pipelined requests */
     rio_readinitb(&rio, connfd);
-    rio_readlineb(&rio, request, MAXLINE);
-    read_requesthdrs(&rio, headers);
+    while (serve_request(connfd, &rio))
+        ;
+    close(connfd);
 }
 
-void
-read_requesthdrs(Rio *rp, char *request_headers)
+/*
+ * serve_request - Read the next request from rp and answer it. Returns 1
+ *     if the connection can carry another one.
+ */
+static int
+serve_request(int connfd, Rio *rp)
 {
-    char buf[MAXLINE];
+    int client, persist, result;
+    char key[MAXLINE], headers[MAXLINE], *head;
+    HttpHead req;
+    CacheObjectPtr op;
+    time_t expires;
+    unsigned long start, lookup, end;
+
+    /* The head is only read from rp's buffer, which holds it until we return */
+    if ((head = read_head(rp, &req, 1)) == NULL) {
+        return 0;
+    }
+    start = metrics_now();
+    client = client_persistence(&req, head);
+    if (cache_key(&req, head, key, sizeof(key)) < 0) {
+        return 0;
+    }
 
-    rio_readlineb(rp, buf, MAXLINE);
-    sprintf(request_headers, "%s", buf);
-    while (strcmp(buf, "\r\n")) {
-        rio_readlineb(rp, buf, MAXLINE);
-        sprintf(request_headers, "%s%s", request_headers, buf);
+    lookup = metrics_now();
+    op = cache_read(&cache, key, &expires);
+    metrics_stage(STAGE_LOOKUP, lookup);
+    if (op && cache_fresh(&req, head, expires)) {
+        persist = forward_response(connfd, op, client);
+        result = LOG_HIT;
+    } else {
+        /* A stale copy is kept to be revalidated rather than fetched again */
+        persist = serve_miss(connfd, &req, head, key, client, op, headers,
+                             &result);
+    }
+
+    end = metrics_stage(STAGE_TOTAL, start);
+    if (result == LOG_MISS || result == LOG_COALESCED) {
+        log_access(&req, head, result, response_status(headers),
+                   headers[0] ? response_length(headers) : -1, end - start);
+    } else {
+        log_access(&req, head, result, response_status(OBJECT_HDRS(op)),
+                   op->content_length, end - start);
+    }
+    if (op) {
+        cache_release(&cache, op);
     }
+    return persist;
 }
 
-void
-append_version(char *request)
+/*
+ * serve_miss - Fetch the response to the request in head from the origin,
+ *     or revalidate the stale copy of it, and cache what comes back. The
+ *     response head sent, if it is not the stale copy's, is left in
+ *     headers, and how the request was served in *result (LOG_*).
+ *     Returns whether the client connection persists.
+ */
+static int
+serve_miss(int connfd, HttpHead *req, char *head, char *key, int client,
+           CacheObjectPtr stale, char *headers, int *result)
 {
-    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    sscanf(request, "%s %s %s", method, uri, version);
+    int clientfd, reused, reusable, rc, persist, leader, iovcnt, shared;
+    ssize_t content_length;
+    char host[MAXLINE], port[MAXLINE], path[MAXLINE];
+    struct iovec request[REQUEST_IOV];
+    CacheFill fill;
+    FlightPtr fp = NULL;
+    time_t expires;
+
+    headers[0] = '\0';
+    *result = LOG_MISS;
+    if (parse_request(req, head, host, port, path) < 0) {
+        return 0;
+    }
+    iovcnt = request_iov(req, head, path, host, stale, request);
+    print_request(request, iovcnt);
+
+    /* Concurrent misses on the same request share one fetch */
+    if ((shared = request_shareable(req, head)) &&
+        (fp = flight_join(&cache.flights, key, cache.max_object, NULL,
+                          &leader)) &&
+        !leader) {
+        rc = follow_flight(connfd, fp, client, headers, &persist);
+        flight_leave(fp, NULL);
+        if (rc <= 0) {
+            *result = LOG_COALESCED;
+            return rc == 0 && persist;
+        }
+        fp = NULL; /* The leader got no response, try on our own */
+    }
 
-    if (strcasecmp(version, "HTTP/1.0")) {
-        sprintf(request, "%s %s %s\r\n", method, uri, "HTTP/1.0");
+    reused = (clientfd = upstream_get(&upstream, host, port)) >= 0;
+    if (!reused && (clientfd = dns_connect(&dns, host, port)) < 0) {
+        if (fp) {
+            flight_finish(&cache.flights, fp, 0);
+        }
+        /* Better stale than nothing while the origin is unreachable */
+        *result = stale ? LOG_STALE : LOG_MISS;
+        return stale ? forward_response(connfd, stale, client) : 0;
+    }
+    if (!reused) {
+        set_transfer_timeout(clientfd); /* Pooled ones keep theirs */
+    }
+    persist = client;
+    rc = serve_client(connfd, clientfd, request, iovcnt, headers, stale,
+                      shared, &fill, fp, &persist, &reusable);
+    if (rc == 1 && reused) {
+        /* The pooled connection went stale, GET is safe to resend */
+        close(clientfd);
+        cache_fill_free(&fill);
+        if ((clientfd = dns_connect(&dns, host, port)) < 0) {
+            if (fp) {
+                flight_finish(&cache.flights, fp, 0);
+            }
+            *result = stale ? LOG_STALE : LOG_MISS;
+            return stale ? forward_response(connfd, stale, client) : 0;
+        }
+        set_transfer_timeout(clientfd);
+        persist = client;
+        rc = serve_client(connfd, clientfd, request, iovcnt, headers, stale,
+                          shared, &fill, fp, &persist, &reusable);
+    }
+    if (rc == 0 && stale && headers[0] == '\0') {
+        *result = LOG_REVALIDATED; /* The copy was sent, see serve_client() */
+    }
+    if (rc == 0 && !fill.abandoned &&
+        (expires = response_expiry(headers, cache.heuristic, shared)) >= 0) {
+        /* Cached copies are self-delimiting whatever the origin sent */
+        content_length = response_length(headers);
+        if (content_length >= 0 ||
+            frame_headers(headers, MAXLINE, fill.len) == 0) {
+            cache_fill_commit(&cache, &fill, key, headers, expires);
+            print_cache_usage(&cache);
+        }
+    }
+    /* Only now, so that requests arriving from here on hit the cache */
+    if (fp) {
+        flight_finish(&cache.flights, fp, rc == 0);
+    }
+    if (rc == 0 && reusable) {
+        upstream_put(&upstream, host, port, clientfd);
+    } else {
+        close(clientfd);
+    }
+    cache_fill_free(&fill);
+    return rc == 0 && persist;
+}
+
+/*
+ * follow_flight - Send the response another request is fetching, as it
+ *     arrives, its head through headers. Returns 0 once it is sent,
+ *     setting *persist like serve_client(); 1 if the leader got no
+ *     response it could share, so the request is still to be served; -1
+ *     if either side failed part way.
+ */
+static int
+follow_flight(int connfd, FlightPtr fp, int client, char *headers,
+              int *persist)
+{
+    char buf[MAXBUF];
+    ssize_t content_length;
+    size_t off = 0, n;
+    int state;
+    struct iovec iov[2];
+
+    flight_wait(fp, 0);
+    if (flight_response(fp, headers, MAXLINE, &content_length,
+                        &state) < 0) {
+        return 1;
+    }
+
+    *persist = response_persistent(client, content_length);
+    iov[0].iov_base = headers;
+    iov[0].iov_len = strlen(headers) - 2; /* Without the blank line */
+    iov[1].iov_base = connection_header(*persist);
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    if (rio_writevn(connfd, iov, 2) < 0) {
+        return -1;
+    }
+
+    while (1) {
+        if ((n = flight_read(fp, off, buf, sizeof(buf), &state)) > 0) {
+            if (rio_writen(connfd, buf, n) < 0) {
+                return -1;
+            }
+            off += n;
+        } else if (state == FLIGHT_DONE) {
+            return 0;
+        } else if (state == FLIGHT_FAILED) {
+            return -1;
+        } else {
+            flight_wait(fp, off);
+        }
     }
 }
 
+/*
+ * reject_client - Answer 503 and close connfd without blocking the accept
+ *     loop. Whatever part of the request already arrived is drained
+ *     first, so the close does not turn into a reset that would discard
+ *     the response before the client reads it.
+ */
+static void
+reject_client(int connfd)
+{
+    char buf[MAXBUF];
+
+    while (recv(connfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    client_error(connfd, "503 Service Unavailable",
+                 "The proxy is overloaded, try again later.");
+    shutdown(connfd, SHUT_WR);
+    while (recv(connfd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    close(connfd);
+}
+
+/*
+ * client_error - Send a minimal error response to the client
+ */
 void
-parse_request(int connfd, char *request, char *headers, char *host, char *port)
+client_error(int connfd, char *status, char *msg)
 {
-    char path[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char buf[MAXLINE] = "";
-    char *ptr;
+    char buf[MAXLINE];
+    int len;
 
-    sscanf(request, "%s %s %s", method, uri, version);
+    len = snprintf(buf, sizeof(buf),
+                   "HTTP/1.0 %s\r\n"
+                   "Content-Type: text/plain\r\n"
+                   "Content-Length: %zu\r\n"
+                   "Connection: close\r\n\r\n"
+                   "%s\n",
+                   status, strlen(msg) + 1, msg);
+    rio_writen(connfd, buf, len);
+}
 
-    if (strcasecmp(method, "GET")) {
-        fprintf(stderr, "method %s not implemented\n", method);
-        *host = '\0';
-        *port = '\0';
-        return;
+/*
+ * read_head - Parse the next head from rp in place, in its buffer, and
+ *     consume it. The head stays valid until the next read from rp. If
+ *     timed is set, the parsing counts as STAGE_PARSE. Returns it, or
+ *     NULL on EOF, error, or a bad or oversized head.
+ */
+char *
+read_head(Rio *rp, HttpHead *hp, int timed)
+{
+    char *head;
+    unsigned long start, parse_ns = 0;
+    int rc;
+
+    http_init(hp);
+    while (1) {
+        start = timed ? metrics_now() : 0;
+        rc = http_parse(hp, rp->rio_bufptr, rp->rio_cnt > 0 ? rp->rio_cnt : 0);
+        parse_ns += timed ? metrics_now() - start : 0;
+        if (rc != 0) {
+            break;
+        }
+        if (rio_fillb(rp) <= 0) {
+            return NULL;
+        }
     }
+    if (timed && rc > 0) {
+        metrics_record(STAGE_PARSE, parse_ns);
+    }
+    if (rc < 0) {
+        return NULL;
+    }
+    head = rp->rio_bufptr;
+    rio_skipb(rp, hp->len);
+    return head;
+}
 
-    parse_uri(uri, host, port, path);
-    sprintf(request, "%s %s %s\r\n", method, path, version);
+/*
+ * client_persistence - What the client allows after this request: HTTP/1.1
+ *     keeps the connection unless it says "close", HTTP/1.0 only if it
+ *     asks for keep-alive.
+ */
+int
+client_persistence(HttpHead *hp, char *head)
+{
+    if (hp->minor == 1) {
+        return http_has_token(hp, head, HDR_CONNECTION, "close") ||
+                       http_has_token(hp, head, HDR_PROXY_CONNECTION,
+                                      "close")
+                   ? CLIENT_CLOSE
+                   : CLIENT_HTTP11;
+    }
+    if (hp->minor == 0) {
+        return http_has_token(hp, head, HDR_CONNECTION, "keep-alive") ||
+                       http_has_token(hp, head, HDR_PROXY_CONNECTION,
+                                      "keep-alive")
+                   ? CLIENT_KEEPALIVE
+                   : CLIENT_CLOSE;
+    }
+    return CLIENT_CLOSE;
+}
+
+/*
+ * cache_key - The request line the response is cached under, with the
+ *     version always HTTP/1.0. Returns -1 if it does not fit in size.
+ */
+int
+cache_key(HttpHead *hp, char *head, char *key, size_t size)
+{
+    int n;
+
+    n = snprintf(key, size, "%.*s %.*s HTTP/1.0\r\n", (int)hp->start[0].len,
+                 head + hp->start[0].off, (int)hp->start[1].len,
+                 head + hp->start[1].off);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
 
-    /* Build request headers */
-    sprintf(buf, "Proxy-Connection: close\r\n");
-    if ((ptr = strcasestr(headers, "connection: "))) {
-        sprintf(buf, "%sConnection: close\r\n", buf);
+/*
+ * request_shareable - Whether a response to the request in head may go to
+ *     other requests for the same key: not if it carries credentials, the
+ *     response may be for this client alone unless it says otherwise, see
+ *     response_expiry()
+ */
+int
+request_shareable(HttpHead *hp, char *head)
+{
+    return hp->known[HDR_AUTHORIZATION] < 0 && hp->known[HDR_COOKIE] < 0;
+}
+
+/*
+ * parse_request - Find where a GET request goes. Returns -1 for other
+ *     methods and targets that are not absolute http:// URIs.
+ */
+int
+parse_request(HttpHead *hp, char *head, char *host, char *port, char *path)
+{
+    *host = '\0';
+    if (hp->start[0].len != 3 || strncasecmp(head, "GET", 3)) {
+        fprintf(stderr, "method %.*s not implemented\n",
+                (int)hp->start[0].len, head);
+        return -1;
     }
-    if (!(ptr = strcasestr(headers, "host: "))) {
-        sprintf(buf, "%sHost: %s\r\n", buf, host);
+    /* The target is shorter than the head, which fits in MAXLINE */
+    if (parse_uri(head + hp->start[1].off, hp->start[1].len, host, port,
+                  path) < 0) {
+        return -1;
     }
-    ptr = strcasestr(headers, "user-agent:");
-    if (!ptr) {
-        sprintf(buf, "%sUser-Agent: %s", buf,
-                "Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
-                "Firefox/10.0.3\r\n");
+    return *host ? 0 : -1;
+}
+
+/*
+ * request_iov - Point iov, which has room for REQUEST_IOV entries, at the
+ *     request to send upstream: an HTTP/1.1 request line for path, so the
+ *     connection can be pooled, the proxy's own headers, then the client's
+ *     less its hop-by-hop ones, straight from head. The client's own
+ *     conditions are dropped, the response is for the cache; revalidating
+ *     a stale copy adds the conditions for that instead. Returns the
+ *     count.
+ */
+int
+request_iov(HttpHead *hp, char *head, char *path, char *host,
+            CacheObjectPtr stale, struct iovec *iov)
+{
+    static char user_agent[] =
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) "
+        "Gecko/20120305 Firefox/10.0.3\r\n";
+    int n = 0;
+
+    set_iov(&iov[n++], head + hp->start[0].off, hp->start[0].len);
+    set_iov(&iov[n++], " ", 1);
+    set_iov(&iov[n++], path, strlen(path));
+    set_iov(&iov[n++], " HTTP/1.1\r\nConnection: keep-alive\r\n",
+            strlen(" HTTP/1.1\r\nConnection: keep-alive\r\n"));
+    if (hp->known[HDR_HOST] < 0) {
+        set_iov(&iov[n++], "Host: ", strlen("Host: "));
+        set_iov(&iov[n++], host, strlen(host));
+        set_iov(&iov[n++], "\r\n", 2);
     }
-    /* Concatenate client headers with proxy headers */
-    strcat(buf, headers);
-    strcpy(headers, buf);
+    if (hp->known[HDR_USER_AGENT] < 0) {
+        set_iov(&iov[n++], user_agent, strlen(user_agent));
+    }
+    n += field_iov(hp, head,
+                   HOP_FIELDS | 1u << HDR_IF_NONE_MATCH |
+                       1u << HDR_IF_MODIFIED_SINCE,
+                   &iov[n]);
+    if (stale) {
+        n += validator_iov(stale, &iov[n]);
+    }
+    set_iov(&iov[n++], "\r\n", 2);
+    return n;
+}
+
+#ifdef DEBUG
+/*
+ * print_request - Dump a request put together by request_iov()
+ */
+void
+print_request(struct iovec *iov, int iovcnt)
+{
+    int i;
 
     printf("Request headers:\r\n");
-    printf("%s", request);
-    printf("%s", headers);
+    for (i = 0; i < iovcnt; i++) {
+        fwrite(iov[i].iov_base, 1, iov[i].iov_len, stdout);
+    }
 }
 
+/*
+ * print_response - Dump the response headers copy_head() kept
+ */
 void
-parse_uri(char *uri, char *hostname, char *port, char *path)
+print_response(char *headers)
+{
+    printf("Response headers:\r\n");
+    printf("%s", headers);
+}
+#endif
+
+/*
+ * copy_head - Copy a response head into buf without its hop-by-hop
+ *     headers, which only describe the connection it came on. Returns its
+ *     length, or -1 if it does not fit in size bytes with a terminating
+ *     NUL.
+ */
+ssize_t
+copy_head(HttpHead *hp, char *head, char *buf, size_t size)
 {
-    char *ptr;
+    struct iovec iov[HTTP_MAX_FIELDS + 2];
+    size_t len = 0;
+    int i, n = 0;
 
-    ptr = strstr(uri, "http://");
-    if (ptr) {
-        /* remove http:// from uri */
-        strcpy(uri, (ptr + strlen("http://")));
-    } else {
-        *hostname = '\0';
-        *path = '\0';
-        return;
+    set_iov(&iov[n++], head, hp->line_end);
+    n += field_iov(hp, head, HOP_FIELDS, &iov[n]);
+    set_iov(&iov[n++], "\r\n", 2);
+    for (i = 0; i < n; i++) {
+        if (len + iov[i].iov_len >= size) {
+            return -1;
+        }
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
     }
+    buf[len] = '\0';
+    return len;
+}
 
-    if ((ptr = index(uri, ':'))) {
-        *ptr = '\0';
-        strcpy(hostname, uri);
-        ptr++;
-        uri = ptr;
+/*
+ * field_iov - Point iov at the header fields of head other than the
+ *     known ones in skip, a mask of HDR_* bits, one entry per run of
+ *     adjacent fields kept. Returns the count, at most HTTP_MAX_FIELDS.
+ */
+static int
+field_iov(HttpHead *hp, char *head, unsigned int skip, struct iovec *iov)
+{
+    HttpField *f;
+    unsigned int last = 0;
+    int i, n = 0;
 
-        if ((ptr = index(uri, '/'))) {
-            strncpy(port, uri, (int)(ptr - uri));
-            *(port + (ptr - uri)) = '\0';
+    for (i = 0; i < hp->nfields; i++) {
+        f = &hp->fields[i];
+        if (f->known >= 0 && (skip & 1u << f->known)) {
+            continue;
+        }
+        if (n > 0 && last == f->name.off) {
+            iov[n - 1].iov_len += f->end - f->name.off;
         } else {
-            *hostname = '\0';
-            *path = '\0';
-            return;
+            set_iov(&iov[n++], head + f->name.off, f->end - f->name.off);
         }
+        last = f->end;
+    }
+    return n;
+}
+
+/*
+ * validator_iov - Point iov at the conditions asking the origin whether
+ *     the cached op is still current, from its ETag and Last-Modified.
+ *     Returns the count, at most 6.
+ */
+static int
+validator_iov(CacheObjectPtr op, struct iovec *iov)
+{
+    HttpHead h;
+    HttpField *f;
+    int n = 0;
+
+    http_init(&h);
+    if (http_parse(&h, OBJECT_HDRS(op), op->hdr_len) != 1) {
+        return 0;
+    }
+    if (h.known[HDR_ETAG] >= 0) {
+        f = &h.fields[h.known[HDR_ETAG]];
+        set_iov(&iov[n++], "If-None-Match: ", strlen("If-None-Match: "));
+        set_iov(&iov[n++], OBJECT_HDRS(op) + f->value.off, f->value.len);
+        set_iov(&iov[n++], "\r\n", 2);
+    }
+    if (h.known[HDR_LAST_MODIFIED] >= 0) {
+        f = &h.fields[h.known[HDR_LAST_MODIFIED]];
+        set_iov(&iov[n++], "If-Modified-Since: ",
+                strlen("If-Modified-Since: "));
+        set_iov(&iov[n++], OBJECT_HDRS(op) + f->value.off, f->value.len);
+        set_iov(&iov[n++], "\r\n", 2);
+    }
+    return n;
+}
+
+static void
+set_iov(struct iovec *iov, char *base, size_t len)
+{
+    iov->iov_base = base;
+    iov->iov_len = len;
+}
+
+/*
+ * set_transfer_timeout - Fail reads and writes on the origin connection
+ *     fd that make no progress for TRANSFER_TIMEOUT, as the event loops
+ *     do, rather than hold the worker for as long as the origin stalls
+ */
+static void
+set_transfer_timeout(int fd)
+{
+    struct timeval timeout = {.tv_sec = TRANSFER_TIMEOUT};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/*
+ * parse_uri - Split an absolute http:// URI of len bytes, which need not
+ *     be NUL terminated, into host, port and path, each with room for
+ *     len + 1 bytes. Returns -1 if it is not one.
+ */
+int
+parse_uri(const char *uri, size_t len, char *hostname, char *port,
+          char *path)
+{
+    const char *host, *slash, *colon;
+    size_t plen = strlen("http://");
 
+    *hostname = '\0';
+    *path = '\0';
+    if (len < plen || strncasecmp(uri, "http://", plen)) {
+        return -1;
+    }
+    host = uri + plen;
+    len -= plen;
+
+    /* The authority runs to the first slash, the port follows a colon */
+    if ((slash = scan_char(host, len, '/')) == NULL) {
+        return -1;
+    }
+    if ((colon = scan_char(host, slash - host, ':'))) {
+        memcpy(port, colon + 1, slash - colon - 1);
+        port[slash - colon - 1] = '\0';
     } else {
         strcpy(port, "80");
-        if ((ptr = index(uri, '/'))) {
-            strncpy(hostname, uri, (int)(ptr - uri));
-            *(hostname + (ptr - uri)) = '\0';
-        } else {
-            *hostname = '\0';
-            *path = '\0';
-            return;
-        }
+        colon = slash;
     }
-
-    strcpy(path, ptr); /* Copy path */
+    memcpy(hostname, host, colon - host);
+    hostname[colon - host] = '\0';
+    memcpy(path, slash, len - (slash - host));
+    path[len - (slash - host)] = '\0';
+    return 0;
 }
 
+/*
+ * serve_client - Send the request in iov upstream on clientfd and relay
+ *     the response to connfd as it arrives, MAXBUF bytes at a time. The
+ *     response headers are left in headers, MAXLINE bytes, without their
+ *     hop-by-hop ones, and the body is tee'd into fill for the cache.
+ *     *persist comes in as what the client allows and goes out as whether
+ *     connfd stays open after this response. shared tells whether the
+ *     request came without credentials; the body is only cached, and fed
+ *     to the requests following a leading fp, if response_expiry() then
+ *     allows it. Returns 0 once the whole response is
+ *     relayed, setting *reusable if clientfd can serve another request; 1
+ *     if the origin closed without responding at all; -1 if either side
+ *     failed part way.
+ */
 int
-serve_client(int clientfd, char *request, char *headers, char **content)
+serve_client(int connfd, int clientfd, struct iovec *request, int iovcnt,
+             char *headers, CacheObjectPtr stale, int shared,
+             CacheFillPtr fill, FlightPtr fp, int *persist, int *reusable)
 {
     Rio rio;
-    char buf[MAXLINE], *ptr;
-    int content_length = 0;
+    char buf[MAXBUF], *head;
+    ssize_t content_length, n, body;
+    size_t want;
+    int rc, keepalive, storable, nosplice = 0;
+    ChunkScan chunks;
+    HttpHead resp;
+    struct iovec iov[REQUEST_IOV];
+    unsigned long sent;
+
+    *reusable = 0;
+    cache_fill_init(&cache, fill, 0); /* Nothing to free before the body */
 
     rio_readinitb(&rio, clientfd);
-    /* Send request and headers to server */
-    rio_writen(clientfd, request, strlen(request));
-    rio_writen(clientfd, headers, strlen(headers));
+    /* A copy, the request may have to be sent again */
+    memcpy(iov, request, iovcnt * sizeof(struct iovec));
+    sent = metrics_now(); /* The origin may answer before writev returns */
+    if (rio_writevn(clientfd, iov, iovcnt) < 0) {
+        return 1;
+    }
+
+    /* Read the response head, and take what we need before the body */
+    errno = 0;
+    if ((head = read_head(&rio, &resp, 0)) == NULL) {
+        return rio.rio_cnt <= 0 && (errno == 0 || errno == ECONNRESET) ? 1
+                                                                         : -1;
+    }
+    sent = metrics_stage(STAGE_TTFB, sent); /* The body starts from here */
+    /* The origin's Connection header is about clientfd, not connfd */
+    keepalive = upstream_keepalive(&resp, head);
+    if ((content_length = http_body_length(&resp, head)) == BODY_MALFORMED) {
+        return -1;
+    }
+    if (stale && resp.status == 304) {
+        /* Still current: refresh our copy and send that instead */
+        cache_refresh(&cache, stale,
+                      refreshed_expiry(&resp, head, stale, cache.heuristic));
+        fill->abandoned = 1; /* Nothing new to cache */
+        if (fp) {
+            publish_object(&cache, fp, stale);
+        }
+        *reusable = rio.rio_cnt <= 0 && keepalive;
+        *persist = forward_response(connfd, stale, *persist);
+        return 0;
+    }
+    if (copy_head(&resp, head, headers, MAXLINE) < 0) {
+        return -1;
+    }
+    *persist = response_persistent(*persist, content_length);
 
-    /* Read response headers from server */
-    rio_readlineb(&rio, buf, MAXLINE);
-    sprintf(headers, "%s", buf);
-    while (strcmp(buf, "\r\n")) {
-        rio_readlineb(&rio, buf, MAXLINE);
-        sprintf(headers, "%s%s", headers, buf);
+    print_response(headers);
+
+    iov[0].iov_base = headers;
+    iov[0].iov_len = strlen(headers) - 2; /* Without the blank line */
+    iov[1].iov_base = connection_header(*persist);
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    if (rio_writevn(connfd, iov, 2) < 0) {
+        return -1;
+    }
+    /* Followers only get what a shared cache could have given them */
+    storable = response_expiry(headers, cache.heuristic, shared) >= 0;
+    if (fp && !storable) {
+        flight_fail(&cache.flights, fp); /* They fetch on their own */
+        fp = NULL;
+    } else if (fp &&
+               !flight_headers(&cache.flights, fp, headers, content_length)) {
+        fp = NULL; /* Too big to share */
     }
 
-    printf("Response headers:\r\n");
-    printf("%s", headers);
+    /*
+     * Relay the body: content_length bytes, chunks up to the last one, or
+     * everything up to EOF
+     */
+    /* What the cache will not keep need not be copied */
+    cache_fill_init(&cache, fill, storable ? content_length : 0);
+    if (!storable) {
+        fill->abandoned = 1;
+    }
+    /* The cache gets a chunked body de-chunked, see frame_headers() */
+    chunk_scan_init(&chunks, fill_chunk, fill);
+    while (content_length != 0 && !chunks.done) {
+        /* Once the body will not be cached it need not enter user space */
+        if (fill->abandoned && fp == NULL && rio.rio_cnt <= 0 && !nosplice &&
+            content_length != BODY_CHUNKED) {
+            if ((rc = splice_body(connfd, clientfd, content_length)) != 1) {
+                *reusable = rc == 0 && content_length > 0 && keepalive;
+                if (rc == 0) {
+                    metrics_stage(STAGE_RELAY, sent);
+                }
+                return rc;
+            }
+            nosplice = 1; /* Fall back to copying */
+        }
+
+        want = sizeof(buf);
+        if (content_length > 0 && content_length < want) {
+            want = content_length;
+        }
+        if ((n = rio_readb(&rio, buf, want)) < 0) {
+            return -1;
+        } else if (n == 0) {
+            if (content_length != BODY_EOF) {
+                return -1; /* EOF */
+            }
+            metrics_stage(STAGE_RELAY, sent);
+            return 0;
+        }
+
+        body = n;
+        if (content_length == BODY_CHUNKED &&
+            (body = chunk_scan(&chunks, buf, n)) < 0) {
+            return -1;
+        }
+        if (rio_writen(connfd, buf, body) < 0) {
+            return -1;
+        }
+        if (content_length != BODY_CHUNKED) {
+            cache_fill_append(fill, buf, body);
+        }
+        if (fp && !flight_append(&cache.flights, fp, buf, body)) {
+            fp = NULL;
+        }
+        if (body < n) {
+            metrics_stage(STAGE_RELAY, sent);
+            return 0; /* The origin sent more than the response */
+        }
+        if (content_length > 0) {
+            content_length -= n;
+        }
+    }
+
+    /* Anything left buffered is not ours, so the connection is spoiled */
+    *reusable = rio.rio_cnt <= 0 && keepalive;
+    metrics_stage(STAGE_RELAY, sent);
+    return 0;
+}
+
+/*
+ * splice_body - Relay the rest of an uncacheable body from clientfd to
+ *     connfd through this worker's pipe. Returns 0 when done, -1 on
+ *     error, and 1 if splice() is not supported for these descriptors,
+ *     in which case nothing was consumed and the caller copies instead.
+ */
+static int
+splice_body(int connfd, int clientfd, ssize_t content_length)
+{
+    size_t moved = 0;
+
+    if (relay_pipe[0] < 0 && pipe(relay_pipe) < 0) {
+        return 1;
+    }
+    if (rio_splicen(clientfd, connfd, relay_pipe, content_length, &moved) <
+        0) {
+        if (moved == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            return 1;
+        }
+        /* Bytes may be stranded in the pipe, start over with a new one */
+        close(relay_pipe[0]);
+        close(relay_pipe[1]);
+        relay_pipe[0] = relay_pipe[1] = -1;
+        return -1;
+    }
+    return (content_length < 0 || moved == content_length) ? 0 : -1;
+}
+
+/*
+ * response_length - http_body_length() of a response head kept as a
+ *     string, BODY_EOF if it does not parse
+ */
+ssize_t
+response_length(char *headers)
+{
+    HttpHead h;
+
+    http_init(&h);
+    if (http_parse(&h, headers, strlen(headers)) != 1) {
+        return BODY_EOF;
+    }
+    return http_body_length(&h, headers);
+}
+
+/*
+ * response_status - Status code of a response head kept as a string, 0 if
+ *     there is none
+ */
+int
+response_status(char *headers)
+{
+    char *sp = strchr(headers, ' ');
+
+    return sp ? atoi(sp + 1) : 0;
+}
+
+/*
+ * response_persistent - Whether the client connection outlives a response
+ *     with this body length: the client must allow it and the body must
+ *     end without the connection closing. Chunked framing is HTTP/1.1.
+ */
+int
+response_persistent(int client, ssize_t content_length)
+{
+    if (client == CLIENT_CLOSE || content_length == BODY_EOF) {
+        return 0;
+    }
+    return content_length >= 0 || client == CLIENT_HTTP11;
+}
+
+/*
+ * cached_persistent - response_persistent() for a cached response. Only
+ *     an HTTP/1.0 client needs its headers looked at for chunked framing.
+ */
+int
+cached_persistent(int client, CacheObjectPtr op)
+{
+    HttpHead h;
+
+    if (client != CLIENT_KEEPALIVE) {
+        return client == CLIENT_HTTP11;
+    }
+    http_init(&h);
+    if (http_parse(&h, OBJECT_HDRS(op), op->hdr_len) != 1) {
+        return 0;
+    }
+    return http_body_length(&h, OBJECT_HDRS(op)) != BODY_CHUNKED;
+}
+
+/*
+ * connection_header - The Connection header, and the blank line ending the
+ *     headers, to send a client after response headers stripped of theirs
+ */
+char *
+connection_header(int persist)
+{
+    return persist ? "Connection: keep-alive\r\n\r\n"
+                   : "Connection: close\r\n\r\n";
+}
+
+/*
+ * frame_headers - Give response headers whose body ran to EOF, or came
+ *     chunked and was cached de-chunked, the Content-Length of the len
+ *     bytes cached instead, so the cached copy is served on a persistent
+ *     connection with no framing to undo. Returns -1 if that does not fit
+ *     in size bytes, or the body was encoded some other way as well.
+ */
+int
+frame_headers(char *headers, size_t size, size_t len)
+{
+    char framed[MAXLINE];
+    HttpHead h;
+    HttpField *f;
+    size_t n;
+    int i, rc;
+
+    http_init(&h);
+    if (http_parse(&h, headers, strlen(headers)) != 1 ||
+        h.line_end >= sizeof(framed)) {
+        return -1;
+    }
+    memcpy(framed, headers, h.line_end);
+    n = h.line_end;
+    for (i = 0; i < h.nfields; i++) {
+        f = &h.fields[i];
+        if (f->known == HDR_TRANSFER_ENCODING &&
+            (f->value.len != strlen("chunked") ||
+             strncasecmp(headers + f->value.off, "chunked", f->value.len))) {
+            return -1; /* Compressed too, say, which we do not undo */
+        }
+        if (f->known == HDR_TRANSFER_ENCODING ||
+            f->known == HDR_CONTENT_LENGTH) {
+            continue;
+        }
+        if (n + f->end - f->name.off >= sizeof(framed)) {
+            return -1;
+        }
+        memcpy(framed + n, headers + f->name.off, f->end - f->name.off);
+        n += f->end - f->name.off;
+    }
+    rc = snprintf(framed + n, sizeof(framed) - n,
+                  "Content-Length: %zu\r\n\r\n", len);
+    if (rc < 0 || n + rc >= size || n + rc >= sizeof(framed)) {
+        return -1;
+    }
+    memcpy(headers, framed, n + rc + 1);
+    return 0;
+}
+
+/*
+ * fill_chunk - ChunkData callback adding de-chunked data to a CacheFill
+ */
+void
+fill_chunk(void *arg, const char *buf, size_t n)
+{
+    cache_fill_append((CacheFillPtr)arg, buf, n);
+}
 
-    /* Get the content length */
-    if ((ptr = strcasestr(headers, "content-length: "))) {
-        strcpy(buf, ptr);
-        ptr = index(buf, '\r');
-        *ptr = '\0';
-        ptr = index(buf, ' ') + 1;
+/*
+ * forward_response - Send a cached response, headers and body in one
+ *     writev(), or the body with sendfile() if it is on disk. Returns 1
+ *     if the connection can carry another request.
+ */
+int
+forward_response(int connfd, CacheObjectPtr op, int client)
+{
+    struct iovec iov[3];
+    int persist = cached_persistent(client, op);
 
-        if ((content_length = atoi(ptr)) > 0) {
-            *content = malloc(content_length);
-            rio_readnb(&rio, *content, content_length);
+    iov[0].iov_base = OBJECT_HDRS(op);
+    iov[0].iov_len = op->hdr_len - 2; /* Without the blank line */
+    iov[1].iov_base = connection_header(persist);
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    iov[2].iov_base = OBJECT_CONTENT(op);
+    iov[2].iov_len = op->content_length;
+    if (OBJECT_ON_DISK(op)) {
+        if (rio_writevn(connfd, iov, 2) < 0 ||
+            rio_sendfilen(op->fd, op->offset, connfd, op->content_length) <
+                0) {
+            return 0;
         }
+    } else if (rio_writevn(connfd, iov, 3) < 0) {
+        return 0;
+    }
+    return persist;
+}
+
+/*
+ * cache_fresh - Whether a cached response that is fresh until expires
+ *     may be sent for the request in head as is. A client asking for
+ *     no-cache or max-age=0 gets it revalidated first.
+ */
+int
+cache_fresh(HttpHead *req, char *head, time_t expires)
+{
+    long maxage;
+
+    if (http_directive(req, head, HDR_CACHE_CONTROL, "no-cache", NULL) ||
+        http_directive(req, head, HDR_PRAGMA, "no-cache", NULL) ||
+        (http_directive(req, head, HDR_CACHE_CONTROL, "max-age", &maxage) &&
+         maxage == 0)) {
+        return 0;
     }
+    return time(NULL) < expires;
+}
 
-    return content_length;
+/*
+ * response_expiry - Until when the response with headers, as copy_head()
+ *     left them, may be served from the cache, or -1 if it may not be
+ *     cached at all. Unless shared, the request carried credentials, and
+ *     the response is only cached if it says it may go to other clients
+ *     too (RFC 9111 section 3.5).
+ */
+time_t
+response_expiry(char *headers, long heuristic, int shared)
+{
+    HttpHead h;
+    time_t now = time(NULL);
+    long lifetime;
+
+    http_init(&h);
+    if (http_parse(&h, headers, strlen(headers)) != 1 || h.status == 304) {
+        return -1;
+    }
+    if (!shared &&
+        !http_directive(&h, headers, HDR_CACHE_CONTROL, "public", NULL) &&
+        !http_directive(&h, headers, HDR_CACHE_CONTROL, "s-maxage", NULL) &&
+        !http_directive(&h, headers, HDR_CACHE_CONTROL, "must-revalidate",
+                        NULL)) {
+        return -1;
+    }
+    if ((lifetime = http_lifetime(&h, headers, now, heuristic)) < 0) {
+        return -1;
+    }
+    return now + lifetime;
 }
 
+/*
+ * refreshed_expiry - Until when op is fresh again after the origin
+ *     answered its revalidation with the 304 in head. The 304's own
+ *     Cache-Control or Expires win, else op's lifetime starts over.
+ */
+time_t
+refreshed_expiry(HttpHead *resp, char *head, CacheObjectPtr op,
+                 long heuristic)
+{
+    HttpHead h;
+    time_t now = time(NULL);
+    long lifetime = 0;
+
+    if (resp->known[HDR_CACHE_CONTROL] >= 0 || resp->known[HDR_EXPIRES] >= 0) {
+        lifetime = http_lifetime(resp, head, now, heuristic);
+    } else {
+        http_init(&h);
+        if (http_parse(&h, OBJECT_HDRS(op), op->hdr_len) == 1) {
+            lifetime = http_lifetime(&h, OBJECT_HDRS(op), now, heuristic);
+        }
+    }
+    return now + (lifetime > 0 ? lifetime : 0);
+}
+
+/*
+ * publish_object - Give the followers of fp the cached op, when the
+ *     origin confirmed it rather than sending a response they could share
+ */
 void
-forward_response(int connfd, char *headers, char *content, int content_length)
+publish_object(CachePtr cp, FlightPtr fp, CacheObjectPtr op)
 {
-    rio_writen(connfd, headers, strlen(headers));
-    if (content_length != 0) {
-        rio_writen(connfd, content, content_length);
+    char *headers, buf[MAXBUF];
+    size_t done = 0;
+    ssize_t n;
+
+    if ((headers = strndup(OBJECT_HDRS(op), op->hdr_len)) == NULL) {
+        return;
     }
+    if (!flight_headers(&cp->flights, fp, headers, op->content_length)) {
+        free(headers);
+        return;
+    }
+    if (!OBJECT_ON_DISK(op)) {
+        flight_append(&cp->flights, fp, OBJECT_CONTENT(op),
+                      op->content_length);
+    }
+    /* A disk body is copied through in MAXBUF pieces */
+    while (OBJECT_ON_DISK(op) && done < op->content_length) {
+        n = op->content_length - done < sizeof(buf) ? op->content_length - done
+                                                    : sizeof(buf);
+        if ((n = pread(op->fd, buf, n, op->offset + done)) <= 0) {
+            break;
+        }
+        flight_append(&cp->flights, fp, buf, n);
+        done += n;
+    }
+    free(headers);
+}
+
+#ifdef DEBUG
+/*
+ * print_cache_usage - Dump how full the cache is and how well it does
+ */
+void
+print_cache_usage(CachePtr cp)
+{
+    CacheStats st;
+
+    cache_stats(cp, &st);
+    printf("Using: %zu\r\nRemaining: %zu\r\n", cache_size(cp),
+           cp->max_size - cache_size(cp));
+    printf("Hit ratio: %.3f\r\nByte hit ratio: %.3f\r\n",
+           st.hits + st.misses ? (double)st.hits / (st.hits + st.misses) : 0,
+           st.hit_bytes + st.miss_bytes
+               ? (double)st.hit_bytes / (st.hit_bytes + st.miss_bytes)
+               : 0);
 }
+#endif
@@ -0,0 +1,73 @@
+#ifndef PROXY_h
+#define PROXY_h
+
+#include "cache/cache.h"
+#include "cache/disk.h"
+#include "rio/rio.h"
+#include "sock_interface/sock_interface.h"
+#include "dns/dns.h"
+#include "upstream/upstream.h"
+#include "http/http.h"
+#include "scan/scan.h"
+#include "metrics/metrics.h"
+#include "log/log.h"
+
+/* What a client connection allows after the current response */
+#define CLIENT_CLOSE 0     /* Close it */
+#define CLIENT_KEEPALIVE 1 /* HTTP/1.0 keep-alive, only for delimited bodies */
+#define CLIENT_HTTP11 2    /* HTTP/1.1 persistent connection */
+
+#define CLIENT_IDLE_TIMEOUT 5 /* Seconds a client may idle between requests */
+#define CONNECT_TIMEOUT 10    /* Seconds an origin has to accept */
+#define TRANSFER_TIMEOUT 60   /* Seconds a request may go without progress */
+
+#define REQUEST_IOV (HTTP_MAX_FIELDS + 18) /* Most iovecs request_iov() uses */
+
+/* Header fields that are about one connection, never forwarded */
+#define HOP_FIELDS \
+    (1u << HDR_CONNECTION | 1u << HDR_PROXY_CONNECTION | 1u << HDR_KEEP_ALIVE)
+
+/* Request handling shared by the threaded and the event-driven modes */
+void handle_client(int connfd);
+void client_error(int connfd, char *status, char *msg);
+char *read_head(Rio *rp, HttpHead *hp, int timed);
+int client_persistence(HttpHead *hp, char *head);
+int cache_key(HttpHead *hp, char *head, char *key, size_t size);
+int request_shareable(HttpHead *hp, char *head);
+int parse_request(HttpHead *hp, char *head, char *host, char *port,
+                  char *path);
+int parse_uri(const char *uri, size_t len, char *hostname, char *port,
+              char *path);
+int request_iov(HttpHead *hp, char *head, char *path, char *host,
+                CacheObjectPtr stale, struct iovec *iov);
+ssize_t copy_head(HttpHead *hp, char *head, char *buf, size_t size);
+int serve_client(int connfd, int clientfd, struct iovec *request, int iovcnt,
+                 char *headers, CacheObjectPtr stale, int shared,
+                 CacheFillPtr fill, FlightPtr fp, int *persist,
+                 int *reusable);
+ssize_t response_length(char *headers);
+int response_status(char *headers);
+int response_persistent(int client, ssize_t content_length);
+int cached_persistent(int client, CacheObjectPtr op);
+char *connection_header(int persist);
+int frame_headers(char *headers, size_t size, size_t len);
+void fill_chunk(void *arg, const char *buf, size_t n);
+int forward_response(int connfd, CacheObjectPtr op, int client);
+int cache_fresh(HttpHead *req, char *head, time_t expires);
+time_t response_expiry(char *headers, long heuristic, int shared);
+time_t refreshed_expiry(HttpHead *resp, char *head, CacheObjectPtr op,
+                        long heuristic);
+void publish_object(CachePtr cp, FlightPtr fp, CacheObjectPtr op);
+
+/* Header dumps and cache usage on stdout, built with make debug */
+#ifdef DEBUG
+void print_request(struct iovec *iov, int iovcnt);
+void print_response(char *headers);
+void print_cache_usage(CachePtr cp);
+#else
+#define print_request(iov, iovcnt)
+#define print_response(headers)
+#define print_cache_usage(cp)
+#endif
+
+#endif
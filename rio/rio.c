@@ -1,4 +1,9 @@
+#define _GNU_SOURCE
 #include "rio.h"
+#include "../scan/scan.h"
+#include <sys/sendfile.h>
+
+static ssize_t rio_refill(Rio *rp);
 
 /*
  * rio_readn - Robustly read n bytes (unbuffered)
@@ -47,6 +52,38 @@ rio_writen(int fd, void *usrbuf, size_t n)
     return n;
 }
 
+/*
+ * rio_writevn - Robustly write a whole iovec array (unbuffered). The
+ *     array is consumed in place as it is written.
+ */
+ssize_t
+rio_writevn(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t nwritten, total = 0;
+
+    while (iovcnt > 0) {
+        if ((nwritten = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR) /* Interrupted by sig handler return */
+                continue;       /* and call writev() again */
+            else
+                return -1; /* errno set by writev() */
+        }
+        total += nwritten;
+
+        /* Skip the buffers written in full, then trim the partial one */
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return total;
+}
+
 /*
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -58,18 +95,11 @@ rio_writen(int fd, void *usrbuf, size_t n)
 static ssize_t
 rio_read(Rio *rp, char *usrbuf, size_t n)
 {
+    ssize_t rc;
     int cnt;
 
-    while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
-        if (rp->rio_cnt < 0) {
-            if (errno != EINTR) /* Interrupted by sig handler return */
-                return -1;
-        } else if (rp->rio_cnt == 0) /* EOF */
-            return 0;
-        else
-            rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
-    }
+    if ((rc = rio_refill(rp)) <= 0) /* Refill if buf is empty */
+        return rc;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;
@@ -81,6 +111,26 @@ rio_read(Rio *rp, char *usrbuf, size_t n)
     return cnt;
 }
 
+/*
+ * rio_refill - Read into the internal buffer if it is empty. Returns the
+ *     unread bytes then in it, 0 on EOF and -1 on error.
+ */
+static ssize_t
+rio_refill(Rio *rp)
+{
+    while (rp->rio_cnt <= 0) {
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        if (rp->rio_cnt < 0) {
+            if (errno != EINTR) /* Interrupted by sig handler return */
+                return -1;
+        } else if (rp->rio_cnt == 0) /* EOF */
+            return 0;
+        else
+            rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+    }
+    return rp->rio_cnt;
+}
+
 /*
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
@@ -114,29 +164,145 @@ rio_readnb(Rio *rp, void *usrbuf, size_t n)
 }
 
 /*
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readb - Read up to n bytes (buffered), returning as soon as any
+ *     are available
+ */
+ssize_t
+rio_readb(Rio *rp, void *usrbuf, size_t n)
+{
+    return rio_read(rp, usrbuf, n);
+}
+
+/*
+ * rio_fillb - Read more into the internal buffer without consuming
+ *     anything, moving the unread bytes to its front first, so a caller
+ *     can parse them in place at rio_bufptr. Returns the bytes read, 0 on
+ *     EOF, and -1 on error or if the buffer is already full.
+ */
+ssize_t
+rio_fillb(Rio *rp)
+{
+    ssize_t nread;
+
+    if (rp->rio_cnt < 0) /* Left by a failed read */
+        rp->rio_cnt = 0;
+    if (rp->rio_cnt == RIO_BUFSIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+    while ((nread = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                         RIO_BUFSIZE - rp->rio_cnt)) < 0) {
+        if (errno != EINTR) /* Interrupted by sig handler return */
+            return -1;
+    }
+    rp->rio_cnt += nread;
+    return nread;
+}
+
+/*
+ * rio_skipb - Consume n bytes already in the internal buffer. They stay
+ *     where they are until the next read into it.
+ */
+void
+rio_skipb(Rio *rp, size_t n)
+{
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+}
+
+/*
+ * rio_readlineb - Robustly read a text line (buffered). The newline is
+ *     looked for in the buffered bytes a block at a time, not byte by
+ *     byte.
  */
 ssize_t
 rio_readlineb(Rio *rp, void *usrbuf, size_t maxlen)
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) {
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                n++;
-                break;
-            }
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break; /* EOF, some data was read */
-        } else
+    size_t n = 0, cnt;
+    ssize_t rc;
+    const char *nl = NULL;
+    char *bufp = usrbuf;
+
+    while (nl == NULL && n + 1 < maxlen) {
+        if ((rc = rio_refill(rp)) < 0)
             return -1; /* Error */
+        else if (rc == 0)
+            break; /* EOF, maybe after some data */
+
+        cnt = rp->rio_cnt;
+        if (cnt > maxlen - 1 - n)
+            cnt = maxlen - 1 - n;
+        if ((nl = scan_char(rp->rio_bufptr, cnt, '\n')))
+            cnt = nl - rp->rio_bufptr + 1;
+        memcpy(bufp + n, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        n += cnt;
+    }
+    bufp[n] = 0;
+    return n;
+}
+
+/*
+ * rio_splicen - Robustly move n bytes from fromfd to tofd through the pipe
+ *     pipefd with splice(), so they are never copied to user space. A
+ *     negative n moves everything up to EOF. *moved counts the bytes that
+ *     reached tofd. Returns 0 at n bytes or EOF, -1 on error; the pipe is
+ *     always empty again unless an error is returned.
+ */
+int
+rio_splicen(int fromfd, int tofd, int *pipefd, ssize_t n, size_t *moved)
+{
+    ssize_t nin, nout;
+    size_t want;
+
+    while (n < 0 || *moved < n) {
+        want = RIO_PIPESIZE;
+        if (n >= 0 && n - *moved < want) {
+            want = n - *moved;
+        }
+        if ((nin = splice(fromfd, NULL, pipefd[1], NULL, want,
+                          SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1; /* errno set by splice() */
+        } else if (nin == 0)
+            break; /* EOF */
+
+        while (nin > 0) {
+            if ((nout = splice(pipefd[0], NULL, tofd, NULL, nin,
+                               SPLICE_F_MOVE | SPLICE_F_MORE)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            nin -= nout;
+            *moved += nout;
+        }
+    }
+    return 0;
+}
+
+/*
+ * rio_sendfilen - Robustly send the n bytes at offset in the file fromfd
+ *     to tofd with sendfile(), straight from the page cache. Returns 0 once
+ *     they are all sent, -1 on error or if the file is shorter.
+ */
+int
+rio_sendfilen(int fromfd, off_t offset, int tofd, size_t n)
+{
+    ssize_t nsent;
+
+    while (n > 0) {
+        if ((nsent = sendfile(tofd, fromfd, &offset, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1; /* errno set by sendfile() */
+        } else if (nsent == 0)
+            return -1; /* The file ended early */
+        n -= nsent;
     }
-    *bufp = 0;
-    return n - 1;
+    return 0;
 }
@@ -11,6 +11,7 @@
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -26,6 +27,8 @@ typedef struct {
 } Rio;
 /* $end rio_t */
 
+#define RIO_PIPESIZE 65536 /* Bytes moved per splice() */
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */
 extern char **environ; /* Defined by libc */
@@ -33,8 +36,14 @@ extern char **environ; /* Defined by libc */
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writevn(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(Rio *rp, int fd);
 ssize_t rio_readnb(Rio *rp, void *usrbuf, size_t n);
+ssize_t rio_readb(Rio *rp, void *usrbuf, size_t n);
+ssize_t rio_fillb(Rio *rp);
+void rio_skipb(Rio *rp, size_t n);
 ssize_t rio_readlineb(Rio *rp, void *usrbuf, size_t maxlen);
+int rio_splicen(int fromfd, int tofd, int *pipefd, ssize_t n, size_t *moved);
+int rio_sendfilen(int fromfd, off_t offset, int tofd, size_t n);
 
 #endif
@@ -0,0 +1,150 @@
+/*
+ * scan.c - delimiter scanning for the line reader and the header parser.
+ *
+ * Heads are short lines, so most scans cover a few dozen bytes. The SIMD
+ * versions compare a whole block against the delimiter and take the
+ * first match from the movemask; the tail shorter than a block is left to
+ * the next narrower version. Which one scan_char() points at is decided
+ * once, at startup, from what the CPU reports.
+ */
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+static const char *scan_scalar(const char *p, size_t n, int c);
+#ifdef SCAN_X86
+static const char *scan_sse2(const char *p, size_t n, int c);
+static const char *scan_avx2(const char *p, size_t n, int c);
+#endif
+static int scan_supported(void);
+static void scan_init(void) __attribute__((constructor));
+
+const char *(*scan_char)(const char *p, size_t n, int c) = scan_scalar;
+
+/*
+ * scan_select - Use the given implementation, or the best supported one
+ *     below it. Returns the one now in use.
+ */
+int
+scan_select(int level)
+{
+    int best = scan_supported();
+
+    if (level > best) {
+        level = best;
+    }
+    switch (level) {
+#ifdef SCAN_X86
+    case SCAN_AVX2:
+        scan_char = scan_avx2;
+        break;
+    case SCAN_SSE2:
+        scan_char = scan_sse2;
+        break;
+#endif
+    default:
+        level = SCAN_SCALAR;
+        scan_char = scan_scalar;
+    }
+    return level;
+}
+
+const char *
+scan_name(int level)
+{
+    switch (level) {
+    case SCAN_AVX2:
+        return "avx2";
+    case SCAN_SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+static void
+scan_init(void)
+{
+    scan_select(SCAN_AVX2);
+}
+
+static int
+scan_supported(void)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SCAN_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return SCAN_SSE2;
+    }
+#endif
+    return SCAN_SCALAR;
+}
+
+static const char *
+scan_scalar(const char *p, size_t n, int c)
+{
+    const char *end = p + n;
+
+    for (; p < end; p++) {
+        if (*p == (char)c) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2"))) static const char *
+scan_sse2(const char *p, size_t n, int c)
+{
+    __m128i needle = _mm_set1_epi8((char)c);
+    const char *end = p + n;
+    int mask;
+
+    for (; end - p >= 16; p += 16) {
+        mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return scan_scalar(p, end - p, c);
+}
+
+__attribute__((target("avx2"))) static const char *
+scan_avx2(const char *p, size_t n, int c)
+{
+    __m256i needle = _mm256_set1_epi8((char)c);
+    const char *end = p + n;
+    unsigned int mask;
+
+    for (; end - p >= 32; p += 32) {
+        mask = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), needle));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    /* Not through scan_sse2(), mixing in non-VEX code would stall */
+    if (end - p >= 16) {
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)p), _mm256_castsi256_si128(needle)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    for (; p < end; p++) {
+        if (*p == (char)c) {
+            return p;
+        }
+    }
+    return NULL;
+}
+#endif
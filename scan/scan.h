@@ -0,0 +1,20 @@
+#ifndef SCAN_h
+#define SCAN_h
+
+#include <stddef.h>
+
+/* Implementations of scan_char(), from slowest */
+#define SCAN_SCALAR 0
+#define SCAN_SSE2 1 /* 16 bytes at a time */
+#define SCAN_AVX2 2 /* 32 bytes at a time */
+
+/*
+ * scan_char - The first c among the n bytes at p, or NULL. Points at the
+ *     fastest implementation the CPU supports, picked at startup.
+ */
+extern const char *(*scan_char)(const char *p, size_t n, int c);
+
+int scan_select(int level);
+const char *scan_name(int level);
+
+#endif
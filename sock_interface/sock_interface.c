@@ -40,8 +40,27 @@ open_clientfd(char *hostname, char *port)
     }
 }
 
+static int open_listenfd_opts(char *port, int reuseport);
+
 int
 open_listenfd(char *port)
+{
+    return open_listenfd_opts(port, 0);
+}
+
+/*
+ * open_listenfd_reuseport - Open a listening socket with SO_REUSEPORT set.
+ *     Every call binds another socket to the same port, and the kernel
+ *     spreads incoming connections across all of them.
+ */
+int
+open_listenfd_reuseport(char *port)
+{
+    return open_listenfd_opts(port, 1);
+}
+
+static int
+open_listenfd_opts(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, optval = 1, rc;
@@ -67,6 +86,12 @@ open_listenfd(char *port)
         /* Eliminates "Adress already in use" error from bind */
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval,
                    sizeof(int));
+        if (reuseport &&
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
 
         /* Bind the discriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
@@ -89,3 +114,17 @@ open_listenfd(char *port)
 
     return listenfd;
 }
+
+/*
+ * set_nonblocking - Put fd in non-blocking mode
+ */
+int
+set_nonblocking(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
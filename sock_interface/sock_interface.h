@@ -24,5 +24,7 @@ extern char **environ; /* Defined by libc */
 
 int open_clientfd(char *hostname, char *port);
 int open_listenfd(char *port);
+int open_listenfd_reuseport(char *port);
+int set_nonblocking(int fd);
 
 #endif
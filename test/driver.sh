@@ -14,6 +14,8 @@
 MAX_BASIC=40
 MAX_CONCURRENCY=15
 MAX_CACHE=15
+MAX_CHUNKED=10
+MAX_FRESHNESS=10
 
 # Various constants
 HOME_DIR=`pwd`
@@ -103,6 +105,72 @@ function download_noproxy {
     cd $HOME_DIR
 }
 
+#
+# download_pipelined - send the requests for two origin urls through the
+#     proxy in one write on one connection, and save both bodies one after
+#     the other
+# usage: download_pipelined <testdir> <filename> <origin_url1> <origin_url2> <proxy_port>
+#
+function download_pipelined {
+    cd $1
+    timeout ${TIMEOUT} python3 - $3 $4 $5 > $2 <<'EOF'
+import http.client, socket, sys
+
+# Both responses are read off one buffered stream, kept open between them
+class Stream:
+    def __init__(self, f):
+        self.f = f
+        self.f.close = lambda: None
+    def makefile(self, *args, **kwargs):
+        return self.f
+
+sock = socket.create_connection(("localhost", int(sys.argv[3])))
+sock.sendall(("GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n"
+              "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n"
+              % (sys.argv[1], sys.argv[2])).encode())
+stream = Stream(sock.makefile("rb"))
+for i in range(2):
+    response = http.client.HTTPResponse(stream)
+    response.begin()
+    sys.stdout.buffer.write(response.read())
+EOF
+    (( $? == 124 )) && echo -e "Error: Fetch timed out after ${TIMEOUT} seconds"
+    cd $HOME_DIR
+}
+
+#
+# origin_count - how many requests the script server got for a path
+# usage: origin_count <script_port> <path>
+#
+function origin_count {
+    curl --max-time ${TIMEOUT} --silent "http://localhost:$1/count$2"
+}
+
+#
+# fetch_twice - fetch an origin url through the proxy twice, and tell
+#     whether the origin got the expected number of requests for it
+# usage: fetch_twice <script_port> <path> <proxy_url> <expected count>
+#
+function fetch_twice {
+    download_proxy $PROXY_DIR "fresh" "http://localhost:$1$2" $3
+    download_proxy $PROXY_DIR "fresh" "http://localhost:$1$2" $3
+    [ "$(origin_count $1 $2)" == "$4" ]
+}
+
+#
+# report - count a test run and tell whether it succeeded
+# usage: report <status> <success message> <failure message>
+#
+function report {
+    numRun=`expr $numRun + 1`
+    if [ $1 -eq 0 ]; then
+        numSucceeded=`expr ${numSucceeded} + 1`
+        echo -e "   \e[1;32mSuccess\e[1;0m: $2"
+    else
+        echo -e "   \e[1;31mFailure\e[1;0m: $3"
+    fi
+}
+
 #
 # clear_dirs - Clear the download directories
 #
@@ -187,7 +255,7 @@ function free_port {
 #
 
 # Kill any stray proxies or tiny servers owned by this user
-killall -q proxy tiny test/nop-server.py 2> /dev/null
+killall -q proxy tiny test/nop-server.py test/script-server.py 2> /dev/null
 
 # Make sure we have a Tiny directory
 if [ ! -d ./tiny ]
@@ -233,6 +301,13 @@ then
     exit
 fi
 
+# Make sure we have an existing executable test/script-server.py file
+if [ ! -x ./test/script-server.py ]
+then 
+    echo -e "Error: ./test/script-server.py not found or not an executable file."
+    exit
+fi
+
 # Create the test directories if needed
 if [ ! -d ${PROXY_DIR} ]
 then
@@ -466,9 +541,178 @@ wait $proxy_pid 2> /dev/null
 
 echo -e "cacheScore: $cacheScore/${MAX_CACHE}"
 
+#####
+# Chunked
+#
+echo -e ""
+echo -e "*** Chunked ***"
+
+# Run the server with canned chunked responses
+script_port=$(free_port)
+echo -e "Starting the script server on port ${script_port}"
+python3 ./test/script-server.py ${script_port} &> /dev/null &
+script_pid=$!
+
+# Wait for the script server to start in earnest
+wait_for_port_use "${script_port}"
+
+# Run the proxy
+proxy_port=$(free_port)
+echo -e "Starting proxy on port ${proxy_port}"
+./proxy ${proxy_port} &> /dev/null &
+proxy_pid=$!
+
+# Wait for the proxy to start in earnest
+wait_for_port_use "${proxy_port}"
+
+script_url="http://localhost:${script_port}"
+proxy_url="http://localhost:${proxy_port}"
+numRun=0
+numSucceeded=0
+clear_dirs
+
+# A miss relayed chunked, then the hit it left in the cache: the second
+# only comes out right if the first ended exactly where its framing says
+echo -e "1: Pipelined pair"
+download_pipelined $PROXY_DIR "pipelined" "${script_url}/chunked/ext" "${script_url}/chunked/ext" ${proxy_port}
+printf "hello, chunked world\nhello, chunked world\n" > ${NOPROXY_DIR}/pipelined
+diff -q ${PROXY_DIR}/pipelined ${NOPROXY_DIR}/pipelined &> /dev/null
+report $? "Both bodies are intact." "The bodies differ."
+
+echo -e "2: Chunk extensions and trailers"
+download_proxy $PROXY_DIR "ext" "${script_url}/chunked/ext" "${proxy_url}"
+printf "hello, chunked world\n" > ${NOPROXY_DIR}/ext
+diff -q ${PROXY_DIR}/ext ${NOPROXY_DIR}/ext &> /dev/null
+report $? "Files are identical." "Files differ."
+
+echo -e "3: Cached copy of a chunked response"
+curl --max-time ${TIMEOUT} --silent --dump-header ${PROXY_DIR}/ext.hdrs \
+    --output /dev/null --proxy ${proxy_url} "${script_url}/chunked/ext"
+grep -qi "^Content-Length: 21" ${PROXY_DIR}/ext.hdrs &&
+    [ "$(origin_count ${script_port} /chunked/ext)" == "1" ]
+report $? "Served from the cache, de-chunked." "Not served from the cache, de-chunked."
+
+# Deliberately lenient: an empty size line ends the body like "0"
+echo -e "4: Empty size line"
+download_proxy $PROXY_DIR "empty" "${script_url}/chunked/empty" "${proxy_url}"
+printf "hello" > ${NOPROXY_DIR}/empty
+diff -q ${PROXY_DIR}/empty ${NOPROXY_DIR}/empty &> /dev/null
+report $? "Taken for the last chunk." "Files differ."
+
+echo -e "5: Malformed size line"
+download_proxy $PROXY_DIR "bad" "${script_url}/chunked/bad" "${proxy_url}"
+download_proxy $PROXY_DIR "bad" "${script_url}/chunked/bad" "${proxy_url}"
+[ "$(origin_count ${script_port} /chunked/bad)" == "2" ]
+report $? "The broken body was not cached." "The broken body was cached."
+
+echo -e "6: Malformed Content-Length"
+download_proxy $PROXY_DIR "length" "${script_url}/length/bad" "${proxy_url}"
+download_proxy $PROXY_DIR "length" "${script_url}/length/bad" "${proxy_url}"
+[ "$(origin_count ${script_port} /length/bad)" == "2" ]
+report $? "The response was not cached." "The response was cached."
+
+echo -e "Killing the script server and proxy"
+kill $script_pid 2> /dev/null
+wait $script_pid 2> /dev/null
+kill $proxy_pid 2> /dev/null
+wait $proxy_pid 2> /dev/null
+
+chunkedScore=`expr ${MAX_CHUNKED} \* ${numSucceeded} / ${numRun}`
+
+echo -e "chunkedScore: $chunkedScore/${MAX_CHUNKED}"
+
+#####
+# Freshness
+#
+echo -e ""
+echo -e "*** Freshness ***"
+
+# Run the server with canned responses
+script_port=$(free_port)
+echo -e "Starting the script server on port ${script_port}"
+python3 ./test/script-server.py ${script_port} &> /dev/null &
+script_pid=$!
+
+# Wait for the script server to start in earnest
+wait_for_port_use "${script_port}"
+
+# Run the proxy
+proxy_port=$(free_port)
+echo -e "Starting proxy on port ${proxy_port}"
+./proxy ${proxy_port} &> /dev/null &
+proxy_pid=$!
+
+# Wait for the proxy to start in earnest
+wait_for_port_use "${proxy_port}"
+
+script_url="http://localhost:${script_port}"
+proxy_url="http://localhost:${proxy_port}"
+numRun=0
+numSucceeded=0
+clear_dirs
+
+echo -e "1: max-age over Expires"
+fetch_twice ${script_port} /fresh/max-age ${proxy_url} 1
+report $? "Still fresh, served from the cache." "Fetched again."
+
+echo -e "2: s-maxage over max-age"
+fetch_twice ${script_port} /fresh/s-maxage ${proxy_url} 2
+report $? "Already stale, fetched again." "Served from the cache."
+
+echo -e "3: Expires against Date"
+fetch_twice ${script_port} /fresh/expires ${proxy_url} 1
+report $? "Still fresh, served from the cache." "Fetched again."
+
+echo -e "4: Age over max-age"
+fetch_twice ${script_port} /fresh/age ${proxy_url} 2
+report $? "Already stale, fetched again." "Served from the cache."
+
+# Fresh for a second, after which the origin answers If-None-Match with a
+# 304 that makes it fresh for a minute
+echo -e "5: Revalidation"
+download_proxy $PROXY_DIR "etag" "${script_url}/etag" "${proxy_url}"
+sleep 2
+download_proxy $PROXY_DIR "etag" "${script_url}/etag" "${proxy_url}"
+download_proxy $NOPROXY_DIR "etag" "${script_url}/etag" "${proxy_url}"
+printf "fresh\n" > ${NOPROXY_DIR}/expected
+diff -q ${PROXY_DIR}/etag ${NOPROXY_DIR}/expected &> /dev/null &&
+    diff -q ${NOPROXY_DIR}/etag ${NOPROXY_DIR}/expected &> /dev/null &&
+    [ "$(origin_count ${script_port} /etag)" == "2" ] &&
+    [ "$(curl --max-time ${TIMEOUT} --silent "${script_url}/count304/etag")" == "1" ]
+report $? "Refreshed by a 304, then served from the cache." "Not refreshed by a 304."
+
+# A response to a request with credentials may be for that client alone
+echo -e "6: Credentials"
+curl --max-time ${TIMEOUT} --silent --proxy ${proxy_url} -H "Authorization: Basic dXNlcjpwdw==" \
+    --output ${PROXY_DIR}/private "${script_url}/private"
+download_proxy $PROXY_DIR "private" "${script_url}/private" "${proxy_url}"
+printf "nobody\n" > ${NOPROXY_DIR}/private
+diff -q ${PROXY_DIR}/private ${NOPROXY_DIR}/private &> /dev/null &&
+    [ "$(origin_count ${script_port} /private)" == "2" ]
+report $? "Not served to another client." "Served to another client."
+
+echo -e "7: Credentials with public"
+curl --max-time ${TIMEOUT} --silent --proxy ${proxy_url} -H "Authorization: Basic dXNlcjpwdw==" \
+    --output ${PROXY_DIR}/public "${script_url}/private/public"
+download_proxy $PROXY_DIR "public" "${script_url}/private/public" "${proxy_url}"
+printf "secret\n" > ${NOPROXY_DIR}/public
+diff -q ${PROXY_DIR}/public ${NOPROXY_DIR}/public &> /dev/null &&
+    [ "$(origin_count ${script_port} /private/public)" == "1" ]
+report $? "Shared, as it says public." "Not shared."
+
+echo -e "Killing the script server and proxy"
+kill $script_pid 2> /dev/null
+wait $script_pid 2> /dev/null
+kill $proxy_pid 2> /dev/null
+wait $proxy_pid 2> /dev/null
+
+freshnessScore=`expr ${MAX_FRESHNESS} \* ${numSucceeded} / ${numRun}`
+
+echo -e "freshnessScore: $freshnessScore/${MAX_FRESHNESS}"
+
 # Emit the total score
-totalScore=`expr ${basicScore} + ${cacheScore} + ${concurrencyScore}`
-maxScore=`expr ${MAX_BASIC} + ${MAX_CACHE} + ${MAX_CONCURRENCY}`
+totalScore=`expr ${basicScore} + ${cacheScore} + ${concurrencyScore} + ${chunkedScore} + ${freshnessScore}`
+maxScore=`expr ${MAX_BASIC} + ${MAX_CACHE} + ${MAX_CONCURRENCY} + ${MAX_CHUNKED} + ${MAX_FRESHNESS}`
 echo -e ""
 echo -e "totalScore: ${totalScore}/${maxScore}"
 exit
@@ -0,0 +1,115 @@
+#!/usr/bin/python3
+
+# script-server.py - This is a server that answers with canned responses
+#                    for the chunked, freshness and credentials tests.
+#                    It counts the requests for every path, and reports
+#                    the count for /count/<path>, and how many of them it
+#                    answered with a 304 for /count304/<path>.
+#
+# usage: script-server.py <port>
+#
+import email.utils
+import socket
+import sys
+import threading
+import time
+
+counts = {}
+not_modified = {}
+lock = threading.Lock()
+
+def date(offset):
+  return email.utils.formatdate(time.time() + offset, usegmt=True).encode()
+
+def chunked(body):
+  return (b"HTTP/1.1 200 OK\r\n"
+          b"Transfer-Encoding: chunked\r\n"
+          b"Cache-Control: max-age=60\r\n"
+          b"Connection: close\r\n\r\n" + body)
+
+def fresh(headers):
+  return (b"HTTP/1.1 200 OK\r\n"
+          b"Date: " + date(0) + b"\r\n" + headers +
+          b"Content-Length: 6\r\n"
+          b"Connection: close\r\n\r\nfresh\n")
+
+RESPONSES = {
+  # Chunk extensions on every size line, and trailers after the last one
+  "/chunked/ext": chunked(b"7;name=value\r\nhello, \r\n"
+                          b"e;quoted=\"a b\";flag\r\nchunked world\n\r\n"
+                          b"0;last\r\nX-Trailer: one\r\nX-Other: two\r\n\r\n"),
+  # An empty size line ends the body like a last chunk
+  "/chunked/empty": chunked(b"5\r\nhello\r\n\r\n\r\n"),
+  # A size line that is no size at all
+  "/chunked/bad": chunked(b"5\r\nhello\r\nzz\r\nworld\r\n0\r\n\r\n"),
+  # A Content-Length that is no number
+  "/length/bad": (b"HTTP/1.1 200 OK\r\n"
+                  b"Content-Length: 5abc\r\n"
+                  b"Cache-Control: max-age=60\r\n"
+                  b"Connection: close\r\n\r\nhello"),
+}
+
+# Built for every request, as they depend on the time
+FRESH = {
+  # max-age wins over Expires
+  "/fresh/max-age": lambda: fresh(b"Cache-Control: max-age=60\r\n"
+                                  b"Expires: " + date(-60) + b"\r\n"),
+  # s-maxage wins over max-age in a shared cache
+  "/fresh/s-maxage": lambda: fresh(b"Cache-Control: max-age=60, s-maxage=0\r\n"),
+  # Expires alone counts from Date
+  "/fresh/expires": lambda: fresh(b"Expires: " + date(60) + b"\r\n"),
+  # Age is time already spent in other caches
+  "/fresh/age": lambda: fresh(b"Cache-Control: max-age=60\r\nAge: 120\r\n"),
+}
+
+def respond(path, head):
+  if path.startswith("/count/") or path.startswith("/count304/"):
+    with lock:
+      if path.startswith("/count/"):
+        body = b"%d\n" % counts.get(path[6:], 0)
+      else:
+        body = b"%d\n" % not_modified.get(path[9:], 0)
+    return (b"HTTP/1.0 200 OK\r\nCache-Control: no-store\r\n"
+            b"Content-Length: %d\r\n\r\n" % len(body) + body)
+  with lock:
+    counts[path] = counts.get(path, 0) + 1
+  if path in RESPONSES:
+    return RESPONSES[path]
+  if path in FRESH:
+    return FRESH[path]()
+  if path == "/etag":
+    # Fresh for a second, then confirmed for a minute while the tag matches
+    if b'if-none-match: "v1"' in head.lower():
+      with lock:
+        not_modified[path] = not_modified.get(path, 0) + 1
+      return (b"HTTP/1.1 304 Not Modified\r\nETag: \"v1\"\r\n"
+              b"Cache-Control: max-age=60\r\nConnection: close\r\n\r\n")
+    return fresh(b"ETag: \"v1\"\r\nCache-Control: max-age=1\r\n")
+  if path.startswith("/private"):
+    # A body for whoever sent credentials, fresh for a minute and shared
+    # only where it says public
+    body = b"secret\n" if b"\r\nauthorization:" in head.lower() else b"nobody\n"
+    public = b", public" if path == "/private/public" else b""
+    return (b"HTTP/1.1 200 OK\r\nCache-Control: max-age=60" + public +
+            b"\r\nContent-Length: 7\r\nConnection: close\r\n\r\n" + body)
+  return b"HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n"
+
+def serve(channel):
+  head = b""
+  while b"\r\n\r\n" not in head:
+    data = channel.recv(4096)
+    if not data:
+      channel.close()
+      return
+    head += data
+  channel.sendall(respond(head.split(b" ")[1].decode(), head))
+  channel.close()
+
+serversocket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+serversocket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+serversocket.bind(('', int(sys.argv[1])))
+serversocket.listen(5)
+
+while 1:
+  channel, details = serversocket.accept()
+  threading.Thread(target=serve, args=(channel,), daemon=True).start()
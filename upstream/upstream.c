@@ -0,0 +1,339 @@
+/*
+ * upstream.c - persistent connections to origin servers: the pool of idle
+ *     ones, and the response framing that tells when one can go back in.
+ *
+ * A connection is pooled under "host:port" with the time it went idle.
+ * upstream_get() hands out the most recently used one that is still
+ * within the idle timeout and still open; anything else found on the way
+ * is closed. The whole pool is swept for expired connections at most
+ * once a second, from whichever call comes along.
+ */
+#define _GNU_SOURCE
+#include "upstream.h"
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* chunk_scan() states */
+#define CS_SIZE_START 0    /* Start of a size line */
+#define CS_SIZE 1          /* Chunk size, in hex */
+#define CS_EXT 2           /* Rest of the size line */
+#define CS_DATA 3          /* Chunk data */
+#define CS_DATA_END 4      /* CRLF after the data */
+#define CS_TRAILER_START 5 /* Start of a trailer line, or the final CRLF */
+#define CS_TRAILER 6       /* Rest of a trailer line */
+#define CS_FINAL 7         /* LF of the final CRLF */
+
+static UpstreamHost **find_host(UpstreamPoolPtr up, const char *key);
+static void make_key(char *key, size_t size, char *host, char *port);
+static void sweep(UpstreamPoolPtr up, time_t now);
+static int alive(int fd);
+static time_t now_sec(void);
+
+void
+upstream_init(UpstreamPoolPtr up, int max_idle, int idle_timeout)
+{
+    memset(up->buckets, 0, sizeof(up->buckets));
+    up->max_idle = max_idle;
+    up->idle_timeout = idle_timeout;
+    up->last_sweep = now_sec();
+    pthread_mutex_init(&up->lock, NULL);
+}
+
+/*
+ * upstream_get - Take an idle connection to host:port out of the pool.
+ *     Returns -1 if there is none that is still usable.
+ */
+int
+upstream_get(UpstreamPoolPtr up, char *host, char *port)
+{
+    char key[NI_MAXHOST + NI_MAXSERV];
+    time_t now = now_sec();
+    UpstreamHost **hpp, *hp;
+    UpstreamConn *uc;
+    int fd;
+
+    if (up->max_idle == 0) {
+        return -1;
+    }
+    make_key(key, sizeof(key), host, port);
+
+    while (1) {
+        pthread_mutex_lock(&up->lock);
+        sweep(up, now);
+        hpp = find_host(up, key);
+        if ((hp = *hpp) == NULL || (uc = hp->idle) == NULL) {
+            pthread_mutex_unlock(&up->lock);
+            return -1;
+        }
+        hp->idle = uc->next;
+        hp->nidle--;
+        pthread_mutex_unlock(&up->lock);
+
+        fd = uc->fd;
+        free(uc);
+        if (alive(fd)) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+/*
+ * upstream_put - Return a connection to host:port whose last response was
+ *     read completely. It is closed instead if the origin already has
+ *     max_idle idle connections.
+ */
+void
+upstream_put(UpstreamPoolPtr up, char *host, char *port, int fd)
+{
+    char key[NI_MAXHOST + NI_MAXSERV];
+    time_t now = now_sec();
+    UpstreamHost **hpp, *hp;
+    UpstreamConn *uc;
+
+    if (up->max_idle == 0 || (uc = malloc(sizeof(UpstreamConn))) == NULL) {
+        close(fd);
+        return;
+    }
+    uc->fd = fd;
+    uc->idle_since = now;
+    make_key(key, sizeof(key), host, port);
+
+    pthread_mutex_lock(&up->lock);
+    sweep(up, now);
+    hpp = find_host(up, key);
+    if ((hp = *hpp) == NULL) {
+        if ((hp = calloc(1, sizeof(UpstreamHost))) == NULL ||
+            (hp->key = strdup(key)) == NULL) {
+            pthread_mutex_unlock(&up->lock);
+            free(hp);
+            free(uc);
+            close(fd);
+            return;
+        }
+        *hpp = hp;
+    }
+    if (hp->nidle >= up->max_idle) {
+        pthread_mutex_unlock(&up->lock);
+        free(uc);
+        close(fd);
+        return;
+    }
+    uc->next = hp->idle;
+    hp->idle = uc;
+    hp->nidle++;
+    pthread_mutex_unlock(&up->lock);
+}
+
+/*
+ * upstream_keepalive - Whether the origin lets the connection be reused
+ *     after the response with this head: HTTP/1.1 unless it says
+ *     "Connection: close", HTTP/1.0 only if it says "keep-alive".
+ *     Interim 1xx responses never count.
+ */
+int
+upstream_keepalive(HttpHead *hp, const char *head)
+{
+    if (hp->minor < 0 || hp->status < 200) {
+        return 0;
+    }
+    if (http_has_token(hp, head, HDR_CONNECTION, "close")) {
+        return 0;
+    }
+    return hp->minor >= 1 ||
+           http_has_token(hp, head, HDR_CONNECTION, "keep-alive");
+}
+
+void
+chunk_scan_init(ChunkScanPtr cs, ChunkData data, void *arg)
+{
+    cs->state = CS_SIZE_START;
+    cs->left = 0;
+    cs->done = 0;
+    cs->data = data;
+    cs->arg = arg;
+}
+
+/*
+ * chunk_scan - Follow the chunked framing over the next n body bytes.
+ *     Returns how many of them belong to the body; fewer than n only once
+ *     the body ended inside buf, which sets cs->done. Returns -1 if the
+ *     framing is malformed. The chunk data found on the way, de-chunked,
+ *     goes to cs->data if there is one, in as many pieces as it takes.
+ *
+ *     An empty size line is taken for the last chunk, as some origins end
+ *     a body with a bare CRLF; a size line that starts with anything but
+ *     a hex digit or the line end is malformed.
+ */
+ssize_t
+chunk_scan(ChunkScanPtr cs, const char *buf, size_t n)
+{
+    size_t i = 0, take;
+    char c;
+    int digit;
+
+    while (i < n && !cs->done) {
+        if (cs->state == CS_DATA) {
+            take = n - i < cs->left ? n - i : cs->left;
+            if (cs->data) {
+                cs->data(cs->arg, buf + i, take);
+            }
+            i += take;
+            if ((cs->left -= take) == 0) {
+                cs->state = CS_DATA_END;
+            }
+            continue;
+        }
+
+        c = buf[i++];
+        switch (cs->state) {
+        case CS_SIZE_START:
+        case CS_SIZE:
+            if (c >= '0' && c <= '9') {
+                digit = c - '0';
+            } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+                digit = (c | 0x20) - 'a' + 10;
+            } else if (c == '\n') {
+                cs->state = cs->left ? CS_DATA : CS_TRAILER_START;
+                break;
+            } else if (cs->state == CS_SIZE_START && c != '\r') {
+                return -1; /* No size at all */
+            } else {
+                cs->state = CS_EXT; /* CR, or a chunk extension */
+                break;
+            }
+            if (cs->left > SIZE_MAX >> 4) {
+                return -1;
+            }
+            cs->left = (cs->left << 4) | digit;
+            cs->state = CS_SIZE;
+            break;
+        case CS_EXT:
+            if (c == '\n') {
+                cs->state = cs->left ? CS_DATA : CS_TRAILER_START;
+            }
+            break;
+        case CS_DATA_END:
+            if (c == '\n') {
+                cs->state = CS_SIZE_START;
+            } else if (c != '\r') {
+                return -1;
+            }
+            break;
+        case CS_TRAILER_START:
+            if (c == '\n') {
+                cs->done = 1;
+            } else {
+                cs->state = c == '\r' ? CS_FINAL : CS_TRAILER;
+            }
+            break;
+        case CS_TRAILER:
+            if (c == '\n') {
+                cs->state = CS_TRAILER_START;
+            }
+            break;
+        case CS_FINAL:
+            if (c != '\n') {
+                return -1;
+            }
+            cs->done = 1;
+            break;
+        }
+    }
+    return i;
+}
+
+static UpstreamHost **
+find_host(UpstreamPoolPtr up, const char *key)
+{
+    unsigned long hash = 5381;
+    const char *p;
+    UpstreamHost **hpp;
+
+    for (p = key; *p; p++) {
+        hash = hash * 33 + (unsigned char)*p;
+    }
+    hpp = &up->buckets[hash % UPSTREAM_BUCKETS];
+    while (*hpp && strcmp((*hpp)->key, key)) {
+        hpp = &(*hpp)->next;
+    }
+    return hpp;
+}
+
+static void
+make_key(char *key, size_t size, char *host, char *port)
+{
+    snprintf(key, size, "%s:%s", host, port);
+}
+
+/*
+ * sweep - Close the connections that have been idle too long, and forget
+ *     origins left with none. Called with up->lock held.
+ */
+static void
+sweep(UpstreamPoolPtr up, time_t now)
+{
+    UpstreamHost **hpp, *hp;
+    UpstreamConn **ucp, *uc;
+    int i;
+
+    if (now - up->last_sweep < 1) {
+        return;
+    }
+    up->last_sweep = now;
+
+    for (i = 0; i < UPSTREAM_BUCKETS; i++) {
+        hpp = &up->buckets[i];
+        while ((hp = *hpp)) {
+            /* Newest first, so the expired ones are a tail */
+            for (ucp = &hp->idle; *ucp; ucp = &(*ucp)->next) {
+                if (now - (*ucp)->idle_since >= up->idle_timeout) {
+                    break;
+                }
+            }
+            while ((uc = *ucp)) {
+                *ucp = uc->next;
+                close(uc->fd);
+                free(uc);
+                hp->nidle--;
+            }
+
+            if (hp->idle == NULL) {
+                *hpp = hp->next;
+                free(hp->key);
+                free(hp);
+            } else {
+                hpp = &hp->next;
+            }
+        }
+    }
+}
+
+/*
+ * alive - An idle connection is usable if it has neither been closed by
+ *     the origin nor received anything unasked
+ */
+static int
+alive(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static time_t
+now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
@@ -0,0 +1,61 @@
+#ifndef UPSTREAM_h
+#define UPSTREAM_h
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "../http/http.h"
+
+#define UPSTREAM_MAX_IDLE 8      /* Idle connections kept per origin */
+#define UPSTREAM_IDLE_TIMEOUT 30 /* Seconds an idle connection is kept */
+#define UPSTREAM_BUCKETS 256
+
+/* An idle connection to an origin */
+typedef struct upstream_conn {
+    int fd;
+    time_t idle_since;
+    struct upstream_conn *next;
+} UpstreamConn;
+
+typedef struct upstream_host {
+    char *key;          /* "host:port" */
+    UpstreamConn *idle; /* Most recently returned first */
+    int nidle;
+    struct upstream_host *next;
+} UpstreamHost;
+
+/*
+ * Idle persistent connections to origin servers, keyed by host and port
+ * and shared by every thread. Connections go back in only once their
+ * response has been read to the end of its framing.
+ */
+typedef struct upstream_pool {
+    pthread_mutex_t lock;
+    UpstreamHost *buckets[UPSTREAM_BUCKETS];
+    int max_idle;     /* Per origin, 0 disables pooling */
+    int idle_timeout; /* Seconds */
+    time_t last_sweep;
+} UpstreamPool, *UpstreamPoolPtr;
+
+/* Gets the chunk data chunk_scan() passes over, without the framing */
+typedef void (*ChunkData)(void *arg, const char *buf, size_t n);
+
+/* Where a chunked body stands, see chunk_scan() */
+typedef struct chunk_scan {
+    int state;
+    size_t left; /* Data bytes left in the current chunk */
+    int done;    /* The last chunk and the trailers have been seen */
+    ChunkData data;
+    void *arg;
+} ChunkScan, *ChunkScanPtr;
+
+void upstream_init(UpstreamPoolPtr up, int max_idle, int idle_timeout);
+int upstream_get(UpstreamPoolPtr up, char *host, char *port);
+void upstream_put(UpstreamPoolPtr up, char *host, char *port, int fd);
+int upstream_keepalive(HttpHead *hp, const char *head);
+
+void chunk_scan_init(ChunkScanPtr cs, ChunkData data, void *arg);
+ssize_t chunk_scan(ChunkScanPtr cs, const char *buf, size_t n);
+
+#endif